@@ -1,9 +1,11 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -16,11 +18,30 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "server/protocol.h"
+
 #define COLUMN 10
 #define ROW 12
+// a relay server of a cluster sends this and the "host:port" of the server owning the key instead of pairing
+#define REDIRECT_PREFIX "REDIRECT "
+// a relay server sends this and the reason when it turns a player away, then hangs up
+#define ERROR_PREFIX "error: "
+// redirects followed for one handshake before giving up, the servers of a cluster never send more than one
+#define MAX_REDIRECTS 4
+#define MESSAGE_LEN 32
+#define ARENA_BLOCK 65536
+#define GRID_CACHE_LEN 256
+// the characters of one line of a cell, without the "| " before it and the " " after it
+#define CELL_WIDTH 7
+// a board is "| " cell " " per column and the closing "|" wide
+#define GRID_WIDTH ((CELL_WIDTH + 3) * COLUMN + 1)
+// a row of cells is at most "| " "\e[100m" "       " "\e[0m" " " per cell and the closing "|"
+#define GRID_LINE_LEN (20 * COLUMN + 2)
 
 struct termios old_terminal_attr;
 int socket_fd = -1;
+// written to by the SIGWINCH handler to wake the main loop up
+int winch_pipe[2] = { -1, -1 };
 
 const char* cells[][3] = {
 	{ // empty
@@ -135,10 +156,69 @@ typedef struct Vec2 {
 } Vec2;
 
 typedef struct Buffer {
-	char** ptr;
+	// the lines one after another, each ends with '\0'
+	char* data;
+	// where each line starts in `data`
+	size_t* lines;
 	Size size;
 } Buffer;
 
+// a bump allocator for the buffers of a frame, reset once the frame is drawn
+typedef struct Arena {
+	char* ptr;
+	size_t len;
+	size_t cap;
+	// where the buffer being written starts, it is moved to the new block when this one fills up
+	size_t mark;
+	// the blocks that filled up during this frame, the buffers in them stay in use until the reset
+	char* full[32];
+	size_t full_len;
+} Arena;
+
+// a growable string, kept between frames so it stops allocating once it has grown to the size of one
+typedef struct StringBuilder {
+	char* ptr;
+	size_t len;
+	size_t cap;
+} StringBuilder;
+
+// one character on the terminal and the sgr attributes it is drawn with
+typedef struct ScreenCell {
+	char ch;
+	bool reverse;
+	// the sgr code of the background, 0 for the default one
+	uint8_t background;
+} ScreenCell;
+
+// what the terminal shows, kept so a frame only has to write the cells that changed
+typedef struct Screen {
+	ScreenCell* cells;
+	ScreenCell* next;
+	Size size;
+	// false until the first frame and after a resize, the terminal is cleared before the frame is drawn
+	bool drawn;
+	// the escape sequences of a frame
+	StringBuilder out;
+} Screen;
+
+Screen screen = {0};
+// the output of ui_wrapper
+StringBuilder frame_builder = {0};
+// every buffer a frame is composed of
+Arena frame_arena = {0};
+
+// the three lines of text a row of board cells is drawn as
+typedef struct GridRow {
+	bool used;
+	// the cells of the row, then the columns of the cursor and of the preparing cursor, 0xff when they are not on it
+	uint8_t key[COLUMN + 2];
+	char lines[3][GRID_LINE_LEN];
+	size_t lens[3];
+} GridRow;
+
+// rows by the hash of their key, most rows of a board look the same from one frame to the next
+GridRow grid_cache[GRID_CACHE_LEN];
+
 typedef enum Page {
 	Greeting = 0,
 	DirectConnect,
@@ -151,6 +231,7 @@ typedef enum Page {
 	WaitingRelayServer,
 	WaitingOtherPlayer,
 	Game,
+	Spectating,
 	End,
 	Error,
 } Page;
@@ -197,6 +278,8 @@ typedef enum ConnectRelayServerSelection {
 typedef enum EnterRelayServerKeySelection {
 	EnterRelayServerKeyInput = SELECTION_INPUT,
 	EnterRelayServerKeySend,
+	EnterRelayServerKeyMatch,
+	EnterRelayServerKeyWatch,
 	EnterRelayServerKeyTyping = SELECTION_TYPING,
 } EnterRelayServerKeySelection;
 
@@ -215,13 +298,33 @@ typedef struct GameStatus {
 	int enemy_max_hp;
 	int self_turn_factor;
 	int enemy_turn_factor;
+	// the other player reads frames
+	bool peer_binary;
+	// messages the other player has not finished sending yet
+	char pending[256];
+	size_t pending_len;
 } GameStatus;
 
+// a game watched through the relay server, each board is kept the way its own player sees it
+typedef struct SpectateStatus {
+	CellState boards[2][ROW][COLUMN];
+	int hp[2];
+	int max_hp[2];
+	bool watching;
+	bool over;
+	// a line the relay server has not finished sending yet
+	char pending[256];
+	size_t pending_len;
+} SpectateStatus;
+
 typedef struct Status {
 	bool running;
 	Page page;
 	int sock_fd;
+	// why the relay server turned the player away, empty when the error page shows errno
+	char server_error[128];
 	GameStatus game;
+	SpectateStatus spectate;
 	struct {
 		GreetingSelection selection;
 	} greeting;
@@ -237,6 +340,11 @@ typedef struct Status {
 			size_t cursor;
 			EnterRelayServerKeySelection selection;
 		} key;
+		// the last key, MATCH or WATCH sent, sent again to the server a redirect points to
+		char handshake[16];
+		// the page after the handshake, EnterRelayServerKey while there is no handshake to send again
+		Page resume;
+		size_t redirects;
 	} relay_server;
 	struct {
 		CreatingSelection selection;
@@ -249,13 +357,133 @@ typedef struct Status {
 	} join;
 } Status;
 
-void free_buffer(Buffer* buf) {
-	for (int i = 0; i < buf->size.y; i++) {
-		free(buf->ptr[i]);
-		buf->ptr[i] = NULL;
+void arena_reserve(Arena* arena, size_t len) {
+	if (arena->len + len <= arena->cap) {
+		return;
+	}
+	size_t open = arena->len - arena->mark;
+	size_t cap = arena->cap * 2 > ARENA_BLOCK ? arena->cap * 2 : ARENA_BLOCK;
+	while (cap < open + len) {
+		cap *= 2;
+	}
+	char* ptr = malloc(cap);
+	assert(ptr != NULL);
+	if (arena->ptr != NULL) {
+		memcpy(ptr, arena->ptr + arena->mark, open);
+		assert(arena->full_len < sizeof(arena->full) / sizeof(arena->full[0]));
+		arena->full[arena->full_len++] = arena->ptr;
+	}
+	arena->ptr = ptr;
+	arena->cap = cap;
+	arena->len = open;
+	arena->mark = 0;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+	arena_reserve(arena, size + sizeof(size_t));
+	arena->len = (arena->len + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+	void* ptr = arena->ptr + arena->len;
+	arena->len += size;
+	arena->mark = arena->len;
+	return ptr;
+}
+
+// the block in use is the biggest one, so a frame like the last one fits in it without allocating
+void arena_reset(Arena* arena) {
+	for (size_t i = 0; i < arena->full_len; i++) {
+		free(arena->full[i]);
+	}
+	arena->full_len = 0;
+	arena->len = 0;
+	arena->mark = 0;
+}
+
+void arena_append(Arena* arena, const char* str, size_t len) {
+	arena_reserve(arena, len);
+	memcpy(arena->ptr + arena->len, str, len);
+	arena->len += len;
+}
+
+void arena_puts(Arena* arena, const char* str) {
+	arena_append(arena, str, strlen(str));
+}
+
+void arena_repeat(Arena* arena, char c, size_t count) {
+	arena_reserve(arena, count);
+	memset(arena->ptr + arena->len, c, count);
+	arena->len += count;
+}
+
+void arena_printf(Arena* arena, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	assert(len >= 0);
+	arena_reserve(arena, len + 1);
+	va_start(args, format);
+	vsnprintf(arena->ptr + arena->len, len + 1, format, args);
+	va_end(args);
+	arena->len += len;
+}
+
+// a buffer of `y` lines in the frame arena, the lines are written in order, each one after a buffer_start_line, and
+// the last one is followed by buffer_end, nothing else can be put in the arena in between
+Buffer buffer_begin(uint16_t x, uint16_t y) {
+	return (Buffer){
+		.data = NULL,
+		.lines = arena_alloc(&frame_arena, y * sizeof(size_t)),
+		.size = { .x = x, .y = y, },
+	};
+}
+
+void buffer_start_line(Buffer* buf, uint16_t line) {
+	if (line != 0) {
+		arena_append(&frame_arena, "", 1);
+	}
+	buf->lines[line] = frame_arena.len - frame_arena.mark;
+}
+
+void buffer_end(Buffer* buf) {
+	arena_append(&frame_arena, "", 1);
+	buf->data = frame_arena.ptr + frame_arena.mark;
+	frame_arena.mark = frame_arena.len;
+}
+
+char* buffer_line(Buffer buf, uint16_t line) {
+	return buf.data + buf.lines[line];
+}
+
+void builder_reserve(StringBuilder* builder, size_t len) {
+	if (builder->len + len + 1 > builder->cap) {
+		builder->cap = (builder->len + len + 1) * 2;
+		builder->ptr = realloc(builder->ptr, builder->cap);
+		assert(builder->ptr != NULL);
 	}
-	free(buf->ptr);
-	buf->ptr = NULL;
+}
+
+void builder_clear(StringBuilder* builder) {
+	builder_reserve(builder, 0);
+	builder->len = 0;
+	builder->ptr[0] = '\0';
+}
+
+void builder_append(StringBuilder* builder, const char* str, size_t len) {
+	builder_reserve(builder, len);
+	memcpy(builder->ptr + builder->len, str, len);
+	builder->len += len;
+	builder->ptr[builder->len] = '\0';
+}
+
+void builder_puts(StringBuilder* builder, const char* str) {
+	builder_append(builder, str, strlen(str));
+}
+
+void builder_repeat(StringBuilder* builder, char c, size_t count) {
+	builder_reserve(builder, count);
+	memset(builder->ptr + builder->len, c, count);
+	builder->len += count;
+	builder->ptr[builder->len] = '\0';
 }
 
 bool streq(const char* a, const char* b) {
@@ -311,55 +539,82 @@ bool cell_is_ship_destroyed(CellState target) {
 	return target >= CellShipTopDestroyed && target <= CellShipVerticalDestroyed;
 }
 
+// the row of the cache for these cells, drawn again only when the slot held something else
+GridRow* grid_row(CellState row_cells[COLUMN], int cursor_x, int preparing_cursor_x) {
+	uint8_t key[COLUMN + 2];
+	for (int j = 0; j < COLUMN; j++) {
+		key[j] = row_cells[j];
+	}
+	key[COLUMN] = cursor_x;
+	key[COLUMN + 1] = preparing_cursor_x;
+	// fnv-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < sizeof(key); i++) {
+		hash = (hash ^ key[i]) * 16777619u;
+	}
+
+	GridRow* row = &grid_cache[hash % GRID_CACHE_LEN];
+	if (row->used && memcmp(row->key, key, sizeof(key)) == 0) {
+		return row;
+	}
+	for (int i = 0; i < 3; i++) {
+		size_t len = 0;
+		for (int j = 0; j < COLUMN; j++) {
+			char* color_start = "";
+			char* color_end = "";
+			if (cursor_x == j) {
+				color_start = "\e[7m";
+				color_end = "\e[0m";
+			} else if (preparing_cursor_x == j) {
+				color_start = "\e[100m";
+				color_end = "\e[0m";
+			}
+			const char* content = cells[row_cells[j]][i];
+			len += snprintf(row->lines[i] + len, GRID_LINE_LEN - len, "| %s%s%s ", color_start, content, color_end);
+		}
+		len += snprintf(row->lines[i] + len, GRID_LINE_LEN - len, "|");
+		assert(len < GRID_LINE_LEN);
+		row->lens[i] = len;
+	}
+	memcpy(row->key, key, sizeof(key));
+	row->used = true;
+	return row;
+}
+
 Buffer grid(CellState status[ROW][COLUMN], Vec2 cursor, Vec2 preparing_cursor) {
-	int width = 7;
 	int height = 3;
-	int full_width = width + 3;
+	int full_width = CELL_WIDTH + 3;
 	int full_height = height + 1;
 
-	uint16_t x = full_width * COLUMN + 1;
+	uint16_t x = GRID_WIDTH;
 	uint16_t y = full_height * ROW + 1;
 
-	char** arr = malloc(y * sizeof(char*));
-	for (int i = 0; i < y; i++) {
-		if (i % full_height == 0) {
-			arr[i] = malloc((x + 1) * sizeof(char));
-			memset(arr[i], '-', x);
-			for (int j = 0; j < x / full_width + 1; j++) {
-				arr[i][j * full_width] = '+';
-			}
-			arr[i][x] = '\0';
-		} else {
-			arr[i] = strdup("");
-			for (int j = 0; j < x / full_width; j++) {
-				char* new;
-				char* color_start = "";
-				char* color_end = "";
-				if (cursor.x == j && cursor.y == i / full_height) {
-					color_start = "\e[7m";
-					color_end = "\e[0m";
-				} else if (preparing_cursor.x == j && preparing_cursor.y == i / full_height) {
-					color_start = "\e[100m";
-					color_end = "\e[0m";
-				}
-				int x_index = j;
-				int type = status[i / full_height][x_index];
-				const char* content = cells[type][i % full_height - 1];
-				asprintf(&new, "%s| %s%s%s ", arr[i], color_start, content, color_end);
-				free(arr[i]);
-				arr[i] = new;
-			}
-			size_t len = strlen(arr[i]);
-			arr[i] = realloc(arr[i], len + 2);
-			arr[i][len] = '|';
-			arr[i][len + 1] = '\0';
+	// +---------+---------+ ... +, the same for every board
+	static char separator[GRID_WIDTH + 1] = {0};
+	if (separator[0] == '\0') {
+		memset(separator, '-', x);
+		for (int j = 0; j < x / full_width + 1; j++) {
+			separator[j * full_width] = '+';
 		}
 	}
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	Buffer buf = buffer_begin(x, y);
+	for (int row = 0; row < ROW; row++) {
+		int cursor_x = cursor.y == row ? cursor.x : -1;
+		int preparing_cursor_x = preparing_cursor.y == row ? preparing_cursor.x : -1;
+		GridRow* cached = grid_row(status[row], cursor_x, preparing_cursor_x);
+		buffer_start_line(&buf, row * full_height);
+		arena_append(&frame_arena, separator, x);
+		for (int i = 0; i < height; i++) {
+			buffer_start_line(&buf, row * full_height + 1 + i);
+			arena_append(&frame_arena, cached->lines[i], cached->lens[i]);
+		}
+	}
+	buffer_start_line(&buf, y - 1);
+	arena_append(&frame_arena, separator, x);
+	buffer_end(&buf);
+
+	return buf;
 }
 
 Buffer game_ui(GameStatus* status) {
@@ -379,30 +634,16 @@ Buffer game_ui(GameStatus* status) {
 	uint16_t y = left.size.y + top_bar_y;
 
 	char* gap = "  ~~  ";
-	char** arr = malloc(y * sizeof(char*));
-
-	for (int i = 0; i < left.size.y; i++) {
-		asprintf(&arr[i + top_bar_y], "%s%s%s", left.ptr[i], gap, right.ptr[i]);
-	}
-	free_buffer(&left);
-	free_buffer(&right);
-
 	uint16_t x = left.size.x + strlen(gap) + right.size.x;
 
-	asprintf(&arr[0], "%*s", x, "");
-	asprintf(&arr[2], "%*s", x, "");
+	Buffer buf = buffer_begin(x, y);
+	buffer_start_line(&buf, 0);
+	arena_repeat(&frame_arena, ' ', x);
 
+	buffer_start_line(&buf, 1);
 	assert(x % 2 == 0);
 	if (status->self_preparing || status->enemy_preparing) {
 		int bar_len = x / 2 - 3 - 7;
-		char* left_hp_bar = malloc(bar_len + 1);
-		memset(left_hp_bar, '\\', bar_len);
-		left_hp_bar[bar_len] = '\0';
-
-		char* right_hp_bar = malloc(bar_len + 1);
-		memset(right_hp_bar, '/', bar_len);
-		right_hp_bar[bar_len] = '\0';
-
 		char* left_preparing = "   ";
 		if (status->enemy_preparing) {
 			left_preparing = "xxx";
@@ -412,21 +653,15 @@ Buffer game_ui(GameStatus* status) {
 			right_preparing = "xxx";
 		}
 
-		asprintf(&arr[1], "?? %s  %s <> %s  %s ??", left_hp_bar, left_preparing, right_preparing, right_hp_bar);
-
-		free(left_hp_bar);
-		free(right_hp_bar);
+		arena_puts(&frame_arena, "?? ");
+		arena_repeat(&frame_arena, '\\', bar_len);
+		arena_printf(&frame_arena, "  %s <> %s  ", left_preparing, right_preparing);
+		arena_repeat(&frame_arena, '/', bar_len);
+		arena_puts(&frame_arena, " ??");
 	} else {
 		int bar_len = x / 2 - 3 - 7;
-		char* left_hp_bar = malloc(bar_len + 1);
-		memset(left_hp_bar, '\\', bar_len);
-		memset(left_hp_bar, '.', bar_len - (int)(bar_len * ((double)status->enemy_hp / status->enemy_max_hp)));
-		left_hp_bar[bar_len] = '\0';
-
-		char* right_hp_bar = malloc(bar_len + 1);
-		memset(right_hp_bar, '.', bar_len);
-		memset(right_hp_bar, '/', (int)(bar_len * ((double)status->self_hp / status->self_max_hp)));
-		right_hp_bar[bar_len] = '\0';
+		int left_lost = bar_len - (int)(bar_len * ((double)status->enemy_hp / status->enemy_max_hp));
+		int right_left = (int)(bar_len * ((double)status->self_hp / status->self_max_hp));
 
 		char* turn;
 		if (status->my_turn) {
@@ -435,16 +670,95 @@ Buffer game_ui(GameStatus* status) {
 			turn = "  <<< <>      ";
 		}
 
-		asprintf(&arr[1], "%-3d%s%s%s%3d", status->enemy_hp, left_hp_bar, turn, right_hp_bar, status->self_hp);
+		arena_printf(&frame_arena, "%-3d", status->enemy_hp);
+		arena_repeat(&frame_arena, '.', left_lost);
+		arena_repeat(&frame_arena, '\\', bar_len - left_lost);
+		arena_puts(&frame_arena, turn);
+		arena_repeat(&frame_arena, '/', right_left);
+		arena_repeat(&frame_arena, '.', bar_len - right_left);
+		arena_printf(&frame_arena, "%3d", status->self_hp);
+	}
+
+	buffer_start_line(&buf, 2);
+	arena_repeat(&frame_arena, ' ', x);
 
-		free(left_hp_bar);
-		free(right_hp_bar);
+	for (int i = 0; i < left.size.y; i++) {
+		buffer_start_line(&buf, i + top_bar_y);
+		arena_puts(&frame_arena, buffer_line(left, i));
+		arena_puts(&frame_arena, gap);
+		arena_puts(&frame_arena, buffer_line(right, i));
 	}
+	buffer_end(&buf);
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	return buf;
+}
+
+// player 1's board is mirrored so both boards face each other like they do in game_ui
+Buffer spectate_ui(SpectateStatus* status) {
+	CellState mirrored[ROW][COLUMN];
+	for (int y = 0; y < ROW; y++) {
+		for (int x = 0; x < COLUMN; x++) {
+			CellState cell = status->boards[0][y][COLUMN - x - 1];
+			if (cell == CellShipLeftDestroyed) {
+				cell = CellShipRightDestroyed;
+			} else if (cell == CellShipRightDestroyed) {
+				cell = CellShipLeftDestroyed;
+			}
+			mirrored[y][x] = cell;
+		}
+	}
+	Vec2 no_cursor = { .x = -1, .y = -1, };
+	Buffer left = grid(mirrored, no_cursor, no_cursor);
+	Buffer right = grid(status->boards[1], no_cursor, no_cursor);
+	assert(left.size.y == right.size.y);
+
+	uint16_t top_bar_y = 3;
+
+	uint16_t y = left.size.y + top_bar_y;
+
+	char* gap = "  ~~  ";
+	uint16_t x = left.size.x + strlen(gap) + right.size.x;
+
+	assert(x % 2 == 0);
+	int bar_len = x / 2 - 3 - 7;
+	int lost[2] = { 0, 0 };
+	for (int i = 0; i < 2; i++) {
+		// a player that is still preparing shows a full bar
+		if (status->max_hp[i] > 0) {
+			lost[i] = bar_len - (int)(bar_len * ((double)status->hp[i] / status->max_hp[i]));
+		}
+	}
+
+	char* label = "  1P  <>  2P  ";
+	if (status->over) {
+		label = "  game  over  ";
+	}
+
+	Buffer buf = buffer_begin(x, y);
+	buffer_start_line(&buf, 0);
+	arena_repeat(&frame_arena, ' ', x);
+
+	buffer_start_line(&buf, 1);
+	arena_printf(&frame_arena, "%-3d", status->hp[0]);
+	arena_repeat(&frame_arena, '.', lost[0]);
+	arena_repeat(&frame_arena, '\\', bar_len - lost[0]);
+	arena_puts(&frame_arena, label);
+	arena_repeat(&frame_arena, '/', bar_len - lost[1]);
+	arena_repeat(&frame_arena, '.', lost[1]);
+	arena_printf(&frame_arena, "%3d", status->hp[1]);
+
+	buffer_start_line(&buf, 2);
+	arena_repeat(&frame_arena, ' ', x);
+
+	for (int i = 0; i < left.size.y; i++) {
+		buffer_start_line(&buf, i + top_bar_y);
+		arena_puts(&frame_arena, buffer_line(left, i));
+		arena_puts(&frame_arena, gap);
+		arena_puts(&frame_arena, buffer_line(right, i));
+	}
+	buffer_end(&buf);
+
+	return buf;
 }
 
 Buffer end_ui(GameStatus* status) {
@@ -462,18 +776,17 @@ Buffer end_ui(GameStatus* status) {
 		uint16_t x = strlen(output[0]) + padding * 2;
 		uint16_t y = sizeof(output) / sizeof(output[0]);
 
-		char** arr = malloc(y * sizeof(char*));
+		Buffer buf = buffer_begin(x, y);
 		for (int i = 0; i < y; i++) {
+			buffer_start_line(&buf, i);
 			if (i == 2) {
-				asprintf(&arr[i], "\e[7m" "%5d // " "\e[0m" "  %s  " "\e[7m" " // %-5d" "\e[0m", status->enemy_hp, output[i], status->self_hp);
+				arena_printf(&frame_arena, "\e[7m" "%5d // " "\e[0m" "  %s  " "\e[7m" " // %-5d" "\e[0m", status->enemy_hp, output[i], status->self_hp);
 			} else {
-				asprintf(&arr[i], "%*s%s%*s", padding, "", output[i], padding, "");
+				arena_printf(&frame_arena, "%*s%s%*s", padding, "", output[i], padding, "");
 			}
 		}
-		return (Buffer){
-			.ptr = arr,
-			.size = { .x = x, .y = y, },
-		};
+		buffer_end(&buf);
+		return buf;
 	} else if (status->self_hp == 0 && status->enemy_hp != 0) {
 		char* output[] = {
 			"    ____       ____           __ ",
@@ -487,18 +800,17 @@ Buffer end_ui(GameStatus* status) {
 		uint16_t x = strlen(output[0]) + padding * 2;
 		uint16_t y = sizeof(output) / sizeof(output[0]);
 
-		char** arr = malloc(y * sizeof(char*));
+		Buffer buf = buffer_begin(x, y);
 		for (int i = 0; i < y; i++) {
+			buffer_start_line(&buf, i);
 			if (i == 2) {
-				asprintf(&arr[i], "\e[7m" "%5d // " "\e[0m" "  %s  " "\e[7m" " // %-5d" "\e[0m", status->enemy_hp, output[i], status->self_hp);
+				arena_printf(&frame_arena, "\e[7m" "%5d // " "\e[0m" "  %s  " "\e[7m" " // %-5d" "\e[0m", status->enemy_hp, output[i], status->self_hp);
 			} else {
-				asprintf(&arr[i], "%*s%s%*s", padding, "", output[i], padding, "");
+				arena_printf(&frame_arena, "%*s%s%*s", padding, "", output[i], padding, "");
 			}
 		}
-		return (Buffer){
-			.ptr = arr,
-			.size = { .x = x, .y = y, },
-		};
+		buffer_end(&buf);
+		return buf;
 	} else {
 		abort();
 	}
@@ -508,7 +820,7 @@ Buffer normal_options(int selection, char** options, size_t options_len) {
 	uint16_t x = strlen(options[0]);
 	uint16_t y = options_len;
 
-	char** arr = malloc(y * sizeof(char*));
+	Buffer buf = buffer_begin(x, y);
 
 	for (int i = 0; i < y; i++) {
 		char* color_start = "";
@@ -517,43 +829,36 @@ Buffer normal_options(int selection, char** options, size_t options_len) {
 			color_start = "\e[7m";
 			color_end = "\e[0m";
 		}
-		char* buf;
-		asprintf(&buf, "%s%s%s", color_start, options[i], color_end);
-		arr[i] = buf;
+		buffer_start_line(&buf, i);
+		arena_printf(&frame_arena, "%s%s%s", color_start, options[i], color_end);
 	}
+	buffer_end(&buf);
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	return buf;
 }
 
 Buffer string_input_options(int selection, char* content, int content_width, char* content_prefix, char** options, size_t options_len) {
-	char* color_start = "";
-	char* color_end = "";
-	char* buf;
-	if (selection == SELECTION_TYPING) {
-		color_start = "\e[7m";
-		color_end = "\e[0m";
-	}
-	asprintf(&buf, "%s%s%*s%s", content_prefix, color_start, content_width, content, color_end);
-
 	uint16_t x = strlen(content_prefix) + content_width;
 	uint16_t y = options_len + 1;
 
-	char** arr = malloc(y * sizeof(char*));
+	Buffer buf = buffer_begin(x, y);
 
-	color_start = "";
-	color_end = "";
+	char* color_start = "";
+	char* color_end = "";
 	if (selection == SELECTION_INPUT) {
 		color_start = "\e[7m";
 		color_end = "\e[0m";
 	}
-	asprintf(&arr[0], "%s%s%s", color_start, buf, color_end);
-	free(buf);
+	char* content_color_start = "";
+	char* content_color_end = "";
+	if (selection == SELECTION_TYPING) {
+		content_color_start = "\e[7m";
+		content_color_end = "\e[0m";
+	}
+	buffer_start_line(&buf, 0);
+	arena_printf(&frame_arena, "%s%s%s%*s%s%s", color_start, content_prefix, content_color_start, content_width, content, content_color_end, color_end);
 
-	char* padding;
-	asprintf(&padding, "%*s", (int)(x - strlen(options[0])) / 2, "");
+	int padding = (int)(x - strlen(options[0])) / 2;
 	char* right = "";
 	if ((x - strlen(options[0])) % 2 != 0) {
 		right = " ";
@@ -565,14 +870,12 @@ Buffer string_input_options(int selection, char* content, int content_width, cha
 			color_start = "\e[7m";
 			color_end = "\e[0m";
 		}
-		asprintf(&arr[i + 1], "%s%s%s%s%s%s", color_start, padding, options[i], padding, right, color_end);
+		buffer_start_line(&buf, i + 1);
+		arena_printf(&frame_arena, "%s%*s%s%*s%s%s", color_start, padding, "", options[i], padding, "", right, color_end);
 	}
-	free(padding);
+	buffer_end(&buf);
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	return buf;
 }
 
 Buffer greeting_options(GreetingSelection selection) {
@@ -602,39 +905,35 @@ Buffer connect_relay_server_options(char* addr, ConnectRelayServerSelection sele
 }
 
 Buffer creating_options(int32_t port, CreatingSelection selection) {
-	char* color_start = "";
-	char* color_end = "";
-	char* buf;
-	if (selection == CreatingTyping) {
-		color_start = "\e[7m";
-		color_end = "\e[0m";
-	}
-	if (port == -1) {
-		asprintf(&buf, "Port: %s%6s%s", color_start, "", color_end);
-	} else {
-		asprintf(&buf, "Port: %s%6d%s", color_start, port, color_end);
-	}
-
 	uint16_t x = strlen("Port: ") + 6;
 	uint16_t y = 3;
 
-	char** arr = malloc(y * sizeof(char*));
+	Buffer buf = buffer_begin(x, y);
 
-	color_start = "";
-	color_end = "";
+	char* color_start = "";
+	char* color_end = "";
 	if (selection == CreatingInput) {
 		color_start = "\e[7m";
 		color_end = "\e[0m";
 	}
-	asprintf(&arr[0], "%s%s%s", color_start, buf, color_end);
-	free(buf);
+	char* port_color_start = "";
+	char* port_color_end = "";
+	if (selection == CreatingTyping) {
+		port_color_start = "\e[7m";
+		port_color_end = "\e[0m";
+	}
+	buffer_start_line(&buf, 0);
+	if (port == -1) {
+		arena_printf(&frame_arena, "%sPort: %s%6s%s%s", color_start, port_color_start, "", port_color_end, color_end);
+	} else {
+		arena_printf(&frame_arena, "%sPort: %s%6d%s%s", color_start, port_color_start, port, port_color_end, color_end);
+	}
 
 	char* options[] = {
 		"- Create",
 		"- Cancel",
 	};
-	char* padding;
-	asprintf(&padding, "%*s", (int)(x - strlen(options[0])) / 2, "");
+	int padding = (int)(x - strlen(options[0])) / 2;
 	char* right = "";
 	if ((x - strlen(options[0])) % 2 != 0) {
 		right = " ";
@@ -646,14 +945,12 @@ Buffer creating_options(int32_t port, CreatingSelection selection) {
 			color_start = "\e[7m";
 			color_end = "\e[0m";
 		}
-		asprintf(&arr[i + 1], "%s%s%s%s%s%s", color_start, padding, options[i], padding, right, color_end);
+		buffer_start_line(&buf, i + 1);
+		arena_printf(&frame_arena, "%s%*s%s%*s%s%s", color_start, padding, "", options[i], padding, "", right, color_end);
 	}
-	free(padding);
+	buffer_end(&buf);
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	return buf;
 }
 
 Buffer join_options(char* addr, JoinSelection selection) {
@@ -668,6 +965,8 @@ Buffer join_options(char* addr, JoinSelection selection) {
 Buffer enter_relay_server_key_options(char* key, EnterRelayServerKeySelection selection) {
 	char* options[] = {
 		"- Send  ",
+		"- Match ",
+		"- Watch ",
 	};
 	return string_input_options(selection, key, 10, "Key: ", options, sizeof(options) / sizeof(options[0]));
 }
@@ -675,38 +974,30 @@ Buffer enter_relay_server_key_options(char* key, EnterRelayServerKeySelection se
 Buffer normal_waiting(char* message, char* info_prefix, char* info) {
 	uint16_t y = 2;
 
-	char** arr = malloc(y * sizeof(char*));
-
-	arr[0] = strdup(message);
-	asprintf(&arr[1], "%s%s", info_prefix, info);
+	size_t lens[2] = { strlen(message), strlen(info_prefix) + strlen(info) };
+	uint16_t x = lens[0] > lens[1] ? lens[0] : lens[1];
 
-	uint16_t x = 0;
+	Buffer buf = buffer_begin(x, y);
 	for (int i = 0; i < y; i++) {
-		size_t len = strlen(arr[i]);
-		if (len > x) {
-			x = len;
+		int padding = (int)(x - lens[i]) / 2;
+		char* right = "";
+		if ((x - lens[i]) % 2 != 0) {
+			right = " ";
 		}
-	}
-	for (int i = 0; i < y; i++) {
-		size_t len = strlen(arr[i]);
-		if (len < x) {
-			char* padding;
-			asprintf(&padding, "%*s", (int)(x - len) / 2, "");
-			char* right = "";
-			if ((x - len) % 2 != 0) {
-				right = " ";
-			}
-			char* old = arr[i];
-			asprintf(&arr[i], "%s%s%s%s", padding, old, padding, right);
-			free(old);
-			free(padding);
+		buffer_start_line(&buf, i);
+		arena_repeat(&frame_arena, ' ', padding);
+		if (i == 0) {
+			arena_puts(&frame_arena, message);
+		} else {
+			arena_puts(&frame_arena, info_prefix);
+			arena_puts(&frame_arena, info);
 		}
+		arena_repeat(&frame_arena, ' ', padding);
+		arena_puts(&frame_arena, right);
 	}
+	buffer_end(&buf);
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	return buf;
 }
 
 Buffer waiting_client(uint16_t port) {
@@ -727,6 +1018,13 @@ Buffer waiting_other_player(char* key) {
 	return normal_waiting("Waiting for other player...", "Key ", key);
 }
 
+Buffer waiting_game(char* key, bool over) {
+	if (over) {
+		return normal_waiting("No game to watch", "Key ", key);
+	}
+	return normal_waiting("Waiting for game...", "Key ", key);
+}
+
 Buffer greeting_screen(Buffer options) {
 	int width = 7;
 	int height = 3;
@@ -736,7 +1034,7 @@ Buffer greeting_screen(Buffer options) {
 	uint16_t x = full_width * 8 + 1;
 	uint16_t y = full_height * 5 + 1;
 
-	char** arr = malloc(y * sizeof(char*));
+	Buffer buf = buffer_begin(x, y);
 
 	char* top_part[] = {
 		"+---------+---------+---------+---------+---------+---------+---------+---------+",
@@ -757,117 +1055,92 @@ Buffer greeting_screen(Buffer options) {
 		"| / =#= \\ | / =#= \\ |         |         |         |  \\-X--- | ---X--- | ---X-/  |",
 		"+---------+---------+---------+---------+---------+---------+---------+---------+",
 	};
-	for (int i = 0; i < sizeof(top_part) / sizeof(top_part[0]); i++) {
-		arr[i] = strdup(top_part[i]);
+	uint16_t top_part_len = sizeof(top_part) / sizeof(top_part[0]);
+	for (int i = 0; i < top_part_len; i++) {
+		buffer_start_line(&buf, i);
+		arena_puts(&frame_arena, top_part[i]);
 	}
 
 	char* other = "|         |         |";
-	char* padding;
-	asprintf(&padding, "%*s", (39 - options.size.x) / 2, "");
-	char* right = "";
-	if ((39 - options.size.x) % 2 != 0) {
-		right = " ";
-	}
+	int padding = (39 - options.size.x) / 2;
 	for (int i = 0; i < 3; i++) {
-		char* buffer;
+		buffer_start_line(&buf, top_part_len + i);
+		arena_puts(&frame_arena, other);
 		if (i < options.size.y) {
-			asprintf(&buffer, "%s%s%s%s%s%s", other, padding, options.ptr[i], padding, right, other);
+			arena_repeat(&frame_arena, ' ', padding);
+			arena_puts(&frame_arena, buffer_line(options, i));
+			arena_repeat(&frame_arena, ' ', padding + (39 - options.size.x) % 2);
 		} else {
-			asprintf(&buffer, "%s%39s%s", other, "", other);
+			arena_repeat(&frame_arena, ' ', 39);
 		}
-		arr[sizeof(top_part) / sizeof(top_part[0]) + i] = buffer;
+		arena_puts(&frame_arena, other);
 	}
-	free(padding);
 
-	arr[y - 1] = strdup("+---------+---------+---------+---------+---------+---------+---------+---------+");
-	
-	free_buffer(&options);
+	buffer_start_line(&buf, y - 1);
+	arena_puts(&frame_arena, "+---------+---------+---------+---------+---------+---------+---------+---------+");
+	buffer_end(&buf);
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = x, .y = y, },
-	};
+	return buf;
 }
 
-Buffer error_screen(void) {
-	char** arr = malloc(1 * sizeof(char*));
-	asprintf(&arr[0], "Error: %s (%d)", strerror(errno), errno);
+Buffer error_screen(const char* server_error) {
+	char message[160];
+	if (server_error[0] != '\0') {
+		snprintf(message, sizeof(message), "Error: the relay server says: %s", server_error);
+	} else {
+		snprintf(message, sizeof(message), "Error: %s (%d)", strerror(errno), errno);
+	}
 
-	return (Buffer){
-		.ptr = arr,
-		.size = { .x = strlen(arr[0]), .y = 1, },
-	};
+	Buffer buf = buffer_begin(strlen(message), 1);
+	buffer_start_line(&buf, 0);
+	arena_puts(&frame_arena, message);
+	buffer_end(&buf);
+
+	return buf;
 }
 
-char* ui_wrapper(Buffer buf, Size size) {
+// the whole frame goes into `frame_builder`, which is reused by the next one
+const char* ui_wrapper(Buffer buf, Size size) {
 	if (buf.size.x > size.x || buf.size.y > size.y) {
-		free_buffer(&buf);
-
-		char* message;
-		int err = asprintf(
-			&message,
+		char message[128];
+		snprintf(
+			message, sizeof(message),
 			"The terminal is too small (%d x %d), and it should at least be %d x %d.",
 			size.x, size.y, buf.size.x, buf.size.y
 		);
-		assert(err != -1);
 
 		if (size.y > 0 && strlen(message) <= size.x) {
-			char** arr = malloc(1 * sizeof(char*));
-			arr[0] = message;
-			return ui_wrapper((Buffer){
-				.ptr = arr,
-				.size = { .x = strlen(message), .y = 1, },
-			}, size);
+			Buffer message_buf = buffer_begin(strlen(message), 1);
+			buffer_start_line(&message_buf, 0);
+			arena_puts(&frame_arena, message);
+			buffer_end(&message_buf);
+			return ui_wrapper(message_buf, size);
 		}
-		char* result;
-		err = asprintf(&result, "%s\e[0J\n", message);
-		assert(err != -1);
-		free(message);
-		return result;
+		builder_clear(&frame_builder);
+		builder_puts(&frame_builder, message);
+		builder_puts(&frame_builder, "\e[0J\n");
+		return frame_builder.ptr;
 	}
 
 	uint16_t top = (size.y - buf.size.y) / 2;
 	uint16_t left = (size.x - buf.size.x) / 2;
 
-	char padding = ' ';
-	char* padding_s = " ";
-	char* y_padding = malloc((size.x + 1) * sizeof(char));
-	memset(y_padding, padding, size.x);
-	y_padding[size.x] = '\0';
-
-	char* x_padding = malloc((left + 1) * sizeof(char));
-	memset(x_padding, padding, left);
-	x_padding[left] = '\0';
-
-	char* right_padding = "";
-	if ((size.x - buf.size.x) % 2 != 0) {
-		right_padding = padding_s;
-	}
-
-	char* result = strdup("");
+	builder_clear(&frame_builder);
 	for (int line = 0; line < size.y; line++) {
-		char* old_result = result;
-		result = NULL;
-		char* line_ending = "\n";
-		if (line == 0) {
-			line_ending = "";
+		if (line != 0) {
+			builder_puts(&frame_builder, "\n");
 		}
 		// top & bottom padding
 		if (line < top || line - top >= buf.size.y) {
-			int err = asprintf(&result, "%s%s%s", old_result, line_ending, y_padding);
-			assert(err != -1);
+			builder_repeat(&frame_builder, ' ', size.x);
 		} else {
-			int err = asprintf(&result, "%s%s%s%s%s%s", old_result, line_ending, x_padding, buf.ptr[line - top], x_padding, right_padding);
-			assert(err != -1);
+			builder_repeat(&frame_builder, ' ', left);
+			builder_puts(&frame_builder, buffer_line(buf, line - top));
+			builder_repeat(&frame_builder, ' ', left + (size.x - buf.size.x) % 2);
 		}
-		free(old_result);
 	}
-	free(x_padding);
-	free(y_padding);
 
-	free_buffer(&buf);
-
-	return result;
+	return frame_builder.ptr;
 }
 
 Size termial_size(void) {
@@ -900,15 +1173,159 @@ void leave_alter_screen(void) {
 	fflush(stdout);
 }
 
+// the cells the output of ui_wrapper covers, escape sequences other than sgr only move on
+void screen_parse(const char* frame, Size size, ScreenCell* cells) {
+	for (size_t i = 0; i < (size_t)size.x * size.y; i++) {
+		cells[i] = (ScreenCell){ .ch = ' ', .reverse = false, .background = 0, };
+	}
+	int row = 0;
+	int column = 0;
+	ScreenCell attr = { .reverse = false, .background = 0, };
+	for (const char* c = frame; *c != '\0'; c++) {
+		if (c[0] == '\e' && c[1] == '[') {
+			const char* end = c + 2;
+			while (*end != '\0' && (*end < '@' || *end > '~')) {
+				end++;
+			}
+			if (*end == '\0') {
+				break;
+			}
+			for (const char* parm = c + 2; *end == 'm' && parm <= end; ) {
+				char* next;
+				long code = strtol(parm, &next, 10);
+				if (code == 0) {
+					attr.reverse = false;
+					attr.background = 0;
+				} else if (code == 7) {
+					attr.reverse = true;
+				} else if ((code >= 40 && code <= 47) || (code >= 100 && code <= 107)) {
+					attr.background = code;
+				} else if (code == 49) {
+					attr.background = 0;
+				}
+				parm = next + 1;
+			}
+			c = end;
+		} else if (*c == '\n') {
+			row += 1;
+			column = 0;
+		} else {
+			if (row < size.y && column < size.x) {
+				attr.ch = *c;
+				cells[row * size.x + column] = attr;
+			}
+			column += 1;
+		}
+	}
+}
+
+bool screen_cell_eq(ScreenCell a, ScreenCell b) {
+	return a.ch == b.ch && a.reverse == b.reverse && a.background == b.background;
+}
+
+// write the cursor moves and the runs of cells that differ from the last frame, in one synchronized update
+void screen_draw(Screen* screen, const char* frame, Size size) {
+	size_t count = (size_t)size.x * size.y;
+	if (screen->cells == NULL || size.x != screen->size.x || size.y != screen->size.y) {
+		free(screen->cells);
+		free(screen->next);
+		screen->cells = malloc((count + 1) * sizeof(ScreenCell));
+		screen->next = malloc((count + 1) * sizeof(ScreenCell));
+		assert(screen->cells != NULL && screen->next != NULL);
+		screen->size = size;
+		screen->drawn = false;
+	}
+	screen_parse(frame, size, screen->next);
+
+	// \e[?2026h: hold the output until the frame is complete
+	char* begin = "\e[?2026h";
+	builder_clear(&screen->out);
+	builder_puts(&screen->out, begin);
+	if (!screen->drawn) {
+		char* clear = "\e[0m" "\e[2J";
+		builder_puts(&screen->out, clear);
+		for (size_t i = 0; i < count; i++) {
+			screen->cells[i] = (ScreenCell){ .ch = ' ', .reverse = false, .background = 0, };
+		}
+		screen->drawn = true;
+	}
+
+	// every frame leaves the attributes reset
+	ScreenCell attr = { .reverse = false, .background = 0, };
+	int cursor_row = -1;
+	int cursor_column = -1;
+	for (int row = 0; row < size.y; row++) {
+		for (int column = 0; column < size.x; column++) {
+			size_t i = (size_t)row * size.x + column;
+			ScreenCell cell = screen->next[i];
+			if (screen_cell_eq(cell, screen->cells[i])) {
+				continue;
+			}
+			if (cursor_row != row || cursor_column != column) {
+				// a short gap drawn like the run around it is cheaper to write again than to jump over
+				bool rewrite = cursor_row == row && column - cursor_column <= 4;
+				for (int j = cursor_column; rewrite && j < column; j++) {
+					ScreenCell gap = screen->next[i - column + j];
+					rewrite = gap.reverse == attr.reverse && gap.background == attr.background;
+				}
+				if (rewrite) {
+					for (int j = cursor_column; j < column; j++) {
+						builder_append(&screen->out, &screen->next[i - column + j].ch, 1);
+					}
+				} else {
+					char move[16];
+					int len = snprintf(move, sizeof(move), "\e[%d;%dH", row + 1, column + 1);
+					builder_append(&screen->out, move, len);
+				}
+			}
+			if (cell.reverse != attr.reverse || cell.background != attr.background) {
+				char sgr[16];
+				int len;
+				if (cell.background != 0) {
+					len = snprintf(sgr, sizeof(sgr), "\e[0%s;%dm", cell.reverse ? ";7" : "", cell.background);
+				} else {
+					len = snprintf(sgr, sizeof(sgr), "\e[0%sm", cell.reverse ? ";7" : "");
+				}
+				builder_append(&screen->out, sgr, len);
+				attr = cell;
+			}
+			builder_append(&screen->out, &cell.ch, 1);
+			cursor_row = row;
+			cursor_column = column + 1;
+			// the cursor waits to wrap after the last column, where it is is up to the terminal
+			if (cursor_column == size.x) {
+				cursor_row = -1;
+			}
+		}
+	}
+	ScreenCell* cells = screen->cells;
+	screen->cells = screen->next;
+	screen->next = cells;
+
+	if (screen->out.len == strlen(begin)) {
+		return;
+	}
+	if (attr.reverse || attr.background != 0) {
+		builder_puts(&screen->out, "\e[0m");
+	}
+	// \e[?2026l: show the frame
+	char* end = "\e[?2026l";
+	builder_puts(&screen->out, end);
+	size_t written = 0;
+	while (written < screen->out.len) {
+		ssize_t len = write(STDOUT_FILENO, screen->out.ptr + written, screen->out.len - written);
+		if (len == -1 && errno == EINTR) {
+			continue;
+		}
+		assert(len > 0);
+		written += len;
+	}
+}
+
 void print_ui(Buffer buf) {
 	Size size = termial_size();
-	char* buffer = ui_wrapper(buf, size);
-	// \e[2j: remove old output
-	// \e[1,1H: move cursor to top left
-	char* control = "\e[1;1H";
-	printf("%s%s", control, buffer);
-	fflush(stdout);
-	free(buffer);
+	screen_draw(&screen, ui_wrapper(buf, size), size);
+	arena_reset(&frame_arena);
 }
 
 void handle_greeting_key_event(Status* status, int key) {
@@ -1178,6 +1595,42 @@ void handle_join_key_event(Status* status, int key) {
 	}
 }
 
+void send_handshake(Status* status, const char* handshake, Page page) {
+	if (handshake != status->relay_server.handshake) {
+		strcpy(status->relay_server.handshake, handshake);
+	}
+	ssize_t written = write(status->sock_fd, handshake, strlen(handshake));
+	assert(written == strlen(handshake));
+	status->page = page;
+}
+
+// connect to the server the redirect names, the handshake is sent again once connected
+void follow_redirect(Status* status, const char* message) {
+	const char* addr = message + strlen(REDIRECT_PREFIX);
+	if (status->relay_server.redirects == MAX_REDIRECTS || strlen(addr) >= sizeof(status->relay_server.connect_addr)) {
+		status->page = Error;
+		return;
+	}
+	status->relay_server.redirects += 1;
+	strcpy(status->relay_server.connect_addr, addr);
+	status->relay_server.cursor = strlen(addr);
+	status->relay_server.resume = status->page;
+	close(status->sock_fd);
+	status->sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	assert(status->sock_fd != -1);
+	socket_fd = status->sock_fd;
+	status->page = WaitingRelayServer;
+}
+
+// the relay server turned the player away and hung up, `reason` is what it said
+void show_server_error(Status* status, const char* reason) {
+	snprintf(status->server_error, sizeof(status->server_error), "%.*s", (int)strcspn(reason, "\n"), reason);
+	close(status->sock_fd);
+	status->sock_fd = -1;
+	socket_fd = -1;
+	status->page = Error;
+}
+
 void handle_enter_relay_server_key_event(Status* status, int key) {
 	if (status->relay_server.key.selection == EnterRelayServerKeyTyping) {
 		if (key >= 'a' && key <= 'z') {
@@ -1199,14 +1652,14 @@ void handle_enter_relay_server_key_event(Status* status, int key) {
 	EnterRelayServerKeySelection* selection = &status->relay_server.key.selection;
 	switch (key) {
 		case 'j': case 's':
-			if (*selection < 0 || *selection > EnterRelayServerKeySend) {
+			if (*selection < 0 || *selection > EnterRelayServerKeyWatch) {
 				*selection = EnterRelayServerKeyInput;
-			} else if (*selection < EnterRelayServerKeySend) {
+			} else if (*selection < EnterRelayServerKeyWatch) {
 				*selection += 1;
 			}
 			break;
 		case 'k': case 'w':
-			if (*selection < 0 || *selection > EnterRelayServerKeySend) {
+			if (*selection < 0 || *selection > EnterRelayServerKeyWatch) {
 				*selection = EnterRelayServerKeyInput;
 			} else if (*selection > 0){
 				*selection -= 1;
@@ -1219,10 +1672,23 @@ void handle_enter_relay_server_key_event(Status* status, int key) {
 				case EnterRelayServerKeyInput:
 					status->relay_server.key.selection = EnterRelayServerKeyTyping;
 					break;
-				case EnterRelayServerKeySend: {
-					ssize_t written = write(status->sock_fd, status->relay_server.key.value, strlen(status->relay_server.key.value));
-					assert(written == strlen(status->relay_server.key.value));
-					status->page = WaitingOtherPlayer;
+				case EnterRelayServerKeySend:
+					status->relay_server.redirects = 0;
+					send_handshake(status, status->relay_server.key.value, WaitingOtherPlayer);
+					break;
+				case EnterRelayServerKeyMatch: {
+					// the relay server pairs it with whoever asked for a match before
+					strcpy(status->relay_server.key.value, "MATCH");
+					status->relay_server.key.cursor = strlen("MATCH");
+					status->relay_server.redirects = 0;
+					send_handshake(status, status->relay_server.key.value, WaitingOtherPlayer);
+					break;
+				}
+				case EnterRelayServerKeyWatch: {
+					char message[sizeof("WATCH ") + sizeof(status->relay_server.key.value)];
+					snprintf(message, sizeof(message), "WATCH %s", status->relay_server.key.value);
+					status->relay_server.redirects = 0;
+					send_handshake(status, message, Spectating);
 					break;
 				}
 			}
@@ -1235,6 +1701,75 @@ void handle_enter_relay_server_key_event(Status* status, int key) {
 	}
 }
 
+// the first message in `buf`, returns how many bytes it takes or 0 while it is unfinished
+size_t take_message(const char* buf, size_t len, Message* message, bool* valid) {
+	if (len == 0) {
+		return 0;
+	}
+	if ((uint8_t)buf[0] & FRAME_FLAG) {
+		// a payload byte may look like a newline, only the length tells where a frame ends
+		size_t frame_len = FRAME_LEN(buf[0]);
+		if (len < frame_len) {
+			return 0;
+		}
+		*valid = decode_frame((const uint8_t*)buf, message);
+		return frame_len;
+	}
+	const char* newline = memchr(buf, '\n', len);
+	if (newline == NULL) {
+		return 0;
+	}
+	char line[256];
+	size_t line_len = newline - buf;
+	if (line_len >= sizeof(line)) {
+		*valid = false;
+	} else {
+		memcpy(line, buf, line_len);
+		line[line_len] = '\0';
+		*valid = parse_text_message(line, message);
+	}
+	return line_len + 1;
+}
+
+// FIRE is three bytes as a frame, BINARY is always a text line
+size_t encode_message(const Message* message, bool binary, char* buf, size_t size) {
+	const uint8_t* values = message->values;
+	size_t count = message_values[message->type];
+	if (binary && message->type != MessageBinary) {
+		size_t payload_len = count + (message->type == MessageDestroyed);
+		assert(1 + payload_len <= size);
+		buf[0] = FRAME_FLAG | message->type << 4 | payload_len;
+		uint8_t* payload = (uint8_t*)buf + 1;
+		if (message->type == MessageDestroyed) {
+			*payload++ = message->direction;
+		}
+		memcpy(payload, values, count);
+		return 1 + payload_len;
+	}
+
+	int len;
+	if (message->type == MessageDestroyed) {
+		len = snprintf(buf, size, "DESTROYED %c,%d,%d,%d\n", message->direction, values[0], values[1], values[2]);
+	} else if (count == 0) {
+		len = snprintf(buf, size, "%s\n", message_methods[message->type]);
+	} else {
+		len = snprintf(buf, size, "%s %d,%d\n", message_methods[message->type], values[0], values[1]);
+	}
+	assert(len > 0 && len < size);
+	return len;
+}
+
+void send_message(Status* status, const Message* message) {
+	char buf[MESSAGE_LEN];
+	size_t len = encode_message(message, status->game.peer_binary, buf, sizeof(buf));
+	write(status->sock_fd, buf, len);
+}
+
+// tell the other player frames can be sent here, one that does not know BINARY ignores it and keeps getting text
+void offer_binary(Status* status) {
+	send_message(status, &(Message){ .type = MessageBinary });
+}
+
 void handle_preparing_key_event(Status* status, int key) {
 	switch (key) {
 		case 'j': case 's':
@@ -1339,10 +1874,10 @@ void handle_preparing_key_event(Status* status, int key) {
 			status->game.self_preparing = false;
 			status->game.self_hp = status->game.self_max_hp;
 			status->game.self_turn_factor = (bool)(random() % 2);
-			char* buf;
-			asprintf(&buf, "READY %d,%d\n", status->game.self_turn_factor, status->game.self_max_hp);
-			write(status->sock_fd, buf, strlen(buf));
-			free(buf);
+			send_message(status, &(Message){
+				.type = MessageReady,
+				.values = { status->game.self_turn_factor, status->game.self_max_hp },
+			});
 
 			if (status->game.enemy_turn_factor != -1) {
 				status->game.my_turn = (status->game.self_turn_factor + status->game.enemy_turn_factor) % 2 == status->game.is_player_1;
@@ -1376,10 +1911,10 @@ void handle_game_key_event(Status* status, int key) {
 		case '\n': {
 			if (status->game.my_turn) {
 				status->game.my_turn = false;
-				char* buf;
-				asprintf(&buf, "FIRE %d,%d\n", status->game.cursor.x, status->game.cursor.y);
-				write(status->sock_fd, buf, strlen(buf));
-				free(buf);
+				send_message(status, &(Message){
+					.type = MessageFire,
+					.values = { status->game.cursor.x, status->game.cursor.y },
+				});
 			}
 			break;
 		}
@@ -1421,6 +1956,11 @@ void handle_key_event(Status* status) {
 					handle_game_key_event(status, key);
 				}
 				break;
+			case Spectating:
+				if (status->spectate.over && key == '\n') {
+					status->running = false;
+				}
+				break;
 			case End:
 				if (key == '\n') {
 					status->running = false;
@@ -1432,7 +1972,7 @@ void handle_key_event(Status* status) {
 	}
 }
 
-char* handle_fire(Status* status, Vec2 position) {
+Message handle_fire(Status* status, Vec2 position) {
 	typeof(CellState[COLUMN])* self_cells = &(status->game.self_status[0]);
 	CellState target = self_cells[position.y][position.x];
 	if (cell_is_ship_not_destroyed(target)) {
@@ -1443,15 +1983,13 @@ char* handle_fire(Status* status, Vec2 position) {
 		}
 	} else if (target == CellEmpty) {
 		self_cells[position.y][position.x] = CellMiss;
-		char* message;
-		asprintf(&message, "MISS %d,%d\n", position.x, position.y);
-		return message;
+		return (Message){ .type = MessageMiss, .values = { position.x, position.y } };
 	} else {
-		return strdup("IGNORE\n");
+		return (Message){ .type = MessageIgnore };
 	}
 
 	Vec2 start_position = position;
-	char* message;
+	Message message;
 	bool destroyed = false;
 	switch (self_cells[position.y][position.x]) {
 		case CellShipTopDestroyed:
@@ -1469,7 +2007,7 @@ char* handle_fire(Status* status, Vec2 position) {
 				}
 			}
 			if (destroyed) {
-				asprintf(&message, "DESTROYED v,%d,%d,%d\n", start_position.x, start_position.y, position.y);
+				message = (Message){ .type = MessageDestroyed, .direction = 'v', .values = { start_position.x, start_position.y, position.y } };
 			}
 			break;
 		case CellShipBottomDestroyed:
@@ -1487,7 +2025,7 @@ char* handle_fire(Status* status, Vec2 position) {
 				}
 			}
 			if (destroyed) {
-				asprintf(&message, "DESTROYED v,%d,%d,%d\n", start_position.x, position.y, start_position.y);
+				message = (Message){ .type = MessageDestroyed, .direction = 'v', .values = { start_position.x, position.y, start_position.y } };
 			}
 			break;
 		case CellShipLeftDestroyed:
@@ -1505,7 +2043,7 @@ char* handle_fire(Status* status, Vec2 position) {
 				}
 			}
 			if (destroyed) {
-				asprintf(&message, "DESTROYED h,%d,%d,%d\n", start_position.x, position.x, start_position.y);
+				message = (Message){ .type = MessageDestroyed, .direction = 'h', .values = { start_position.x, position.x, start_position.y } };
 			}
 			break;
 		case CellShipRightDestroyed:
@@ -1523,7 +2061,7 @@ char* handle_fire(Status* status, Vec2 position) {
 				}
 			}
 			if (destroyed) {
-				asprintf(&message, "DESTROYED h,%d,%d,%d\n", position.x, start_position.x, start_position.y);
+				message = (Message){ .type = MessageDestroyed, .direction = 'h', .values = { position.x, start_position.x, start_position.y } };
 			}
 			break;
 		case CellShipHorizontalDestroyed: {
@@ -1559,7 +2097,7 @@ char* handle_fire(Status* status, Vec2 position) {
 				}
 			}
 			if (destroyed) {
-				asprintf(&message, "DESTROYED h,%d,%d,%d\n", left, right, start_position.y);
+				message = (Message){ .type = MessageDestroyed, .direction = 'h', .values = { left, right, start_position.y } };
 			}
 			break;
 		}
@@ -1596,7 +2134,7 @@ char* handle_fire(Status* status, Vec2 position) {
 				}
 			}
 			if (destroyed) {
-				asprintf(&message, "DESTROYED v,%d,%d,%d\n", start_position.x, top, bottom);
+				message = (Message){ .type = MessageDestroyed, .direction = 'v', .values = { start_position.x, top, bottom } };
 			}
 			break;
 		}
@@ -1604,95 +2142,49 @@ char* handle_fire(Status* status, Vec2 position) {
 			abort();
 	}
 	if (!destroyed) {
-		asprintf(&message, "HIT %d,%d\n", start_position.x, start_position.y);
+		message = (Message){ .type = MessageHit, .values = { start_position.x, start_position.y } };
 	}
 	return message;
 }
 
-void handle_game_action(Status* status) {
-	struct pollfd fds = { .fd = status->sock_fd, .events = POLLIN, };
-	while (poll(&fds, 1, 0) > 0) {
-		char buf[256] = {0};
-		int readed = read(status->sock_fd, buf, sizeof(buf) - 1);
-		if (readed == -1) {
-			status->page = Error;
+// every number of `message` is checked, the other player may be running anything
+void handle_message(Status* status, const Message* message) {
+	const uint8_t* values = message->values;
+	switch (message->type) {
+		case MessageFire: {
+			if (values[0] >= COLUMN || values[1] >= ROW) {
+				break;
+			}
+			Vec2 position = { .x = COLUMN - values[0] - 1, .y = values[1], };
+			if (!status->game.my_turn) {
+				status->game.my_turn = true;
+				Message reply = handle_fire(status, position);
+				send_message(status, &reply);
+			}
 			break;
-		} else if (readed == 0) {
-			status->running = false;
+		}
+		case MessageHit:
+		case MessageMiss: {
+			if (values[0] >= COLUMN || values[1] >= ROW) {
+				break;
+			}
+			Vec2 position = { .x = COLUMN - values[0] - 1, .y = values[1], };
+			if (message->type == MessageHit) {
+				status->game.enemy_hp -= 1;
+				status->game.enemy_status[position.y][position.x] = CellHit;
+			} else {
+				status->game.enemy_status[position.y][position.x] = CellMiss;
+			}
 			break;
 		}
-
-		char* save;
-		char* method = strtok_r(buf, " ", &save);
-		char* parms = strtok_r(NULL, "\n", &save);
-		assert(method != NULL);
-		if (string_has_prefix(buf, "FIRE")) {
-			assert(parms != NULL);
-			char* save;
-			char* x_str = strtok_r(parms, ",", &save);
-			char* y_str = strtok_r(NULL, "", &save);
-
-			Vec2 position;
-			char* end;
-			position.x = COLUMN - strtoul(x_str, &end, 10) - 1;
-			assert(end != x_str);
-			position.y = strtoul(y_str, &end, 10);
-			assert(end != y_str);
-
-			if (!status->game.my_turn) {
-				status->game.my_turn = true;
-				char* message = handle_fire(status, position);
-				write(status->sock_fd, message, strlen(message));
-				free(message);
-			}
-		} else if (string_has_prefix(buf, "HIT")) {
-			assert(parms != NULL);
-			char* save;
-			char* x_str = strtok_r(parms, ",", &save);
-			char* y_str = strtok_r(NULL, "", &save);
-
-			Vec2 position;
-			char* end;
-			position.x = COLUMN - strtoul(x_str, &end, 10) - 1;
-			assert(end != x_str);
-			position.y = strtoul(y_str, &end, 10);
-			assert(end != y_str);
-
-			status->game.enemy_hp -= 1;
-			status->game.enemy_status[position.y][position.x] = CellHit;
-		} else if (string_has_prefix(buf, "MISS")) {
-			assert(parms != NULL);
-			char* save;
-			char* x_str = strtok_r(parms, ",", &save);
-			char* y_str = strtok_r(NULL, "", &save);
-
-			Vec2 position;
-			char* end;
-			position.x = COLUMN - strtoul(x_str, &end, 10) - 1;
-			assert(end != x_str);
-			position.y = strtoul(y_str, &end, 10);
-			assert(end != y_str);
-
-			status->game.enemy_status[position.y][position.x] = CellMiss;
-		} else if (string_has_prefix(buf, "DESTROYED")) {
-			assert(parms != NULL);
-			char* save;
-			char* direction = strtok_r(parms, ",", &save);
-			char* a_str = strtok_r(NULL, ",", &save);
-			char* b_str = strtok_r(NULL, ",", &save);
-			char* c_str = strtok_r(NULL, "", &save);
-			assert(direction!= NULL);
-			assert(a_str != NULL);
-			assert(b_str != NULL);
-			assert(c_str != NULL);
-			char* end;
-			int a = strtoul(a_str, &end, 10);
-			assert(end != a_str);
-			int b = strtoul(b_str, &end, 10);
-			assert(end != b_str);
-			int c = strtoul(c_str, &end, 10);
-			assert(end != c_str);
-			if (streq(direction, "v")) {
+		case MessageDestroyed: {
+			int a = values[0];
+			int b = values[1];
+			int c = values[2];
+			if (message->direction == 'v') {
+				if (a >= COLUMN || b > c || c >= ROW) {
+					break;
+				}
 				int x = COLUMN - a - 1;
 				int y1 = b;
 				int y2 = c;
@@ -1706,7 +2198,10 @@ void handle_game_action(Status* status) {
 					}
 
 				}
-			} else if (streq(direction, "h")){
+			} else {
+				if (a > b || b >= COLUMN || c >= ROW) {
+					break;
+				}
 				int x1 = COLUMN - a - 1;
 				int x2 = COLUMN - b - 1;
 				int y = c;
@@ -1719,32 +2214,186 @@ void handle_game_action(Status* status) {
 						status->game.enemy_status[y][x] = CellShipHorizontalDestroyed;
 					}
 				}
-			} else {
-				assert(streq(direction, "v") || streq(direction, "h"));
 			}
 			status->game.enemy_hp -= 1;
 			if (status->game.enemy_hp <= 0) {
 				status->page = End;
 			}
-		} else if (string_has_prefix(buf, "READY")) {
-			assert(parms != NULL);
-			char* save;
-			char* turn_factor_str = strtok_r(parms, ",", &save);
-			char* hp_str = strtok_r(NULL, "", &save);
-
-			char* end;
-			status->game.enemy_turn_factor = (bool)strtoul(turn_factor_str, &end, 10);
-			assert(end != turn_factor_str);
-			status->game.enemy_max_hp = strtoul(hp_str, &end, 10);
-			assert(end != hp_str);
+			break;
+		}
+		case MessageReady:
+			status->game.enemy_turn_factor = (bool)values[0];
+			status->game.enemy_max_hp = values[1];
 			status->game.enemy_hp = status->game.enemy_max_hp;
 			status->game.enemy_preparing = false;
 
 			if (status->game.self_turn_factor != -1) {
 				status->game.my_turn = (status->game.self_turn_factor + status->game.enemy_turn_factor) % 2 == status->game.is_player_1;
 			}
-		} else if (string_has_prefix(buf, "IGNORE")) {
-			assert(parms == NULL);
+			break;
+		case MessageBinary:
+			status->game.peer_binary = true;
+			break;
+		case MessageIgnore:
+		case MessageTypes:
+			break;
+	}
+}
+
+// handle every finished message in the pending buffer, an unfinished one is kept for the next read
+void handle_pending_messages(Status* status) {
+	GameStatus* game = &status->game;
+	size_t used = 0;
+	size_t len;
+	Message message;
+	bool valid;
+	while ((len = take_message(game->pending + used, game->pending_len - used, &message, &valid)) != 0) {
+		if (valid) {
+			handle_message(status, &message);
+		}
+		used += len;
+	}
+	game->pending_len -= used;
+	memmove(game->pending, game->pending + used, game->pending_len);
+	// a line that never ends is thrown away
+	if (game->pending_len == sizeof(game->pending)) {
+		game->pending_len = 0;
+	}
+}
+
+void handle_game_action(Status* status) {
+	GameStatus* game = &status->game;
+	// what came in together with CONNECTED AS
+	handle_pending_messages(status);
+	struct pollfd fds = { .fd = status->sock_fd, .events = POLLIN, };
+	while (poll(&fds, 1, 0) > 0) {
+		ssize_t readed = read(status->sock_fd, game->pending + game->pending_len, sizeof(game->pending) - game->pending_len);
+		if (readed == -1) {
+			status->page = Error;
+			break;
+		} else if (readed == 0) {
+			status->running = false;
+			break;
+		}
+		game->pending_len += readed;
+		handle_pending_messages(status);
+	}
+}
+
+// a line the relay server recorded, prefixed with the number of the player that sent it
+void handle_spectate_line(SpectateStatus* status, char* line) {
+	if (streq(line, "WATCHING")) {
+		status->watching = true;
+		return;
+	}
+
+	Message message;
+	if ((line[0] != '1' && line[0] != '2') || line[1] != ' ' || !parse_text_message(line + 2, &message)) {
+		return;
+	}
+	int player = line[0] - '1';
+	typeof(CellState[COLUMN])* cells = status->boards[player];
+
+	// every reply is about the board of the player that sent it, in its own coordinates
+	const uint8_t* values = message.values;
+	switch (message.type) {
+		case MessageReady:
+			status->max_hp[player] = values[1];
+			status->hp[player] = values[1];
+			break;
+		case MessageHit:
+		case MessageMiss: {
+			int x = values[0];
+			int y = values[1];
+			if (x >= COLUMN || y >= ROW) {
+				break;
+			}
+			if (message.type == MessageHit) {
+				cells[y][x] = CellHit;
+				status->hp[player] -= 1;
+			} else {
+				cells[y][x] = CellMiss;
+			}
+			break;
+		}
+		case MessageDestroyed: {
+			int a = values[0];
+			int b = values[1];
+			int c = values[2];
+			if (message.direction == 'v' && a < COLUMN && b <= c && c < ROW) {
+				for (int y = b; y <= c; y++) {
+					if (y == b) {
+						cells[y][a] = CellShipTopDestroyed;
+					} else if (y == c) {
+						cells[y][a] = CellShipBottomDestroyed;
+					} else {
+						cells[y][a] = CellShipVerticalDestroyed;
+					}
+				}
+			} else if (message.direction == 'h' && a <= b && b < COLUMN && c < ROW) {
+				for (int x = a; x <= b; x++) {
+					if (x == a) {
+						cells[c][x] = CellShipLeftDestroyed;
+					} else if (x == b) {
+						cells[c][x] = CellShipRightDestroyed;
+					} else {
+						cells[c][x] = CellShipHorizontalDestroyed;
+					}
+				}
+			} else {
+				break;
+			}
+			status->hp[player] -= 1;
+			break;
+		}
+		case MessageFire:
+		case MessageIgnore:
+		case MessageBinary:
+		case MessageTypes:
+			break;
+	}
+}
+
+void handle_spectate_action(Status* status) {
+	SpectateStatus* spectate = &status->spectate;
+	struct pollfd fds = { .fd = status->sock_fd, .events = POLLIN, };
+	while (!spectate->over && poll(&fds, 1, 0) > 0) {
+		size_t space = sizeof(spectate->pending) - 1 - spectate->pending_len;
+		ssize_t readed = read(status->sock_fd, spectate->pending + spectate->pending_len, space);
+		if (readed == -1) {
+			status->page = Error;
+			break;
+		} else if (readed == 0) {
+			// the relay server hangs up once the game ends, or right away when there is nothing to watch
+			spectate->pending[spectate->pending_len] = '\0';
+			if (string_has_prefix(spectate->pending, REDIRECT_PREFIX)) {
+				spectate->pending_len = 0;
+				follow_redirect(status, spectate->pending);
+			} else if (!spectate->watching && string_has_prefix(spectate->pending, ERROR_PREFIX) &&
+				!string_has_prefix(spectate->pending, ERROR_PREFIX "no game to watch")) {
+				// turned away before watching, like a full server, which the waiting page would pass off as no game
+				spectate->pending_len = 0;
+				show_server_error(status, spectate->pending + strlen(ERROR_PREFIX));
+			} else {
+				spectate->over = true;
+			}
+			break;
+		}
+		spectate->pending_len += readed;
+		spectate->pending[spectate->pending_len] = '\0';
+
+		char* line = spectate->pending;
+		char* newline;
+		while ((newline = strchr(line, '\n')) != NULL) {
+			*newline = '\0';
+			handle_spectate_line(spectate, line);
+			line = newline + 1;
+		}
+		spectate->pending_len -= line - spectate->pending;
+		memmove(spectate->pending, line, spectate->pending_len);
+		// a line that never ends is thrown away
+		if (spectate->pending_len == sizeof(spectate->pending) - 1) {
+			spectate->pending_len = 0;
 		}
 	}
 }
@@ -1770,6 +2419,7 @@ void handle_actions(Status* status) {
 				status->sock_fd = accepted_fd;
 				socket_fd = accepted_fd;
 				status->game.is_player_1 = true;
+				offer_binary(status);
 			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				status->page = Error;
 			}
@@ -1783,6 +2433,7 @@ void handle_actions(Status* status) {
 			if (err == 0 || errno == EISCONN) {
 				status->page = Game;
 				status->game.is_player_1 = false;
+				offer_binary(status);
 			} else if (errno != EAGAIN && errno != EALREADY && errno != EINPROGRESS) {
 				status->page = Error;
 			}
@@ -1794,7 +2445,13 @@ void handle_actions(Status* status) {
 			int err = connect(status->sock_fd, (struct sockaddr*)&addr, sizeof(addr));
 			// openbsd will have error code EISCONN when connected
 			if (err == 0 || errno == EISCONN) {
-				status->page = EnterRelayServerKey;
+				if (status->relay_server.resume != EnterRelayServerKey) {
+					// connected to the server a redirect named, carry on as if the first server had taken the key
+					send_handshake(status, status->relay_server.handshake, status->relay_server.resume);
+					status->relay_server.resume = EnterRelayServerKey;
+				} else {
+					status->page = EnterRelayServerKey;
+				}
 			} else if (errno != EAGAIN && errno != EALREADY && errno != EINPROGRESS) {
 				status->page = Error;
 			}
@@ -1811,15 +2468,24 @@ void handle_actions(Status* status) {
 					status->page = Error;
 				} else if (readed == 0) {
 					status->running = false;
+				} else if (string_has_prefix(buf, REDIRECT_PREFIX)) {
+					follow_redirect(status, buf);
+				} else if (string_has_prefix(buf, ERROR_PREFIX)) {
+					show_server_error(status, buf + strlen(ERROR_PREFIX));
 				} else {
-					if (streq(buf, "CONNECTED AS 1")) {
+					size_t connected_len = strlen("CONNECTED AS 1");
+					if (string_has_prefix(buf, "CONNECTED AS 1")) {
 						status->game.is_player_1 = true;
-					} else if (streq(buf, "CONNECTED AS 2")) {
+					} else if (string_has_prefix(buf, "CONNECTED AS 2")) {
 						status->game.is_player_1 = false;
 					} else {
-						assert(streq(buf, "CONNECTED AS 1") || streq(buf, "CONNECTED AS 2"));
+						assert(string_has_prefix(buf, "CONNECTED AS 1") || string_has_prefix(buf, "CONNECTED AS 2"));
 					}
+					// the other player may have written already, its messages are right behind
+					status->game.pending_len = readed - connected_len;
+					memcpy(status->game.pending, buf + connected_len, status->game.pending_len);
 					status->page = Game;
+					offer_binary(status);
 				}
 			}
 
@@ -1828,6 +2494,9 @@ void handle_actions(Status* status) {
 		case Game:
 			handle_game_action(status);
 			break;
+		case Spectating:
+			handle_spectate_action(status);
+			break;
 	}
 }
 
@@ -1851,9 +2520,117 @@ void ctrl_c(void) {
 	assert(err != -1);
 }
 
+void print_page(Status* status) {
+	switch (status->page) {
+		case Greeting:
+			print_ui(greeting_screen(greeting_options(status->greeting.selection)));
+			break;
+		case DirectConnect:
+			print_ui(greeting_screen(direct_connect_options(status->direct_connect.selection)));
+			break;
+		case ConnectingRelayServer:
+			print_ui(greeting_screen(connect_relay_server_options(status->relay_server.connect_addr, status->relay_server.selection)));
+			break;
+		case Creating:
+			print_ui(greeting_screen(creating_options(status->creating.port, status->creating.selection)));
+			break;
+		case Join:
+			print_ui(greeting_screen(join_options(status->join.connect_addr, status->join.selection)));
+			break;
+		case EnterRelayServerKey:
+			print_ui(greeting_screen(enter_relay_server_key_options(status->relay_server.key.value, status->relay_server.key.selection)));
+			break;
+		case WaitingClient:
+			print_ui(greeting_screen(waiting_client(status->creating.port)));
+			break;
+		case WaitingServer:
+			print_ui(greeting_screen(waiting_server(status->join.connect_addr)));
+			break;
+		case WaitingRelayServer:
+			print_ui(greeting_screen(waiting_relay_server(status->relay_server.connect_addr)));
+			break;
+		case WaitingOtherPlayer:
+			print_ui(greeting_screen(waiting_other_player(status->relay_server.key.value)));
+			break;
+		case Game:
+			print_ui(game_ui(&status->game));
+			break;
+		case Spectating:
+			if (status->spectate.watching) {
+				print_ui(spectate_ui(&status->spectate));
+			} else {
+				print_ui(greeting_screen(waiting_game(status->relay_server.key.value, status->spectate.over)));
+			}
+			break;
+		case End:
+			print_ui(end_ui(&status->game));
+			break;
+		case Error:
+			print_ui(error_screen(status->server_error));
+			break;
+	}
+}
+
+void winch_handler(int sig) {
+	assert(sig == SIGWINCH);
+	int saved_errno = errno;
+	write(winch_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+// the terminal size is read again by the next frame, the handler only has to wake the main loop up
+void winch(void) {
+	int err = pipe(winch_pipe);
+	assert(err != -1);
+	for (int i = 0; i < 2; i++) {
+		err = fcntl(winch_pipe[i], F_SETFL, fcntl(winch_pipe[i], F_GETFL) | O_NONBLOCK);
+		assert(err != -1);
+	}
+
+	struct sigaction sa;
+	sa.sa_handler = winch_handler;
+	err = sigemptyset(&sa.sa_mask);
+	assert(err != -1);
+	sa.sa_flags = SA_RESTART;
+	err = sigaction(SIGWINCH, &sa, NULL);
+	assert(err != -1);
+}
+
+// what the socket is waited for on the current page, 0 when the page does not use it
+short socket_events(Status* status) {
+	switch (status->page) {
+		case WaitingClient:
+		case WaitingOtherPlayer:
+		case Game:
+			return POLLIN;
+		case Spectating:
+			// the relay server has hung up, the socket would stay readable
+			if (status->spectate.over) {
+				return 0;
+			}
+			return POLLIN;
+		case WaitingServer:
+		case WaitingRelayServer:
+			return POLLOUT;
+		case Greeting:
+		case DirectConnect:
+		case ConnectingRelayServer:
+		case Creating:
+		case Join:
+		case EnterRelayServerKey:
+		case End:
+		case Error:
+			return 0;
+	}
+	return 0;
+}
+
 int main(int argc, char** argv) {
 	ctrl_c();
+	winch();
 	enter_alter_screen();
+	// keys are read one at a time, a buffered one would wait for the next wake up
+	setvbuf(stdin, NULL, _IONBF, 0);
 
 	Status status = {
 		.running = true,
@@ -1872,6 +2649,14 @@ int main(int argc, char** argv) {
 			.enemy_max_hp = 0,
 			.self_turn_factor = -1,
 			.enemy_turn_factor = -1,
+			.peer_binary = false,
+			.pending_len = 0,
+		},
+		.spectate = {
+			.boards = {0},
+			.watching = false,
+			.over = false,
+			.pending_len = 0,
 		},
 		.greeting = {
 			.selection = GreetingNone,
@@ -1887,7 +2672,10 @@ int main(int argc, char** argv) {
 				.selection = EnterRelayServerKeyTyping,
 				.value = {0},
 				.cursor = 0,
-			}
+			},
+			.handshake = {0},
+			.resume = EnterRelayServerKey,
+			.redirects = 0,
 		},
 		.creating = {
 			.selection = CreatingTyping,
@@ -1902,52 +2690,39 @@ int main(int argc, char** argv) {
 	socket_fd = status.sock_fd;
 
 	while (status.running) {
-		handle_key_event(&status);
+		// nothing changes between wake ups, so a frame is only drawn after one, and the renderer skips what did not change
+		print_page(&status);
 
-		handle_actions(&status);
+		struct pollfd fds[3] = {
+			{ .fd = STDIN_FILENO, .events = POLLIN, },
+			{ .fd = winch_pipe[0], .events = POLLIN, },
+			{ .fd = -1, .events = 0, },
+		};
+		short events = socket_events(&status);
+		if (events != 0) {
+			fds[2] = (struct pollfd){ .fd = status.sock_fd, .events = events, };
+		}
+		// no page has a deadline, the loop sleeps until a key, the socket or a resize wakes it up
+		int polled = poll(fds, 3, -1);
+		if (polled == -1) {
+			assert(errno == EINTR);
+			continue;
+		}
+		if (fds[1].revents != 0) {
+			char drain[16];
+			while (read(winch_pipe[0], drain, sizeof(drain)) > 0) {
+			}
+		}
 
-		switch (status.page) {
-			case Greeting:
-				print_ui(greeting_screen(greeting_options(status.greeting.selection)));
-				break;
-			case DirectConnect:
-				print_ui(greeting_screen(direct_connect_options(status.direct_connect.selection)));
-				break;
-			case ConnectingRelayServer:
-				print_ui(greeting_screen(connect_relay_server_options(status.relay_server.connect_addr, status.relay_server.selection)));
-				break;
-			case Creating:
-				print_ui(greeting_screen(creating_options(status.creating.port, status.creating.selection)));
-				break;
-			case Join:
-				print_ui(greeting_screen(join_options(status.join.connect_addr, status.join.selection)));
-				break;
-			case EnterRelayServerKey:
-				print_ui(greeting_screen(enter_relay_server_key_options(status.relay_server.key.value, status.relay_server.key.selection)));
-				break;
-			case WaitingClient:
-				print_ui(greeting_screen(waiting_client(status.creating.port)));
-				break;
-			case WaitingServer:
-				print_ui(greeting_screen(waiting_server(status.join.connect_addr)));
-				break;
-			case WaitingRelayServer:
-				print_ui(greeting_screen(waiting_relay_server(status.relay_server.connect_addr)));
-				break;
-			case WaitingOtherPlayer:
-				print_ui(greeting_screen(waiting_other_player(status.relay_server.key.value)));
-				break;
-			case Game:
-				print_ui(game_ui(&status.game));
-				break;
-			case End:
-				print_ui(end_ui(&status.game));
-				break;
-			case Error:
-				print_ui(error_screen());
-				break;
+		Page page = status.page;
+		handle_key_event(&status);
+		handle_actions(&status);
+		// a page that was just entered runs its action once right away, it may already have something to do, like the
+		// messages that came in together with CONNECTED AS
+		while (status.running && status.page != page) {
+			page = status.page;
+			handle_actions(&status);
 		}
-		usleep(1000*1000/60);
 	}
 
 	leave_alter_screen();
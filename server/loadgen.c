@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEY_LEN 5
+#define KEY_SPACE (26 * 26 * 26 * 26 * 26)
+#define MAX_EVENTS 256
+#define LINE_LEN 256
+// the board of main.c
+#define COLUMN 10
+#define ROW 12
+// the ship cells of a full fleet, only sent in READY
+#define MAX_HP 17
+
+typedef enum BotState {
+	BotConnecting,
+	BotWaiting,
+	BotPlaying,
+	BotDone,
+} BotState;
+
+typedef struct Game Game;
+
+// one scripted player, it speaks the same protocol as main.c
+typedef struct Bot {
+	int fd;
+	BotState state;
+	Game* game;
+	bool is_player_1;
+	bool my_turn;
+	bool peer_ready;
+	uint32_t shots_left;
+	// cells of its own board the peer fired at, a second FIRE on one is answered with IGNORE
+	bool shot[ROW][COLUMN];
+	// when the outstanding FIRE was sent, 0 when there is none
+	uint64_t fired_at;
+	size_t len;
+	char buf[LINE_LEN];
+} Bot;
+
+struct Game {
+	Bot bots[2];
+	char key[KEY_LEN + 1];
+	bool closed;
+	// games closed in this batch, freed once no event can refer to them
+	Game* next_closed;
+};
+
+typedef struct Options {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	// games played at the same time
+	size_t concurrency;
+	// new games started per second, 0 for as fast as possible
+	double rate;
+	// FIRE messages sent by each player of a game
+	uint32_t shots;
+	// seconds to run
+	uint32_t duration;
+} Options;
+
+typedef struct Report {
+	uint64_t pairs;
+	uint64_t games;
+	uint64_t messages;
+	uint64_t errors;
+	// round-trip latency of every FIRE in microseconds
+	uint32_t* latencies;
+	size_t latencies_len;
+	size_t latencies_cap;
+} Report;
+
+typedef struct Loadgen {
+	Options* options;
+	int epoll_fd;
+	size_t active;
+	uint64_t next_key;
+	Game* closed;
+	Report report;
+	// set when the server refused a connection, the run stops instead of retrying into an error flood
+	bool refused;
+} Loadgen;
+
+bool streq(const char* a, const char* b) {
+	return strcmp(a, b) == 0;
+}
+
+bool has_prefix(const char* str, const char* prefix) {
+	return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+uint64_t now_ns(void) {
+	struct timespec now;
+	int err = clock_gettime(CLOCK_MONOTONIC, &now);
+	assert(err == 0);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void report_latency(Report* report, uint64_t ns) {
+	if (report->latencies_len == report->latencies_cap) {
+		report->latencies_cap = report->latencies_cap == 0 ? 4096 : report->latencies_cap * 2;
+		report->latencies = realloc(report->latencies, report->latencies_cap * sizeof(uint32_t));
+		assert(report->latencies != NULL);
+	}
+	uint64_t us = ns / 1000;
+	report->latencies[report->latencies_len] = us > UINT32_MAX ? UINT32_MAX : us;
+	report->latencies_len += 1;
+}
+
+int compare_latency(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+bool bot_send(Loadgen* loadgen, Bot* bot, const char* message) {
+	size_t len = strlen(message);
+	// every message is far smaller than the socket buffer, so a short write means the peer is gone
+	ssize_t written = write(bot->fd, message, len);
+	if (written != len) {
+		if (written == -1) {
+			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
+		} else {
+			fprintf(stderr, "[ERROR] not all bytes are written (%ld / %ld) (line: %d)\n", written, len, __LINE__);
+		}
+		return false;
+	}
+	loadgen->report.messages += 1;
+	return true;
+}
+
+void game_close(Loadgen* loadgen, Game* game, bool failed) {
+	if (game->closed) {
+		return;
+	}
+	game->closed = true;
+	for (size_t i = 0; i < 2; i++) {
+		close(game->bots[i].fd);
+	}
+	if (failed) {
+		loadgen->report.errors += 1;
+	} else {
+		loadgen->report.games += 1;
+	}
+	loadgen->active -= 1;
+	game->next_closed = loadgen->closed;
+	loadgen->closed = game;
+}
+
+void loadgen_free_closed(Loadgen* loadgen) {
+	while (loadgen->closed != NULL) {
+		Game* game = loadgen->closed;
+		loadgen->closed = game->next_closed;
+		free(game);
+	}
+}
+
+bool bot_fire(Loadgen* loadgen, Bot* bot) {
+	char message[LINE_LEN];
+	snprintf(message, sizeof(message), "FIRE %ld,%ld\n", random() % COLUMN, random() % ROW);
+	bot->my_turn = false;
+	bot->shots_left -= 1;
+	bot->fired_at = now_ns();
+	return bot_send(loadgen, bot, message);
+}
+
+// a bot is done once it fired every shot and got the answer to the last one
+void bot_check_done(Loadgen* loadgen, Bot* bot) {
+	if (bot->shots_left == 0 && bot->fired_at == 0) {
+		bot->state = BotDone;
+	}
+	Game* game = bot->game;
+	if (game->bots[0].state == BotDone && game->bots[1].state == BotDone) {
+		game_close(loadgen, game, false);
+	}
+}
+
+// the defending side of main.c: answer a FIRE, then it is this bot's turn
+bool bot_answer(Loadgen* loadgen, Bot* bot, const char* line) {
+	int x;
+	int y;
+	if (sscanf(line, "FIRE %d,%d", &x, &y) != 2) {
+		fprintf(stderr, "[ERROR] bad FIRE `%s` (line: %d)\n", line, __LINE__);
+		return false;
+	}
+	if (x < 0 || x >= COLUMN || y < 0 || y >= ROW) {
+		fprintf(stderr, "[ERROR] FIRE out of the board `%s` (line: %d)\n", line, __LINE__);
+		return false;
+	}
+	// the shooter counts the columns from the other side, answers are in the coordinates of this board
+	x = COLUMN - x - 1;
+	// a fixed scripted board with fewer ship cells than MAX_HP, so a game never ends early and every answer
+	// the real client can give shows up
+	char message[LINE_LEN];
+	int cell = y * COLUMN + x;
+	if (bot->shot[y][x]) {
+		snprintf(message, sizeof(message), "IGNORE\n");
+	} else if (cell % 16 == 0) {
+		snprintf(message, sizeof(message), "DESTROYED h,%d,%d,%d\n", x, x, y);
+	} else if (cell % 8 == 0) {
+		snprintf(message, sizeof(message), "HIT %d,%d\n", x, y);
+	} else {
+		snprintf(message, sizeof(message), "MISS %d,%d\n", x, y);
+	}
+	bot->shot[y][x] = true;
+	if (!bot_send(loadgen, bot, message)) {
+		return false;
+	}
+	bot->my_turn = true;
+	if (bot->shots_left > 0) {
+		return bot_fire(loadgen, bot);
+	}
+	return true;
+}
+
+bool bot_handle_line(Loadgen* loadgen, Bot* bot, const char* line) {
+	if (has_prefix(line, "READY")) {
+		bot->peer_ready = true;
+		if (bot->my_turn && bot->shots_left > 0) {
+			return bot_fire(loadgen, bot);
+		}
+	} else if (has_prefix(line, "FIRE")) {
+		return bot_answer(loadgen, bot, line);
+	} else if (has_prefix(line, "HIT") || has_prefix(line, "MISS") || has_prefix(line, "DESTROYED") || has_prefix(line, "IGNORE")) {
+		if (bot->fired_at == 0) {
+			fprintf(stderr, "[ERROR] an answer without a FIRE `%s` (line: %d)\n", line, __LINE__);
+			return false;
+		}
+		report_latency(&loadgen->report, now_ns() - bot->fired_at);
+		bot->fired_at = 0;
+	} else {
+		fprintf(stderr, "[ERROR] unknown message `%s` (line: %d)\n", line, __LINE__);
+		return false;
+	}
+	return true;
+}
+
+// returns false when the game should fail
+bool bot_handle_input(Loadgen* loadgen, Bot* bot) {
+	while (true) {
+		ssize_t readed = read(bot->fd, bot->buf + bot->len, sizeof(bot->buf) - 1 - bot->len);
+		if (readed == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
+			return false;
+		} else if (readed == 0) {
+			fprintf(stderr, "[ERROR] the server closed a game (line: %d)\n", __LINE__);
+			return false;
+		}
+		bot->len += readed;
+		bot->buf[bot->len] = '\0';
+
+		if (bot->state == BotWaiting) {
+			// the server messages have no newline, the relayed ones all have one
+			if (has_prefix(bot->buf, "error")) {
+				fprintf(stderr, "[ERROR] server: `%s` (line: %d)\n", bot->buf, __LINE__);
+				return false;
+			}
+			const char* connected = "CONNECTED AS ";
+			if (bot->len < strlen(connected) + 1) {
+				continue;
+			}
+			if (!has_prefix(bot->buf, connected)) {
+				fprintf(stderr, "[ERROR] unexpected `%s` (line: %d)\n", bot->buf, __LINE__);
+				return false;
+			}
+			bot->is_player_1 = bot->buf[strlen(connected)] == '1';
+			bot->len -= strlen(connected) + 1;
+			memmove(bot->buf, bot->buf + strlen(connected) + 1, bot->len + 1);
+			bot->state = BotPlaying;
+			// same turn order as main.c with both turn factors at 0
+			bot->my_turn = !bot->is_player_1;
+			if (bot->game->bots[0].state != BotWaiting && bot->game->bots[1].state != BotWaiting) {
+				loadgen->report.pairs += 1;
+			}
+			char message[LINE_LEN];
+			snprintf(message, sizeof(message), "READY 0,%d\n", MAX_HP);
+			if (!bot_send(loadgen, bot, message)) {
+				return false;
+			}
+		}
+
+		char* line = bot->buf;
+		char* end;
+		while ((end = strchr(line, '\n')) != NULL) {
+			*end = '\0';
+			if (!bot_handle_line(loadgen, bot, line)) {
+				return false;
+			}
+			line = end + 1;
+		}
+		bot->len -= line - bot->buf;
+		memmove(bot->buf, line, bot->len + 1);
+		if (bot->len == sizeof(bot->buf) - 1) {
+			fprintf(stderr, "[ERROR] a line is too long (line: %d)\n", __LINE__);
+			return false;
+		}
+	}
+	if (bot->state == BotPlaying) {
+		bot_check_done(loadgen, bot);
+	}
+	return true;
+}
+
+bool bot_handle_connected(Loadgen* loadgen, Bot* bot) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	getsockopt(bot->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+	if (err != 0) {
+		fprintf(stderr, "[ERROR] connect error: %s (line: %d)\n", strerror(err), __LINE__);
+		loadgen->refused = err == ECONNREFUSED;
+		return false;
+	}
+	struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = bot };
+	err = epoll_ctl(loadgen->epoll_fd, EPOLL_CTL_MOD, bot->fd, &event);
+	assert(err == 0);
+
+	bot->state = BotWaiting;
+	return bot_send(loadgen, bot, bot->game->key);
+}
+
+void game_start(Loadgen* loadgen) {
+	Game* game = calloc(1, sizeof(Game));
+	assert(game != NULL);
+	loadgen->active += 1;
+	uint64_t key = loadgen->next_key % KEY_SPACE;
+	loadgen->next_key += 1;
+	for (int i = KEY_LEN - 1; i >= 0; i--) {
+		game->key[i] = 'a' + key % 26;
+		key /= 26;
+	}
+	for (size_t i = 0; i < 2; i++) {
+		game->bots[i] = (Bot){
+			.fd = -1,
+			.state = BotConnecting,
+			.game = game,
+			.shots_left = loadgen->options->shots,
+			.fired_at = 0,
+			.len = 0,
+		};
+	}
+	for (size_t i = 0; i < 2; i++) {
+		Bot* bot = &game->bots[i];
+		bot->fd = socket(loadgen->options->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (bot->fd == -1) {
+			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
+			game_close(loadgen, game, true);
+			return;
+		}
+		int one = 1;
+		setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		int err = connect(bot->fd, (struct sockaddr*)&loadgen->options->addr, loadgen->options->addr_len);
+		if (err == -1 && errno != EINPROGRESS) {
+			fprintf(stderr, "[ERROR] connect error: %s (line: %d)\n", strerror(errno), __LINE__);
+			game_close(loadgen, game, true);
+			return;
+		}
+		struct epoll_event event = { .events = EPOLLOUT, .data.ptr = bot };
+		err = epoll_ctl(loadgen->epoll_fd, EPOLL_CTL_ADD, bot->fd, &event);
+		assert(err == 0);
+	}
+}
+
+void bot_handle_event(Loadgen* loadgen, Bot* bot, uint32_t events) {
+	if (bot->game->closed) {
+		return;
+	}
+	bool ok = true;
+	if (bot->state == BotConnecting) {
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+			ok = bot_handle_connected(loadgen, bot);
+		}
+	} else if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+		ok = bot_handle_input(loadgen, bot);
+	}
+	if (!ok) {
+		game_close(loadgen, bot->game, true);
+	}
+}
+
+void print_report(Report* report, double seconds) {
+	printf("[LOG] %.1fs: %lu pairs (%.0f/s), %lu games, %lu messages (%.0f/s), %lu errors\n",
+		seconds, report->pairs, report->pairs / seconds, report->games,
+		report->messages, report->messages / seconds, report->errors);
+	if (report->latencies_len == 0) {
+		return;
+	}
+	qsort(report->latencies, report->latencies_len, sizeof(uint32_t), compare_latency);
+	double quantiles[3] = { 0.5, 0.99, 0.999 };
+	const char* names[3] = { "p50", "p99", "p999" };
+	printf("[LOG] round trip of %lu FIRE messages:", report->latencies_len);
+	for (size_t i = 0; i < 3; i++) {
+		size_t index = quantiles[i] * (report->latencies_len - 1);
+		printf(" %s %uus", names[i], report->latencies[index]);
+	}
+	printf("\n");
+}
+
+int run(Options* options) {
+	Loadgen loadgen = {
+		.options = options,
+		.epoll_fd = epoll_create1(EPOLL_CLOEXEC),
+		.active = 0,
+		// keys start at a random point so a run does not pair with leftovers of the last one
+		.next_key = random() % KEY_SPACE,
+		.closed = NULL,
+		.report = {0},
+		.refused = false,
+	};
+	if (loadgen.epoll_fd == -1) {
+		fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
+		return errno;
+	}
+
+	uint64_t started = now_ns();
+	uint64_t last_refill = started;
+	uint64_t last_print = started;
+	Report last_report = {0};
+	double tokens = 0;
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		uint64_t now = now_ns();
+		if (now - started >= (uint64_t)options->duration * 1000000000 || loadgen.refused) {
+			break;
+		}
+		// the ramp: new games are limited by a token bucket of at most one second of starts
+		if (options->rate > 0) {
+			tokens += options->rate * (now - last_refill) / 1e9;
+			if (tokens > options->rate) {
+				tokens = options->rate;
+			}
+		} else {
+			tokens = options->concurrency;
+		}
+		last_refill = now;
+		while (loadgen.active < options->concurrency && tokens >= 1) {
+			game_start(&loadgen);
+			tokens -= 1;
+		}
+
+		if (now - last_print >= 1000000000) {
+			double seconds = (now - last_print) / 1e9;
+			printf("[LOG] %lu active games, %.0f pairs/s, %.0f messages/s, %lu errors\n", loadgen.active,
+				(loadgen.report.pairs - last_report.pairs) / seconds,
+				(loadgen.report.messages - last_report.messages) / seconds,
+				loadgen.report.errors);
+			fflush(stdout);
+			last_report = loadgen.report;
+			last_print = now;
+		}
+
+		int polled = epoll_wait(loadgen.epoll_fd, events, MAX_EVENTS, 10);
+		if (polled == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "[ERROR] error on epoll_wait %s (line: %d)\n", strerror(errno), __LINE__);
+			return errno;
+		}
+		for (int i = 0; i < polled; i++) {
+			bot_handle_event(&loadgen, events[i].data.ptr, events[i].events);
+		}
+		loadgen_free_closed(&loadgen);
+	}
+
+	print_report(&loadgen.report, (now_ns() - started) / 1e9);
+	return 0;
+}
+
+// parse a whole decimal number no bigger than `max`
+bool parse_number(const char* str, uint64_t max, uint64_t* number) {
+	char* end;
+	errno = 0;
+	uint64_t tmp = strtoull(str, &end, 10);
+	if (end == str || *end != '\0' || errno != 0 || tmp > max) {
+		return false;
+	}
+	*number = tmp;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	Options options = {
+		.concurrency = 1000,
+		.rate = 0,
+		.shots = 50,
+		.duration = 10,
+	};
+	const char* host = "127.0.0.1";
+	char* port_str = NULL;
+	for (int i = 1; i < argc; i++) {
+		uint64_t number;
+		if (streq(argv[i], "--host") && i + 1 < argc) {
+			i += 1;
+			host = argv[i];
+		} else if ((streq(argv[i], "--concurrency") || streq(argv[i], "--rate") || streq(argv[i], "--shots") || streq(argv[i], "--duration")) && i + 1 < argc) {
+			const char* flag = argv[i];
+			i += 1;
+			if (!parse_number(argv[i], UINT32_MAX, &number)) {
+				fprintf(stderr, "[ERROR] the value `%s` of %s is not a number (line: %d)\n", argv[i], flag, __LINE__);
+				return 1;
+			}
+			if (streq(flag, "--concurrency")) {
+				options.concurrency = number;
+			} else if (streq(flag, "--rate")) {
+				options.rate = number;
+			} else if (streq(flag, "--shots")) {
+				options.shots = number;
+			} else {
+				options.duration = number;
+			}
+		} else if (port_str == NULL) {
+			port_str = argv[i];
+		} else {
+			port_str = NULL;
+			break;
+		}
+	}
+	if (port_str == NULL) {
+		printf("usage: %s [--host <host>] [--concurrency <games>] [--rate <games/s>]\n"
+			"    [--shots <n>] [--duration <s>] <port>\n", argv[0]);
+		return 0;
+	}
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* result;
+	int err = getaddrinfo(host, port_str, &hints, &result);
+	if (err != 0) {
+		fprintf(stderr, "[ERROR] %s (line: %d)\n", gai_strerror(err), __LINE__);
+		return 1;
+	}
+	memcpy(&options.addr, result->ai_addr, result->ai_addrlen);
+	options.addr_len = result->ai_addrlen;
+	freeaddrinfo(result);
+
+	// two sockets per game
+	struct rlimit limit;
+	err = getrlimit(RLIMIT_NOFILE, &limit);
+	if (err == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (err == 0 && limit.rlim_cur != RLIM_INFINITY && options.concurrency * 2 + 16 > limit.rlim_cur) {
+		fprintf(stderr, "[ERROR] %zu games need more fds than the limit of %lu (line: %d)\n", options.concurrency, (unsigned long)limit.rlim_cur, __LINE__);
+		return 1;
+	}
+
+	srandom(time(NULL));
+	printf("[LOG] %zu concurrent games of %u shots per player for %us\n", options.concurrency, options.shots, options.duration);
+	return run(&options);
+}
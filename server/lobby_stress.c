@@ -0,0 +1,223 @@
+// hammers the lobby of server.c from many threads at once and checks that no player is lost or paired twice, the
+// players are made up fds that never touch a socket
+#define main server_main
+#include "server.c"
+#undef main
+
+// what became of a player, a partner is the id of the other player
+#define PLAYER_NONE 0
+#define PLAYER_REMOVED -1
+#define PLAYER_REJECTED -2
+
+typedef struct StressOptions {
+	uint32_t threads;
+	uint32_t joins;
+	// few keys make the players collide on the same slots
+	uint32_t keys;
+	uint32_t cap;
+} StressOptions;
+
+typedef struct Stress {
+	StressOptions options;
+	Lobby lobby;
+	// indexed by the player id, which is its fd, ids start at 1
+	_Atomic int32_t* players;
+	_Atomic uint64_t errors;
+} Stress;
+
+typedef struct StressWaiter {
+	int32_t id;
+	uint32_t key;
+} StressWaiter;
+
+typedef struct StressThread {
+	Stress* stress;
+	uint32_t index;
+	pthread_t thread;
+} StressThread;
+
+void stress_error(Stress* stress, const char* what, int32_t id, int32_t other) {
+	if (atomic_fetch_add(&stress->errors, 1) < 10) {
+		fprintf(stderr, "[ERROR] %s: player %d, other %d\n", what, id, other);
+	}
+}
+
+void stress_key(uint32_t index, char* key) {
+	for (size_t i = 0; i < KEY_LEN; i++) {
+		key[KEY_LEN - 1 - i] = 'a' + index % 26;
+		index /= 26;
+	}
+	key[KEY_LEN] = '\0';
+}
+
+uint32_t stress_random(uint32_t* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+void* stress_thread(void* raw_thread) {
+	StressThread* thread = raw_thread;
+	Stress* stress = thread->stress;
+	StressOptions* options = &stress->options;
+	uint32_t state = thread->index * 2654435761u + 1;
+	// players of this thread that were told to wait, some of them are paired by other threads meanwhile
+	StressWaiter* waiting = malloc(options->joins * sizeof(StressWaiter));
+	assert(waiting != NULL);
+	size_t waiting_len = 0;
+
+	for (uint32_t i = 0; i < options->joins; i++) {
+		int32_t id = thread->index * options->joins + i + 1;
+		uint32_t key_index = stress_random(&state) % options->keys;
+		char key[KEY_LEN + 1];
+		stress_key(key_index, key);
+		int wait_sock_fd;
+		LobbyResult joined = lobby_join(&stress->lobby, key, id, &wait_sock_fd);
+		if (joined == LobbyPaired) {
+			int32_t expected = PLAYER_NONE;
+			if (!atomic_compare_exchange_strong(&stress->players[wait_sock_fd], &expected, id)) {
+				stress_error(stress, "paired a player that was already gone", wait_sock_fd, expected);
+			}
+			atomic_store(&stress->players[id], wait_sock_fd);
+		} else if (joined == LobbyFull) {
+			if (options->cap == 0) {
+				stress_error(stress, "rejected without a cap", id, 0);
+			}
+			atomic_store(&stress->players[id], PLAYER_REJECTED);
+		} else {
+			waiting[waiting_len++] = (StressWaiter){ .id = id, .key = key_index };
+		}
+
+		// a waiting player hangs up now and then
+		if (waiting_len > 0 && stress_random(&state) % 4 == 0) {
+			size_t pick = stress_random(&state) % waiting_len;
+			StressWaiter leaving = waiting[pick];
+			waiting[pick] = waiting[--waiting_len];
+			stress_key(leaving.key, key);
+			// false when another thread paired it first
+			if (lobby_remove(&stress->lobby, key, leaving.id)) {
+				int32_t expected = PLAYER_NONE;
+				if (!atomic_compare_exchange_strong(&stress->players[leaving.id], &expected, PLAYER_REMOVED)) {
+					stress_error(stress, "removed a player that was paired", leaving.id, expected);
+				}
+			}
+		}
+	}
+	free(waiting);
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	StressOptions options = {
+		.threads = 8,
+		.joins = 200000,
+		.keys = 64,
+		.cap = 0,
+	};
+	for (int i = 1; i < argc; i++) {
+		uint64_t number;
+		if ((streq(argv[i], "--threads") || streq(argv[i], "--joins") || streq(argv[i], "--keys") || streq(argv[i], "--cap")) && i + 1 < argc) {
+			const char* flag = argv[i];
+			i += 1;
+			if (!parse_number(argv[i], 1 << 20, &number)) {
+				fprintf(stderr, "[ERROR] the value `%s` of %s is not a number (line: %d)\n", argv[i], flag, __LINE__);
+				return 1;
+			}
+			if (streq(flag, "--threads")) {
+				options.threads = number;
+			} else if (streq(flag, "--joins")) {
+				options.joins = number;
+			} else if (streq(flag, "--keys")) {
+				options.keys = number;
+			} else {
+				options.cap = number;
+			}
+		} else {
+			printf("usage: %s [--threads <n>] [--joins <per thread>] [--keys <n>] [--cap <sockets>]\n", argv[0]);
+			return 0;
+		}
+	}
+	uint64_t players_len = (uint64_t)options.threads * options.joins + 1;
+	if (options.threads == 0 || options.keys == 0 || options.keys > KEY_SPACE || players_len >= (1 << SLOT_FD_BITS)) {
+		fprintf(stderr, "[ERROR] needs at least one thread and key, at most %d keys and %d players (line: %d)\n", KEY_SPACE, (1 << SLOT_FD_BITS) - 1, __LINE__);
+		return 1;
+	}
+
+	logger.level = LogError;
+	Stress stress = {
+		.options = options,
+		.lobby = lobby_new(),
+	};
+	stress.lobby.cap = options.cap;
+	stress.players = calloc(players_len, sizeof(_Atomic int32_t));
+	assert(stress.players != NULL);
+
+	StressThread* threads = calloc(options.threads, sizeof(StressThread));
+	assert(threads != NULL);
+	uint64_t start = now_ns();
+	for (uint32_t i = 0; i < options.threads; i++) {
+		threads[i] = (StressThread){ .stress = &stress, .index = i };
+		int err = pthread_create(&threads[i].thread, NULL, stress_thread, &threads[i]);
+		assert(err == 0);
+	}
+	for (uint32_t i = 0; i < options.threads; i++) {
+		int err = pthread_join(threads[i].thread, NULL);
+		assert(err == 0);
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	// every player still in a slot waits, and only once
+	bool* still_waiting = calloc(players_len, sizeof(bool));
+	assert(still_waiting != NULL);
+	uint64_t waiting = 0;
+	for (size_t i = 0; i <= KEY_SPACE; i++) {
+		uint64_t entry = atomic_load(&stress.lobby.slots[i]);
+		if (entry == 0) {
+			continue;
+		}
+		int32_t id = entry_fd(entry);
+		if (id <= 0 || id >= players_len || still_waiting[id]) {
+			stress_error(&stress, "a slot holds a player twice or one that never joined", id, 0);
+			continue;
+		}
+		if (atomic_load(&stress.players[id]) != PLAYER_NONE) {
+			stress_error(&stress, "a player waits that is already gone", id, atomic_load(&stress.players[id]));
+		}
+		still_waiting[id] = true;
+		waiting += 1;
+	}
+
+	uint64_t pairs = 0;
+	uint64_t removed = 0;
+	uint64_t rejected = 0;
+	for (int32_t id = 1; id < players_len; id++) {
+		int32_t other = atomic_load(&stress.players[id]);
+		if (other == PLAYER_REMOVED) {
+			removed += 1;
+		} else if (other == PLAYER_REJECTED) {
+			rejected += 1;
+		} else if (other == PLAYER_NONE) {
+			if (!still_waiting[id]) {
+				stress_error(&stress, "a player was lost", id, 0);
+			}
+		} else if (other < 0 || other >= players_len || atomic_load(&stress.players[other]) != id) {
+			stress_error(&stress, "a player was paired with someone who was not paired back", id, other);
+		} else if (id < other) {
+			pairs += 1;
+		}
+	}
+	if (options.cap != 0 && atomic_load(stress.lobby.size) != waiting) {
+		stress_error(&stress, "the lobby size does not match the waiting players", atomic_load(stress.lobby.size), waiting);
+	}
+
+	uint64_t errors = atomic_load(&stress.errors);
+	printf("players: %lu, pairs: %lu, removed: %lu, rejected: %lu, waiting: %lu, %.0f joins/s\n", players_len - 1, pairs,
+		removed, rejected, waiting, (players_len - 1) / (elapsed / 1e9));
+	if (errors != 0) {
+		printf("FAILED with %lu error(s)\n", errors);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the messages players send each other through the relay server, shared by the client and the server
+
+// a frame of the binary protocol is a header byte with the high bit set, which no text line starts with, holding the
+// message type in the next three bits and the payload length in the low four
+#define FRAME_FLAG 0x80
+#define FRAME_LEN(header) (1 + ((uint8_t)(header) & 0xf))
+
+// the order is the type of a frame
+typedef enum MessageType {
+	MessageReady = 0,
+	MessageFire,
+	MessageHit,
+	MessageMiss,
+	MessageDestroyed,
+	MessageIgnore,
+	// sent as a text line when the game starts, never a frame itself, the other player writes frames from then on
+	MessageBinary,
+	MessageTypes,
+} MessageType;
+
+// a message of either protocol, with the numbers the way the sender wrote them
+typedef struct Message {
+	MessageType type;
+	// 'v' or 'h' for DESTROYED
+	char direction;
+	// x,y for FIRE, HIT and MISS, the turn factor and the hp for READY, the three numbers of DESTROYED
+	uint8_t values[3];
+} Message;
+
+const char* message_methods[MessageTypes] = { "READY", "FIRE", "HIT", "MISS", "DESTROYED", "IGNORE", "BINARY" };
+const uint8_t message_values[MessageTypes] = { 2, 2, 2, 2, 3, 0, 0 };
+
+// one text line without its newline, false for anything that is not a message of the game
+bool parse_text_message(char* line, Message* message) {
+	char* save;
+	char* method = strtok_r(line, " ", &save);
+	char* parms = strtok_r(NULL, "", &save);
+	if (method == NULL) {
+		return false;
+	}
+	size_t type = 0;
+	while (type < MessageTypes && strcmp(method, message_methods[type]) != 0) {
+		type += 1;
+	}
+	if (type == MessageTypes) {
+		return false;
+	}
+	*message = (Message){ .type = type };
+	size_t count = message_values[type];
+	if (count == 0 || parms == NULL) {
+		return count == 0 && parms == NULL;
+	}
+	if (type == MessageDestroyed) {
+		if ((parms[0] != 'v' && parms[0] != 'h') || parms[1] != ',') {
+			return false;
+		}
+		message->direction = parms[0];
+		parms += 2;
+	}
+	size_t i = 0;
+	for (char* part = strtok_r(parms, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save)) {
+		char* end;
+		errno = 0;
+		unsigned long value = strtoul(part, &end, 10);
+		if (i == count || end == part || *end != '\0' || errno != 0 || value > UINT8_MAX) {
+			return false;
+		}
+		message->values[i] = value;
+		i += 1;
+	}
+	return i == count;
+}
+
+// a whole frame, its length only has to match the type since every payload byte is a valid number
+bool decode_frame(const uint8_t* frame, Message* message) {
+	size_t type = (frame[0] >> 4) & 0x7;
+	if (type >= MessageBinary) {
+		return false;
+	}
+	size_t count = message_values[type];
+	const uint8_t* payload = frame + 1;
+	if (FRAME_LEN(frame[0]) != 1 + count + (type == MessageDestroyed)) {
+		return false;
+	}
+	*message = (Message){ .type = type };
+	if (type == MessageDestroyed) {
+		if (payload[0] != 'v' && payload[0] != 'h') {
+			return false;
+		}
+		message->direction = payload[0];
+		payload += 1;
+	}
+	memcpy(message->values, payload, count);
+	return true;
+}
+
+#endif
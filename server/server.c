@@ -1,9 +1,14 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -11,40 +16,557 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+#include <time.h>
 #include <unistd.h>
 
+#include "protocol.h"
+
 #define KEY_LEN 5
 #define BUFFER_LEN 256
-#define MINIMAL_CAPACITY 16
+// bytes a relay direction queues for a slow peer before it stops reading, at most one default pipe capacity
+#define RELAY_LEN 4096
+// keys are five letters a-z, so every key maps to a slot of a direct-indexed table
+#define KEY_SPACE (26 * 26 * 26 * 26 * 26)
+// quick match: the oldest waiter is paired with the next player that sends this instead of a key,
+// so the queue never holds more than one socket and is a single lobby slot past the key space
+#define MATCH_KEY "MATCH"
+// a spectator sends this followed by the key of a running game
+#define WATCH_PREFIX "WATCH "
+// lines of a game kept for spectators, a whole game fits so a late spectator still sees every shot
+#define GAME_RING_LEN 16384
+// seconds a spectator may take to accept a write before it is dropped
+#define SPECTATOR_SEND_TIMEOUT 5
+// how long the spectator loop lets lines pile up after a wake-up before sending them
+#define SPECTATOR_BATCH_MS 10
+// the board of main.c, authoritative mode checks every coordinate against it
+#define ROW 12
+#define COLUMN 10
+// the longest line of the game protocol is "DESTROYED h,9,9,11\n", anything longer is thrown away
+#define REFEREE_LINE_LEN 24
+#define REFEREE_NO_TARGET 0xff
+// per address token buckets: groups of buckets behind one lock each, an address only ever lives in its own group
+#define ADMISSION_GROUPS 1024
+#define ADMISSION_GROUP_LEN 8
+// an address may open this many seconds worth of its rate at once
+#define ADMISSION_BURST_SECONDS 5
+// cluster mode: every node is hashed to this many points of a ring, a key belongs to the node of the first point
+// at or after the hash of the key
+#define CLUSTER_POINTS 128
+// "host:port" of a node the way main.c connects to it, an ipv4 address or localhost
+#define CLUSTER_NODE_LEN 32
+// sent instead of pairing when another node owns the key, followed by the "host:port" of that node
+#define REDIRECT_PREFIX "REDIRECT "
+#define MAX_EVENTS 256
+#define MAX_CONNS (1 << 20)
+#define URING_ENTRIES 4096
+// provided receive buffers of BUFFER_LEN bytes, a power of two
+#define URING_BUFFERS 4096
+// buffers queued for one connection before its peer stops being read
+#define URING_QUEUE_LEN (RELAY_LEN / BUFFER_LEN)
+#define URING_BUFFER_GROUP 0
+// timing wheel: 3 levels of 256 slots of 100ms cover about 19 days
+#define TICK_MS 100
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+// objects carved from the heap at once when a pool runs dry
+#define POOL_SLAB_LEN 64
+// a thread cache holding more than this gives half of it back to its pool
+#define POOL_CACHE_LEN 32
+// histogram bounds plus the +Inf bucket
+#define HISTOGRAM_LEN 10
+// log lines a thread can queue before new ones are dropped, a power of two
+#define LOG_RING_LEN 256
+// longer lines are truncated
+#define LOG_LINE_LEN 128
+// how long the log writer sleeps when every ring is empty
+#define LOG_IDLE_US 5000
+// a lobby slot holds the waiting fd plus one in its low bits, a shared lobby adds which process holds the socket:
+// its index plus one, its generation and a sequence number, so no entry is ever mistaken for an older one
+#define SLOT_FD_BITS 24
+#define SLOT_PROCESS_SHIFT 24
+#define SLOT_GENERATION_SHIFT 32
+#define SLOT_SEQUENCE_SHIFT 40
+// a process asking another one for its socket first turns the entry into a claim, the same entry with the index plus
+// one and the generation of the asking process on top, so the entry can be given back if that process dies
+#define SLOT_CLAIMER_SHIFT 48
+#define SLOT_CLAIMER_GENERATION_SHIFT 56
+#define SLOT_ENTRY_MASK ((1ULL << SLOT_CLAIMER_SHIFT) - 1)
+// processes that can share a lobby, the index plus one fits in a byte of a slot
+#define SHARED_PROCESSES 255
+#define SHARED_MAGIC 0x62736869706c6f62
+// the slots of a shared lobby file start on the page after the header
+#define SHARED_SLOTS_OFFSET 4096
+// seconds a process waits on another one handing over a socket before it takes that one as gone
+#define SHARED_TIMEOUT 1
+// how long a join waits before looking again at a slot another process is asking for the socket of
+#define SHARED_CLAIM_WAIT_US 100
 
-typedef struct Entry {
-	char key[KEY_LEN + 1];
-	int wait_sock_fd;
-} Entry;
+// the start of a shared lobby file, a crash cannot leave it half updated since every field is changed with a single
+// atomic operation, the count of waiting sockets stays in each process so a crash takes its share with it
+typedef struct SharedHeader {
+	_Atomic uint64_t magic;
+	// bumped by every process that takes an index, entries of an older generation belong to a process that is gone
+	_Atomic uint32_t generations[SHARED_PROCESSES];
+} SharedHeader;
+
+static_assert(sizeof(SharedHeader) <= SHARED_SLOTS_OFFSET, "the header of a shared lobby fits before the slots");
+
+// several processes on one host pair through one mapped lobby, a process that claims the entry of another one asks it
+// for the waiting socket over a unix socket and only empties the slot once the socket arrived
+typedef struct SharedLobby {
+	SharedHeader* header;
+	const char* path;
+	// the lobby file, this process holds a lock on the byte of its index for as long as it lives
+	int fd;
+	uint32_t index;
+	uint32_t generation;
+	_Atomic uint32_t sequence;
+	// where the other processes ask for a waiting socket of this one
+	int listen_fd;
+	// indexed by fd, the entry each waiting socket of this process was put in its slot with, a socket is only
+	// handed over or timed out by whoever clears it here
+	_Atomic uint64_t* published;
+	size_t published_len;
+	// NULL without a lobby timeout
+	struct WaiterTimers* timers;
+} SharedLobby;
+
+typedef struct Lobby {
+	// indexed by the encoded key, holds the entry of the waiting socket so zero is an empty slot,
+	// every slot is only ever updated with a compare-and-swap so different keys never contend
+	// an ABA on a slot is harmless: a waiting fd cannot be closed and reused while it is in the lobby
+	_Atomic uint64_t* slots;
+	// waiting sockets, a place is reserved before a socket waits so the cap is never passed, only counted with a cap
+	// since every join would contend on it, and given back by whoever takes the socket out of this process
+	_Atomic uint32_t* size;
+	// 0 for no cap, a shared lobby caps each process on its own
+	uint32_t cap;
+	// NULL unless the lobby is shared with other processes
+	SharedLobby* shared;
+} Lobby;
+
+typedef enum LobbyResult {
+	LobbyWaiting = 0,
+	LobbyPaired,
+	// the socket would have to wait but the lobby is at its cap
+	LobbyFull,
+	// only seen inside lobby_join: the entry of another process was claimed and the socket has to be asked for
+	LobbyClaimed,
+	// only seen inside lobby_join: another process is asking for the socket on the key
+	LobbyBusy,
+} LobbyResult;
+
+typedef struct Timer {
+	// NULL when the timer is not armed
+	struct Timer* prev;
+	struct Timer* next;
+	uint64_t expires;
+} Timer;
+
+typedef struct TimerWheel {
+	// every slot is the sentinel of a circular list of timers
+	Timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+	// the next tick to be processed
+	uint64_t now;
+	size_t len;
+} TimerWheel;
+
+typedef enum LogLevel {
+	LogDebug,
+	LogInfo,
+	LogError,
+} LogLevel;
+
+typedef struct LogRecord {
+	// wall clock
+	uint64_t time_ns;
+	LogLevel level;
+	char text[LOG_LINE_LEN];
+} LogRecord;
+
+// single producer, single consumer: the owning thread queues lines and the log writer drains them
+typedef struct LogRing {
+	struct LogRing* next;
+	// the ring of an exited thread is handed to the next new thread
+	struct LogRing* next_idle;
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	// lines lost to a full ring, the writer reports the difference to `reported`
+	_Atomic uint64_t dropped;
+	uint64_t reported;
+	LogRecord records[LOG_RING_LEN];
+} LogRing;
+
+typedef struct Logger {
+	// only taken when a thread registers its ring
+	pthread_mutex_t mutex;
+	// held while draining, so the final flush at exit does not race the writer thread
+	pthread_mutex_t drain_mutex;
+	LogRing* rings;
+	LogRing* idle;
+	LogLevel level;
+} Logger;
+
+Logger logger = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.drain_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.rings = NULL,
+	.idle = NULL,
+	.level = LogInfo,
+};
+_Thread_local LogRing* thread_log_ring = NULL;
+// its destructor hands the ring of an exiting thread over
+pthread_key_t thread_log_ring_key;
+pthread_once_t thread_log_ring_key_once = PTHREAD_ONCE_INIT;
 
-typedef struct EntryVector {
-	Entry* ptr;
+typedef enum PoolKind {
+	PoolWaitThreadInfo,
+	PoolWorkThreadInfo,
+	PoolWaiter,
+	PoolConn,
+	PoolGame,
+	PoolSpectator,
+	POOL_COUNT,
+} PoolKind;
+
+typedef struct PoolObject {
+	struct PoolObject* next;
+} PoolObject;
+
+// fixed-size objects carved from slabs that are never given back to the heap
+typedef struct Pool {
+	const char* name;
+	size_t object_size;
+	pthread_mutex_t mutex;
+	// objects given back by full thread caches and by exiting threads
+	PoolObject* free;
+	// occupancy, for monitoring
+	_Atomic size_t in_use;
+	_Atomic size_t capacity;
+} Pool;
+
+typedef struct PoolCache {
+	PoolObject* free;
+	size_t len;
+} PoolCache;
+
+Pool pools[POOL_COUNT];
+// allocations and frees only take the pool mutex when this cache runs empty or overflows
+_Thread_local PoolCache pool_caches[POOL_COUNT];
+_Thread_local bool pool_caches_registered = false;
+// its destructor gives the caches of an exiting thread back to the pools
+pthread_key_t pool_caches_key;
+pthread_once_t pool_caches_key_once = PTHREAD_ONCE_INIT;
+
+typedef struct Histogram {
+	// bucket i counts the observations up to the i-th bound, the last one everything above
+	_Atomic uint64_t buckets[HISTOGRAM_LEN];
+	_Atomic uint64_t sum_ns;
+} Histogram;
+
+// counters of one thread, only that thread writes them and a scrape sums every thread
+typedef struct Stats {
+	struct Stats* next;
+	// the stats of an exited thread are handed to the next new thread and keep accumulating
+	struct Stats* next_idle;
+	_Atomic uint64_t lobby_joins;
+	_Atomic uint64_t lobby_leaves;
+	_Atomic uint64_t pairs;
+	_Atomic uint64_t games_ended;
+	_Atomic uint64_t invalid_keys;
+	// indexed by the sending player
+	_Atomic uint64_t relayed_bytes[2];
+	_Atomic uint64_t relayed_messages[2];
+	// bytes put into and taken out of the relay queues, the difference is what is queued right now
+	_Atomic uint64_t relay_queued;
+	_Atomic uint64_t relay_flushed;
+	// times a queue filled up and its reading side was paused
+	_Atomic uint64_t relay_stalls;
+	_Atomic uint64_t spectators_joined;
+	_Atomic uint64_t spectators_left;
+	// spectators the relay lapped
+	_Atomic uint64_t spectators_dropped;
+	// lines authoritative mode did not relay
+	_Atomic uint64_t messages_dropped;
+	// connections turned away for an address over its rate, for a full lobby and for running out of fds
+	_Atomic uint64_t rejected_rate;
+	_Atomic uint64_t rejected_lobby;
+	_Atomic uint64_t rejected_fds;
+	_Atomic uint64_t accept_errors;
+	// keys sent on to the node of the cluster that owns them
+	_Atomic uint64_t redirects;
+	// waiting sockets taken from and handed to another process of a shared lobby
+	_Atomic uint64_t transfers_in;
+	_Atomic uint64_t transfers_out;
+	Histogram lobby_wait;
+	Histogram relay_latency;
+} Stats;
+
+typedef struct Metrics {
+	// only taken when a thread registers its stats and on a scrape
+	pthread_mutex_t mutex;
+	Stats* stats;
+	Stats* idle;
+	// latencies cost a clock read per message, so they are only measured when the endpoint is enabled
+	bool timed;
+	// fd-indexed time each waiting socket joined the lobby
+	uint64_t* wait_started;
+	size_t wait_started_len;
+	// kept here so a handoff can pass it on
+	int listen_fd;
+} Metrics;
+
+Metrics metrics = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.stats = NULL,
+	.idle = NULL,
+	.timed = false,
+	.wait_started = NULL,
+	.wait_started_len = 0,
+	.listen_fd = -1,
+};
+_Thread_local Stats* thread_stats = NULL;
+// its destructor hands the stats of an exiting thread over
+pthread_key_t thread_stats_key;
+pthread_once_t thread_stats_key_once = PTHREAD_ONCE_INIT;
+
+// in nanoseconds
+const uint64_t lobby_wait_bounds[HISTOGRAM_LEN - 1] = {
+	100000000, 500000000, 1000000000, 5000000000, 10000000000,
+	30000000000, 60000000000, 300000000000, 900000000000,
+};
+const uint64_t relay_latency_bounds[HISTOGRAM_LEN - 1] = {
+	10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 5000000, 10000000,
+};
+
+// one direction of a game: bytes read from one player that the other has not taken yet
+typedef struct Relay {
+	size_t head;
 	size_t len;
-	size_t cap;
+	// authoritative mode: the unfinished line at the end of the queue, it is not sent until the referee saw all of it
+	size_t held;
+	// when splicing the queued bytes sit in this pipe instead of `buf`
+	int pipe_fds[2];
+	char buf[RELAY_LEN];
+} Relay;
+
+// authoritative mode: all the server knows about a game, so a million of them take a few dozen megabytes
+typedef struct Referee {
+	// a bit per cell of each board that was fired at, bit y * COLUMN + x in the coordinates of its owner
+	uint64_t shots[2][(ROW * COLUMN + 63) / 64];
+	uint8_t hp[2];
+	// bit n is set once player n sent READY, and holds its turn factor
+	uint8_t ready;
+	uint8_t turn_factors;
+	// the player that fires next
+	uint8_t turn;
+	// the cell of the last FIRE on the board of `turn`, REFEREE_NO_TARGET once that player answered it
+	uint8_t target;
+	// bit n is set while a line of player n that is too long is being thrown away
+	uint8_t skipping;
+	bool over;
+} Referee;
+
+static_assert(ROW * COLUMN < REFEREE_NO_TARGET, "every cell needs an index below REFEREE_NO_TARGET");
+
+typedef struct Config {
+	// relay with splice() through a pipe instead of copying through a buffer (thread mode)
+	bool use_splice;
+	// parse the game protocol and drop the messages a player may not send, instead of relaying bytes blindly
+	bool authoritative;
+	// deadlines in seconds, 0 disables them
+	uint32_t handshake_timeout;
+	uint32_t lobby_timeout;
+	uint32_t idle_timeout;
+	// the command line, executed again for a handoff
+	char** argv;
+	// the socket a previous process hands its sockets over on, -1 for a fresh start
+	int handoff_fd;
+} Config;
+
+// thread mode: a waiting socket is not owned by any thread, so its lobby deadline lives here
+typedef struct Waiter {
+	Timer timer;
+	int sock_fd;
+	char key[KEY_LEN + 1];
+} Waiter;
+
+typedef struct WaiterTimers {
 	pthread_mutex_t mutex;
-} EntryVector;
+	TimerWheel wheel;
+	// indexed by fd, so a pairing can cancel the deadline of the socket it took
+	Waiter** waiters;
+	size_t waiters_len;
+	Lobby* lobby;
+	Config* config;
+} WaiterTimers;
 
 typedef struct WaitThreadInfo {
 	int sock_fd;
-	EntryVector* entries;
+	Lobby* lobby;
+	Config* config;
+	WaiterTimers* timers;
 } WaitThreadInfo;
 
+// thread mode: a running game, the relay copies every line it forwards into `ring` once
+// and the spectator loop sends straight from it at the offset of each spectator
+typedef struct Game {
+	char key[KEY_LEN + 1];
+	char ring[GAME_RING_LEN];
+	// bytes ever written to the ring, only the relay thread stores it
+	_Atomic uint64_t end;
+	// where the write in progress stops, stored before the bytes so a send can be told to have raced the relay
+	_Atomic uint64_t writing;
+	_Atomic bool over;
+	// the relay only wakes the spectator loop while there are some
+	_Atomic uint32_t spectators;
+	// held by the relay and by every spectator, the last one frees the game
+	_Atomic uint32_t refs;
+	// what each player sent after its last newline, only touched by the relay thread
+	char partial[2][BUFFER_LEN];
+	size_t partial_len[2];
+} Game;
+
+// thread mode: the latest game paired on each key, so a spectator can find it
+typedef struct GameTable {
+	// only taken when a game starts or ends and when a spectator joins
+	pthread_mutex_t mutex;
+	// indexed by the encoded key, NULL when spectating is off
+	Game** games;
+} GameTable;
+
+GameTable game_table = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.games = NULL,
+};
+
+typedef struct Spectator {
+	int sock_fd;
+	Game* game;
+	// bytes of the ring already sent
+	uint64_t offset;
+	// when a full socket first turned a send away, 0 while it takes everything
+	uint64_t blocked_since;
+	// only used while it waits in `joining`
+	struct Spectator* next;
+} Spectator;
+
+// thread mode: one poll loop serves every spectator, so a watcher costs a slot in its tables and not a thread
+typedef struct SpectatorLoop {
+	// a byte in it wakes the loop for a joining spectator or new lines of a watched game
+	int wake_pipe[2];
+	// set while a byte is on its way, so a busy relay writes at most one per turn of the loop
+	_Atomic bool woken;
+	pthread_mutex_t mutex;
+	// handed over by the wait threads, the loop takes the whole list each turn
+	Spectator* joining;
+} SpectatorLoop;
+
+SpectatorLoop spectator_loop = {
+	.wake_pipe = { -1, -1 },
+	.woken = false,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.joining = NULL,
+};
+
+// the token bucket of one client address, only refilled when the address connects again
+typedef struct Bucket {
+	// in network order, 0 for an unused bucket
+	uint32_t addr;
+	// in thousandths of a connection
+	uint32_t tokens;
+	uint64_t updated;
+} Bucket;
+
+typedef struct Admission {
+	// connections per second an address may open, 0 disables the buckets
+	uint32_t rate;
+	// ADMISSION_GROUPS locks, each guarding ADMISSION_GROUP_LEN buckets
+	pthread_mutex_t* locks;
+	Bucket* buckets;
+	// fd kept open only to be closed when accept() runs out of fds, shared by the accepting threads
+	_Atomic int spare_fd;
+} Admission;
+
+Admission admission = {
+	.rate = 0,
+	.locks = NULL,
+	.buckets = NULL,
+	.spare_fd = -1,
+};
+
+typedef struct ClusterPoint {
+	uint64_t hash;
+	uint32_t node;
+} ClusterPoint;
+
+// cluster mode: the nodes of the peer file, every node reads the same file so they all agree on the owner of a key
+typedef struct Cluster {
+	// empty when not in a cluster
+	char (*nodes)[CLUSTER_NODE_LEN];
+	size_t nodes_len;
+	// the index of this node in `nodes`
+	size_t self;
+	// CLUSTER_POINTS per node, sorted by hash
+	ClusterPoint* points;
+	size_t points_len;
+} Cluster;
+
+Cluster cluster = {
+	.nodes = NULL,
+	.nodes_len = 0,
+	.self = 0,
+	.points = NULL,
+	.points_len = 0,
+};
+
 typedef struct WorkThreadInfo {
 	int sock1_fd;
 	int sock2_fd;
+	Config* config;
+	// NULL when the game cannot be watched
+	Game* game;
 } WorkThreadInfo;
 
 bool streq(const char* a, const char* b) {
 	return strcmp(a, b) == 0;
 }
 
+bool string_has_prefix(const char* str, const char* prefix) {
+	return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+// parse a whole decimal number no bigger than `max`
+bool parse_number(const char* str, uint64_t max, uint64_t* number) {
+	char* end;
+	errno = 0;
+	uint64_t tmp = strtoull(str, &end, 10);
+	if (end == str || *end != '\0' || errno != 0 || tmp > max) {
+		return false;
+	}
+	*number = tmp;
+	return true;
+}
+
 bool is_valid_key(char* key) {
+	if (streq(key, MATCH_KEY)) {
+		return true;
+	}
 	size_t len = strlen(key);
 	if (len != KEY_LEN) {
 		return false;
@@ -57,247 +579,4521 @@ bool is_valid_key(char* key) {
 	return true;
 }
 
-void* work_thread(void* raw_info) {
-	WorkThreadInfo* info = (WorkThreadInfo*)raw_info;
-	int sock1_fd = info->sock1_fd;
-	int sock2_fd = info->sock2_fd;
+// encode a valid key as a base-26 number (fits in 24 bits)
+uint32_t encode_key(const char* key) {
+	if (streq(key, MATCH_KEY)) {
+		return KEY_SPACE;
+	}
+	uint32_t code = 0;
+	for (int i = 0; i < KEY_LEN; i++) {
+		code = code * 26 + (key[i] - 'a');
+	}
+	return code;
+}
 
-	char* message = "CONNECTED AS 1";
-	ssize_t written = write(sock1_fd, message, strlen(message));
-	if (written == -1) {
-		fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-	} else if (written != strlen(message)) {
-		fprintf(stderr, "[ERROR] not all readed bytes are written to the sock1 (%ld / %ld) (line: %d)\n", written, strlen(message), __LINE__);
+void log_ring_release(void* raw_ring) {
+	LogRing* ring = raw_ring;
+	int err = pthread_mutex_lock(&logger.mutex);
+	assert(err == 0);
+	ring->next_idle = logger.idle;
+	logger.idle = ring;
+	err = pthread_mutex_unlock(&logger.mutex);
+	assert(err == 0);
+}
+
+void thread_log_ring_key_init(void) {
+	int err = pthread_key_create(&thread_log_ring_key, log_ring_release);
+	assert(err == 0);
+}
+
+LogRing* log_ring(void) {
+	if (thread_log_ring == NULL) {
+		int err = pthread_once(&thread_log_ring_key_once, thread_log_ring_key_init);
+		assert(err == 0);
+		err = pthread_mutex_lock(&logger.mutex);
+		assert(err == 0);
+		if (logger.idle != NULL) {
+			thread_log_ring = logger.idle;
+			logger.idle = thread_log_ring->next_idle;
+		} else {
+			thread_log_ring = calloc(1, sizeof(LogRing));
+			assert(thread_log_ring != NULL);
+			thread_log_ring->next = logger.rings;
+			logger.rings = thread_log_ring;
+		}
+		err = pthread_mutex_unlock(&logger.mutex);
+		assert(err == 0);
+		err = pthread_setspecific(thread_log_ring_key, thread_log_ring);
+		assert(err == 0);
 	}
+	return thread_log_ring;
+}
 
-	message = "CONNECTED AS 2";
-	written = write(sock2_fd, message, strlen(message));
-	if (written == -1) {
-		fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-	} else if (written != strlen(message)) {
-		fprintf(stderr, "[ERROR] not all readed bytes are written to the sock2 (%ld / %ld) (line: %d)\n", written, strlen(message), __LINE__);
+// queue one line, this never blocks: when the writer fell behind the line is dropped and counted
+__attribute__((format(printf, 2, 3)))
+void log_message(LogLevel level, const char* format, ...) {
+	if (level < logger.level) {
+		return;
+	}
+	LogRing* ring = log_ring();
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail == LOG_RING_LEN) {
+		atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+		return;
 	}
 
-	struct pollfd fds[2] = {
-		{ .fd = sock1_fd, .events = POLLIN },
-		{ .fd = sock2_fd, .events = POLLIN },
-	};
-	bool end = false;
-	while (!end) {
-		int pollled = poll(fds, 2, -1);
-		if (pollled == -1) {
-			fprintf(stderr, "[ERROR] error on poll %s (line: %d)\n", strerror(errno), __LINE__);
-			break;
+	LogRecord* record = &ring->records[head & (LOG_RING_LEN - 1)];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	record->level = level;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(record->text, sizeof(record->text), format, args);
+	va_end(args);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void log_write(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
 		}
+		buf += written;
+		len -= written;
+	}
+}
 
-		for (size_t i = 0; i < 2; i++) {
-			if (fds[i].revents == POLLIN) {
-				char buf[BUFFER_LEN] = {0};
-				ssize_t readed = read(fds[i].fd, buf, sizeof(buf) - 1);
-				if (readed == -1) {
-					fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-					end = true;
-					break;
-				} else if (readed == 0) {
-					printf("[LOG] a socket ended\n");
-					end = true;
-					break;
-				}
+// write every queued line, info and debug to stdout and errors to stderr, returns how many were written
+size_t log_drain(void) {
+	// one write per stream and batch instead of one per line
+	static char out[1 << 16];
+	static char err_out[1 << 16];
+	size_t out_len = 0;
+	size_t err_out_len = 0;
+	size_t count = 0;
 
-				ssize_t written = write(fds[(i + 1) % 2].fd, buf, readed);
-				if (written == -1) {
-					fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-					end = true;
-				} else if (written != readed) {
-					fprintf(stderr, "[ERROR] not all readed bytes are written to the write_sock (%ld / %ld) (line: %d)\n", written, readed, __LINE__);
-					end = true;
-				}
-			} else if (fds[i].revents == POLLHUP) {
-				printf("[LOG] a socket ended\n");
-				end = true;
-			} else if (fds[i].revents != 0) {
-				fprintf(stderr, "[ERROR] poll return event `%d` (line: %d)\n", fds[i].revents, __LINE__);
-				end = true;
+	int err = pthread_mutex_lock(&logger.drain_mutex);
+	assert(err == 0);
+	// rings are only ever added at the front, so the list can be walked without the mutex
+	err = pthread_mutex_lock(&logger.mutex);
+	assert(err == 0);
+	LogRing* rings = logger.rings;
+	err = pthread_mutex_unlock(&logger.mutex);
+	assert(err == 0);
+
+	const char* prefixes[3] = { "[DEBUG]", "[LOG]", "[ERROR]" };
+	for (LogRing* ring = rings; ring != NULL; ring = ring->next) {
+		uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		for (; tail != head; tail++) {
+			LogRecord* record = &ring->records[tail & (LOG_RING_LEN - 1)];
+			char* buf = out;
+			size_t* len = &out_len;
+			int fd = STDOUT_FILENO;
+			if (record->level == LogError) {
+				buf = err_out;
+				len = &err_out_len;
+				fd = STDERR_FILENO;
+			}
+			if (sizeof(out) - *len < LOG_LINE_LEN + 64) {
+				log_write(fd, buf, *len);
+				*len = 0;
+			}
+			*len += snprintf(buf + *len, sizeof(out) - *len, "%lu.%06lu %s %s\n",
+				record->time_ns / 1000000000, record->time_ns % 1000000000 / 1000, prefixes[record->level], record->text);
+			count += 1;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+		uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if (dropped != ring->reported) {
+			if (sizeof(err_out) - err_out_len < LOG_LINE_LEN) {
+				log_write(STDERR_FILENO, err_out, err_out_len);
+				err_out_len = 0;
 			}
+			err_out_len += snprintf(err_out + err_out_len, sizeof(err_out) - err_out_len, "[ERROR] %lu log lines dropped\n", dropped - ring->reported);
+			ring->reported = dropped;
 		}
 	}
+	log_write(STDOUT_FILENO, out, out_len);
+	log_write(STDERR_FILENO, err_out, err_out_len);
+	err = pthread_mutex_unlock(&logger.drain_mutex);
+	assert(err == 0);
+	return count;
+}
 
-	close(sock1_fd);
-	close(sock2_fd);
-	free(raw_info);
+void* log_writer_thread(void* raw) {
+	while (true) {
+		if (log_drain() == 0) {
+			usleep(LOG_IDLE_US);
+		}
+	}
 	return NULL;
 }
 
-void* wait_thread(void* raw_info) {
-	WaitThreadInfo* info = (WaitThreadInfo*)raw_info;
-	EntryVector* entries = info->entries;
+// lines queued right before exit would be lost otherwise
+void log_flush(void) {
+	log_drain();
+}
 
-	char buf[1024] = {0};
-	ssize_t readed = read(info->sock_fd, buf, sizeof(buf) - 1);
-	if (readed == -1) {
-		fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
+int log_start(void) {
+	int err = atexit(log_flush);
+	assert(err == 0);
+	pthread_t thread;
+	err = pthread_create(&thread, NULL, log_writer_thread, NULL);
+	if (err != 0) {
+		fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(err), __LINE__);
+		return err;
 	}
-	if (is_valid_key(buf)) {
-		int err = pthread_mutex_lock(&entries->mutex);
-		assert(err == 0);
+	err = pthread_detach(thread);
+	assert(err == 0);
+	return 0;
+}
 
-		bool found = false;
-		size_t index = 0;
-		while (!found && index < entries->len) {
-			if (streq(buf, entries->ptr[index].key)) {
-				found = true;
-			} else {
-				index += 1;
-			}
-		}
-		if (found) {
-			printf("[LOG] paired key: `%s`\n", buf);
-			int sock1_fd = entries->ptr[index].wait_sock_fd;
-			int sock2_fd = info->sock_fd;
+void write_message(int sock_fd, const char* message) {
+	ssize_t written = write(sock_fd, message, strlen(message));
+	if (written == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	} else if (written != strlen(message)) {
+		log_message(LogError, "not all readed bytes are written to the write_sock (%ld / %ld) (line: %d)", written, strlen(message), __LINE__);
+	}
+}
 
-			entries->len -= 1;
-			for (size_t i = index; i < entries->len; i ++) {
-				entries->ptr[i] = entries->ptr[i + 1];
-			}
-			printf("[LOG] new entries length: %lu\n", entries->len);
+uint64_t now_ns(void) {
+	struct timespec now;
+	int err = clock_gettime(CLOCK_MONOTONIC, &now);
+	assert(err == 0);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-			if (entries->len < entries->cap / 4 && entries->cap / 2 >= MINIMAL_CAPACITY) {
-				entries->cap /= 2;
-				Entry* new_ptr = realloc(entries->ptr, entries->cap * sizeof(Entry));
-				assert(new_ptr != NULL);
-				entries->ptr = new_ptr;
-				printf("[LOG] new entries capacity: %lu\n", entries->cap);
-			}
+uint64_t current_tick(void) {
+	return now_ns() / 1000000 / TICK_MS;
+}
 
-			int err = pthread_mutex_unlock(&entries->mutex);
-			assert(err == 0);
+uint64_t seconds_to_ticks(uint32_t seconds) {
+	return (uint64_t)seconds * 1000 / TICK_MS;
+}
 
-			WorkThreadInfo* work_info = malloc(sizeof(WorkThreadInfo));
-			*work_info = (WorkThreadInfo){
-				.sock1_fd = sock1_fd,
-				.sock2_fd = sock2_fd,
-			};
+void timer_wheel_init(TimerWheel* wheel) {
+	for (size_t level = 0; level < WHEEL_LEVELS; level++) {
+		for (size_t i = 0; i < WHEEL_SIZE; i++) {
+			wheel->slots[level][i].prev = &wheel->slots[level][i];
+			wheel->slots[level][i].next = &wheel->slots[level][i];
+		}
+	}
+	wheel->now = current_tick();
+	wheel->len = 0;
+}
 
-			pthread_t thread;
-			err = pthread_create(&thread, NULL, work_thread, work_info);
-			if (err != 0) {
-				fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(err), __LINE__);
+// a timer goes to the lowest level whose range covers its delay, in the slot of its expiry at that level
+void timer_wheel_link(TimerWheel* wheel, Timer* timer) {
+	uint64_t max_delta = ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	if (timer->expires < wheel->now) {
+		timer->expires = wheel->now;
+	} else if (timer->expires - wheel->now > max_delta) {
+		timer->expires = wheel->now + max_delta;
+	}
+	uint64_t delta = timer->expires - wheel->now;
+	size_t level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+		level += 1;
+	}
+	Timer* head = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+void timer_cancel(TimerWheel* wheel, Timer* timer) {
+	if (timer->next == NULL) {
+		return;
+	}
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+	wheel->len -= 1;
+}
+
+// (re)arm `timer` to expire in `ticks`, 0 only cancels it
+void timer_set(TimerWheel* wheel, Timer* timer, uint64_t ticks) {
+	timer_cancel(wheel, timer);
+	if (ticks == 0) {
+		return;
+	}
+	timer->expires = wheel->now + ticks;
+	timer_wheel_link(wheel, timer);
+	wheel->len += 1;
+}
+
+// process every tick up to and including `to`, calling `on_expire` for each expired timer,
+// which may arm or cancel any timer, including the one it got
+void timer_wheel_advance(TimerWheel* wheel, uint64_t to, void (*on_expire)(void*, Timer*), void* ctx) {
+	while (wheel->now <= to) {
+		if (wheel->len == 0) {
+			wheel->now = to + 1;
+			return;
+		}
+		// when a lower level wraps around, the next slot of the level above moves down
+		for (size_t level = WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0) {
+				continue;
 			}
-			err = pthread_detach(thread);
-			if (err != 0) {
-				fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(err), __LINE__);
+			Timer* head = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+			Timer* timer = head->next;
+			head->prev = head;
+			head->next = head;
+			while (timer != head) {
+				Timer* next = timer->next;
+				timer_wheel_link(wheel, timer);
+				timer = next;
 			}
-		} else {
-			printf("[LOG] new key: `%s`\n", buf);
-			assert(entries->len <= entries->cap);
-			if (entries->len == entries->cap) {
-				entries->cap *= 2;
-				Entry* new_ptr = realloc(entries->ptr, entries->cap * sizeof(Entry));
-				assert(new_ptr != NULL);
-				entries->ptr = new_ptr;
-				printf("[LOG] new entries capacity: %lu\n", entries->cap);
-			}
-			entries->ptr[entries->len] = (Entry){
-				.key = {0},
-				.wait_sock_fd = info->sock_fd,
-			};
-			strncpy(entries->ptr[entries->len].key, buf, KEY_LEN);
-			entries->len += 1;
-			printf("[LOG] new entries length: %lu\n", entries->len);
+		}
 
-			int err = pthread_mutex_unlock(&entries->mutex);
-			assert(err == 0);
+		Timer* head = &wheel->slots[0][wheel->now & (WHEEL_SIZE - 1)];
+		while (head->next != head) {
+			Timer* timer = head->next;
+			timer_cancel(wheel, timer);
+			on_expire(ctx, timer);
 		}
-	} else {
-		printf("[LOG] invalid key format\n");
-		char* message = "error: invalid connection";
-		ssize_t written = write(info->sock_fd, message, strlen(message));
-		if (written == -1) {
-			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-		} else if (written != strlen(message)) {
-			fprintf(stderr, "[ERROR] not all readed bytes are written to the write_sock (%ld / %ld) (line: %d)\n", written, strlen(message), __LINE__);
+		wheel->now += 1;
+	}
+}
+
+// the highest fd the process can open, for fd-indexed tables
+size_t fd_table_len(void) {
+	struct rlimit limit;
+	int err = getrlimit(RLIMIT_NOFILE, &limit);
+	if (err == -1 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAX_CONNS) {
+		return MAX_CONNS;
+	}
+	return limit.rlim_cur;
+}
+
+void pool_init(PoolKind kind, const char* name, size_t object_size) {
+	// every object must stay aligned for any type it holds
+	size_t align = _Alignof(max_align_t);
+	if (object_size < sizeof(PoolObject)) {
+		object_size = sizeof(PoolObject);
+	}
+	pools[kind] = (Pool){
+		.name = name,
+		.object_size = (object_size + align - 1) / align * align,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.free = NULL,
+		.in_use = 0,
+		.capacity = 0,
+	};
+}
+
+// moves `count` objects from the front of the cache to the shared free list
+void pool_release(Pool* pool, PoolCache* cache, size_t count) {
+	int err = pthread_mutex_lock(&pool->mutex);
+	assert(err == 0);
+	for (size_t i = 0; i < count; i++) {
+		PoolObject* object = cache->free;
+		cache->free = object->next;
+		object->next = pool->free;
+		pool->free = object;
+	}
+	cache->len -= count;
+	err = pthread_mutex_unlock(&pool->mutex);
+	assert(err == 0);
+}
+
+// fills the cache with up to `count` objects, carving a new slab when the shared free list is empty
+void pool_refill(Pool* pool, PoolCache* cache, size_t count) {
+	int err = pthread_mutex_lock(&pool->mutex);
+	assert(err == 0);
+	if (pool->free == NULL) {
+		char* slab = malloc(pool->object_size * POOL_SLAB_LEN);
+		assert(slab != NULL);
+		for (size_t i = 0; i < POOL_SLAB_LEN; i++) {
+			PoolObject* object = (PoolObject*)(slab + i * pool->object_size);
+			object->next = pool->free;
+			pool->free = object;
 		}
-		close(info->sock_fd);
+		atomic_fetch_add_explicit(&pool->capacity, POOL_SLAB_LEN, memory_order_relaxed);
+	}
+	while (cache->len < count && pool->free != NULL) {
+		PoolObject* object = pool->free;
+		pool->free = object->next;
+		object->next = cache->free;
+		cache->free = object;
+		cache->len += 1;
 	}
+	err = pthread_mutex_unlock(&pool->mutex);
+	assert(err == 0);
+}
 
-	free(raw_info);
-	return NULL;
+void pool_flush_caches(void* raw_caches) {
+	PoolCache* caches = raw_caches;
+	for (size_t kind = 0; kind < POOL_COUNT; kind++) {
+		if (caches[kind].len > 0) {
+			pool_release(&pools[kind], &caches[kind], caches[kind].len);
+		}
+	}
 }
 
-int main(int argc, char** argv) {
-	if (argc != 2) {
-		printf("usage: %s <port>\n", argv[0]);
-		return 0;
+void pool_caches_key_init(void) {
+	int err = pthread_key_create(&pool_caches_key, pool_flush_caches);
+	assert(err == 0);
+}
+
+PoolCache* pool_cache(PoolKind kind) {
+	if (!pool_caches_registered) {
+		int err = pthread_once(&pool_caches_key_once, pool_caches_key_init);
+		assert(err == 0);
+		err = pthread_setspecific(pool_caches_key, pool_caches);
+		assert(err == 0);
+		pool_caches_registered = true;
 	}
+	return &pool_caches[kind];
+}
 
-	uint16_t port;
-	{
-		char* end;
-		uint64_t tmp_port = strtoul(argv[1], &end, 10);
-		if (end == argv[1]) {
-			fprintf(stderr, "[ERROR] the port `%s` is not a number (line: %d)\n", argv[1], __LINE__);
-			return 1;
+void* pool_alloc(PoolKind kind) {
+	Pool* pool = &pools[kind];
+	PoolCache* cache = pool_cache(kind);
+	if (cache->free == NULL) {
+		pool_refill(pool, cache, POOL_CACHE_LEN / 2);
+	}
+	PoolObject* object = cache->free;
+	cache->free = object->next;
+	cache->len -= 1;
+	atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed);
+	return object;
+}
+
+void pool_free(PoolKind kind, void* ptr) {
+	Pool* pool = &pools[kind];
+	PoolCache* cache = pool_cache(kind);
+	PoolObject* object = ptr;
+	object->next = cache->free;
+	cache->free = object;
+	cache->len += 1;
+	if (cache->len > POOL_CACHE_LEN) {
+		pool_release(pool, cache, POOL_CACHE_LEN / 2);
+	}
+	atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+}
+
+void pool_log_stats(void) {
+	for (size_t kind = 0; kind < POOL_COUNT; kind++) {
+		if (pools[kind].name == NULL) {
+			continue;
 		}
-		if (tmp_port > UINT16_MAX) {
-			fprintf(stderr, "[ERROR] the port `%s` is too big for a port (line: %d)\n", argv[1], __LINE__);
-			return 1;
+		size_t in_use = atomic_load_explicit(&pools[kind].in_use, memory_order_relaxed);
+		size_t capacity = atomic_load_explicit(&pools[kind].capacity, memory_order_relaxed);
+		log_message(LogInfo, "pool %s: %zu in use of %zu", pools[kind].name, in_use, capacity);
+	}
+}
+
+void stats_release(void* raw_stats) {
+	Stats* stats = raw_stats;
+	int err = pthread_mutex_lock(&metrics.mutex);
+	assert(err == 0);
+	stats->next_idle = metrics.idle;
+	metrics.idle = stats;
+	err = pthread_mutex_unlock(&metrics.mutex);
+	assert(err == 0);
+}
+
+void thread_stats_key_init(void) {
+	int err = pthread_key_create(&thread_stats_key, stats_release);
+	assert(err == 0);
+}
+
+Stats* stats(void) {
+	if (thread_stats == NULL) {
+		int err = pthread_once(&thread_stats_key_once, thread_stats_key_init);
+		assert(err == 0);
+		err = pthread_mutex_lock(&metrics.mutex);
+		assert(err == 0);
+		if (metrics.idle != NULL) {
+			thread_stats = metrics.idle;
+			metrics.idle = thread_stats->next_idle;
+		} else {
+			thread_stats = calloc(1, sizeof(Stats));
+			assert(thread_stats != NULL);
+			thread_stats->next = metrics.stats;
+			metrics.stats = thread_stats;
 		}
-		port = tmp_port;
+		err = pthread_mutex_unlock(&metrics.mutex);
+		assert(err == 0);
+		err = pthread_setspecific(thread_stats_key, thread_stats);
+		assert(err == 0);
 	}
+	return thread_stats;
+}
 
-	int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock_fd == -1) {
-		fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-		return errno;
+// every counter has a single writer, so a relaxed load and store replace a locked add
+void stat_add(_Atomic uint64_t* counter, uint64_t value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void histogram_observe(Histogram* histogram, const uint64_t* bounds, uint64_t ns) {
+	size_t i = 0;
+	while (i < HISTOGRAM_LEN - 1 && ns > bounds[i]) {
+		i += 1;
 	}
+	stat_add(&histogram->buckets[i], 1);
+	stat_add(&histogram->sum_ns, ns);
+}
 
-	struct sockaddr_in addr;
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	int err = bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr));
-	if (err == -1) {
-		fprintf(stderr, "[ERROR] bind error: %s (line: %d)\n", strerror(errno), __LINE__);
-		return errno;
+// a read of `player` was queued for its peer, `full` when it filled the queue and reading stops
+void stats_relayed(int player, size_t bytes, bool full) {
+	Stats* s = stats();
+	stat_add(&s->relayed_bytes[player], bytes);
+	stat_add(&s->relayed_messages[player], 1);
+	stat_add(&s->relay_queued, bytes);
+	if (full) {
+		stat_add(&s->relay_stalls, 1);
 	}
+}
 
-	err = listen(sock_fd, SOMAXCONN);
-	if (err == -1) {
-		fprintf(stderr, "[ERROR] listen error: %s (line: %d)\n", strerror(errno), __LINE__);
-		return errno;
+void stats_flushed(size_t bytes) {
+	stat_add(&stats()->relay_flushed, bytes);
+}
+
+void stats_relay_latency(uint64_t started) {
+	if (metrics.timed) {
+		histogram_observe(&stats()->relay_latency, relay_latency_bounds, now_ns() - started);
 	}
-	printf("[LOG] start listening port %d\n", port);
-	
+}
 
-	EntryVector entries = {
-		.ptr = malloc(MINIMAL_CAPACITY * sizeof(Entry)),
-		.len = 0,
-		.cap = MINIMAL_CAPACITY,
-		.mutex = PTHREAD_MUTEX_INITIALIZER,
-	};
+void relay_init(Relay* relay) {
+	relay->head = 0;
+	relay->len = 0;
+	relay->held = 0;
+	relay->pipe_fds[0] = -1;
+	relay->pipe_fds[1] = -1;
+}
 
-	while (true) {
-		int accepted_fd = accept(sock_fd, NULL, NULL);
-		if (accepted_fd == -1) {
-			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(errno), __LINE__);
-			return errno;
+// read whatever fits from `from_fd`, the result is that of read(): -1 with errno set, or 0 when the socket ended
+ssize_t relay_fill(Relay* relay, int from_fd) {
+	assert(relay->len < RELAY_LEN);
+#ifdef __linux__
+	if (relay->pipe_fds[1] != -1) {
+		ssize_t spliced = splice(from_fd, NULL, relay->pipe_fds[1], NULL, RELAY_LEN - relay->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (spliced > 0) {
+			relay->len += spliced;
 		}
-		printf("[LOG] a new connection\n");
-		
-		WaitThreadInfo* info = malloc(sizeof(WaitThreadInfo));
-		*info = (WaitThreadInfo){
-			.sock_fd = accepted_fd,
-			.entries = &entries,
-		};
-		pthread_t thread;
-		int err = pthread_create(&thread, NULL, wait_thread, info);
-		if (err != 0) {
-			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(err), __LINE__);
+		return spliced;
+	}
+#endif
+	// an empty ring starts over at the front, so most reads fill a single segment
+	if (relay->len == 0) {
+		relay->head = 0;
+	}
+	// the free space is the part after the queued bytes, wrapping around to the front of the ring
+	size_t tail = (relay->head + relay->len) % RELAY_LEN;
+	struct iovec iov[2];
+	int iov_len = 1;
+	if (tail >= relay->head) {
+		iov[0] = (struct iovec){ .iov_base = relay->buf + tail, .iov_len = RELAY_LEN - tail };
+		if (relay->head > 0) {
+			iov[1] = (struct iovec){ .iov_base = relay->buf, .iov_len = relay->head };
+			iov_len = 2;
+		}
+	} else {
+		iov[0] = (struct iovec){ .iov_base = relay->buf + tail, .iov_len = relay->head - tail };
+	}
+	ssize_t readed = readv(from_fd, iov, iov_len);
+	if (readed > 0) {
+		relay->len += readed;
+	}
+	return readed;
+}
+
+// the queued bytes that may be sent
+size_t relay_ready(Relay* relay) {
+	return relay->len - relay->held;
+}
+
+// write as much of the queue to `to_fd` as it takes without blocking, returns the byte count or -1 on an error
+ssize_t relay_drain(Relay* relay, int to_fd) {
+	size_t ready = relay_ready(relay);
+	if (ready == 0) {
+		return 0;
+	}
+	ssize_t written;
+#ifdef __linux__
+	if (relay->pipe_fds[0] != -1) {
+		written = splice(relay->pipe_fds[0], NULL, to_fd, NULL, relay->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (written == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		relay->len -= written;
+		return written;
+	}
+#endif
+	// every queued message goes out in one writev, even when the ring wrapped around
+	struct iovec iov[2];
+	int iov_len = 1;
+	if (relay->head + ready <= RELAY_LEN) {
+		iov[0] = (struct iovec){ .iov_base = relay->buf + relay->head, .iov_len = ready };
+	} else {
+		iov[0] = (struct iovec){ .iov_base = relay->buf + relay->head, .iov_len = RELAY_LEN - relay->head };
+		iov[1] = (struct iovec){ .iov_base = relay->buf, .iov_len = ready - iov[0].iov_len };
+		iov_len = 2;
+	}
+	written = writev(to_fd, iov, iov_len);
+	if (written == -1) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+	relay->head = (relay->head + written) % RELAY_LEN;
+	relay->len -= written;
+	return written;
+}
+
+void referee_init(Referee* referee) {
+	*referee = (Referee){
+		.target = REFEREE_NO_TARGET,
+	};
+}
+
+// the text line of a message, spectators are only ever sent text
+size_t message_to_text(const Message* message, char* buf, size_t size) {
+	const uint8_t* values = message->values;
+	int len;
+	switch (message->type) {
+		case MessageDestroyed:
+			len = snprintf(buf, size, "DESTROYED %c,%d,%d,%d\n", message->direction, values[0], values[1], values[2]);
+			break;
+		case MessageIgnore:
+		case MessageBinary:
+			len = snprintf(buf, size, "%s\n", message_methods[message->type]);
+			break;
+		default:
+			len = snprintf(buf, size, "%s %d,%d\n", message_methods[message->type], values[0], values[1]);
+			break;
+	}
+	assert(len > 0 && len < size);
+	return len;
+}
+
+// whether `player` may send `message` right now, the game moves on when it may
+bool referee_check(Referee* referee, int player, const Message* message) {
+	uint8_t bit = 1 << player;
+	const uint8_t* values = message->values;
+
+	if (message->type == MessageBinary) {
+		// only changes how the other player is written to
+		return true;
+	}
+
+	if (message->type == MessageReady) {
+		if ((referee->ready & bit) || values[0] > 1 || values[1] > ROW * COLUMN || values[1] == 0) {
+			return false;
+		}
+		referee->ready |= bit;
+		if (values[0] != 0) {
+			referee->turn_factors |= bit;
+		}
+		referee->hp[player] = values[1];
+		// the rule of main.c: the first player starts when the turn factors add up to an odd number
+		if (referee->ready == 3) {
+			referee->turn = referee->turn_factors == 1 || referee->turn_factors == 2 ? 0 : 1;
+		}
+		return true;
+	}
+
+	if (message->type == MessageFire) {
+		if (referee->ready != 3 || referee->over || referee->turn != player || referee->target != REFEREE_NO_TARGET) {
+			return false;
+		}
+		if (values[0] >= COLUMN || values[1] >= ROW) {
+			return false;
+		}
+		// the shooter counts the columns of the enemy board from the other side
+		referee->turn = 1 - player;
+		referee->target = values[1] * COLUMN + (COLUMN - values[0] - 1);
+		return true;
+	}
+
+	// everything else answers the last FIRE, only the player it aimed at does that and only once
+	if (referee->target == REFEREE_NO_TARGET || referee->turn != player) {
+		return false;
+	}
+	size_t x = referee->target % COLUMN;
+	size_t y = referee->target / COLUMN;
+	uint64_t* shots = &referee->shots[player][referee->target / 64];
+	uint64_t mask = (uint64_t)1 << (referee->target % 64);
+	bool shot = (*shots & mask) != 0;
+	bool hit;
+	if (message->type == MessageIgnore) {
+		// the answer to a cell that was already fired at
+		if (!shot) {
+			return false;
+		}
+		referee->target = REFEREE_NO_TARGET;
+		return true;
+	} else if (message->type == MessageHit || message->type == MessageMiss) {
+		if (shot || values[0] != x || values[1] != y) {
+			return false;
+		}
+		hit = message->type == MessageHit;
+	} else {
+		if (shot) {
+			return false;
+		}
+		// the whole ship, which has to cover the cell that was fired at
+		if (message->direction == 'v' && (values[0] != x || values[1] > y || values[2] < y || values[2] >= ROW)) {
+			return false;
+		} else if (message->direction == 'h' && (values[2] != y || values[0] > x || values[1] < x || values[1] >= COLUMN)) {
+			return false;
+		}
+		hit = true;
+	}
+
+	*shots |= mask;
+	referee->target = REFEREE_NO_TARGET;
+	if (hit && referee->hp[player] > 0) {
+		referee->hp[player] -= 1;
+		if (referee->hp[player] == 0) {
+			referee->over = true;
+		}
+	}
+	return true;
+}
+
+// authoritative mode: check the messages the last fill of `relay` finished, the illegal ones are cut out of the queue
+// and an unfinished one is held back until the rest of it arrives, returns how many bytes were cut out
+size_t referee_filter(Referee* referee, int player, Relay* relay, size_t filled) {
+	uint8_t bit = 1 << player;
+	bool skipping = (referee->skipping & bit) != 0;
+	size_t len = relay->len;
+	// offsets from the head of the queue, kept messages are moved back over the cut out ones
+	size_t start = len - relay->held - filled;
+	size_t kept = start;
+	size_t line_start = start;
+	char line[REFEREE_LINE_LEN];
+	size_t line_len = 0;
+	for (size_t i = start; i < len; i++) {
+		char c = relay->buf[(relay->head + i) % RELAY_LEN];
+		if (!skipping && line_len == sizeof(line)) {
+			skipping = true;
+		}
+		if (!skipping) {
+			line[line_len++] = c;
+		}
+		// a frame ends after the length in its first byte, its payload may hold a newline byte
+		bool frame = !skipping && ((uint8_t)line[0] & FRAME_FLAG);
+		if (frame ? line_len < FRAME_LEN(line[0]) : c != '\n') {
+			continue;
+		}
+		Message message;
+		bool legal = false;
+		if (frame) {
+			legal = decode_frame((uint8_t*)line, &message);
+		} else if (!skipping) {
+			line[line_len - 1] = '\0';
+			legal = parse_text_message(line, &message);
+		}
+		if (legal && referee_check(referee, player, &message)) {
+			for (size_t j = line_start; j <= i && kept != line_start; j++) {
+				relay->buf[(relay->head + kept + j - line_start) % RELAY_LEN] = relay->buf[(relay->head + j) % RELAY_LEN];
+			}
+			kept += i + 1 - line_start;
+		} else {
+			stat_add(&stats()->messages_dropped, 1);
+		}
+		skipping = false;
+		line_len = 0;
+		line_start = i + 1;
+	}
+
+	size_t held = 0;
+	if (!skipping) {
+		held = len - line_start;
+		for (size_t j = 0; j < held && kept != line_start; j++) {
+			relay->buf[(relay->head + kept + j) % RELAY_LEN] = relay->buf[(relay->head + line_start + j) % RELAY_LEN];
+		}
+	}
+	if (skipping) {
+		referee->skipping |= bit;
+	} else {
+		referee->skipping &= ~bit;
+	}
+	relay->len = kept + held;
+	relay->held = held;
+	return len - relay->len;
+}
+
+// a game is registered under its key right away, quick matches are not
+Game* game_new(const char* key) {
+	Game* game = pool_alloc(PoolGame);
+	strncpy(game->key, key, KEY_LEN);
+	game->key[KEY_LEN] = '\0';
+	atomic_init(&game->end, 0);
+	atomic_init(&game->writing, 0);
+	atomic_init(&game->over, false);
+	atomic_init(&game->spectators, 0);
+	atomic_init(&game->refs, 1);
+	game->partial_len[0] = 0;
+	game->partial_len[1] = 0;
+
+	if (!streq(key, MATCH_KEY)) {
+		int err = pthread_mutex_lock(&game_table.mutex);
+		assert(err == 0);
+		game_table.games[encode_key(key)] = game;
+		err = pthread_mutex_unlock(&game_table.mutex);
+		assert(err == 0);
+	}
+	return game;
+}
+
+void game_release(Game* game) {
+	if (atomic_fetch_sub_explicit(&game->refs, 1, memory_order_acq_rel) == 1) {
+		pool_free(PoolGame, game);
+	}
+}
+
+// take a reference on the game running on `key`, NULL when there is none
+Game* game_watch(const char* key) {
+	int err = pthread_mutex_lock(&game_table.mutex);
+	assert(err == 0);
+	Game* game = game_table.games[encode_key(key)];
+	if (game != NULL) {
+		atomic_fetch_add_explicit(&game->refs, 1, memory_order_relaxed);
+		// seq_cst like the load in game_wake, so either the relay wakes the loop or the loop reads the new end
+		atomic_fetch_add(&game->spectators, 1);
+	}
+	err = pthread_mutex_unlock(&game_table.mutex);
+	assert(err == 0);
+	return game;
+}
+
+// pairs with the seq_cst clear of `woken` in spectator_thread, so either the loop sees what was stored before
+// or this writes another byte
+void spectator_loop_wake(void) {
+	if (atomic_exchange(&spectator_loop.woken, true)) {
+		return;
+	}
+	char byte = 0;
+	if (write(spectator_loop.wake_pipe[1], &byte, sizeof(byte)) == -1 && errno != EAGAIN) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	}
+}
+
+void game_wake(Game* game) {
+	if (atomic_load(&game->spectators) != 0) {
+		spectator_loop_wake();
+	}
+}
+
+void game_end(Game* game) {
+	int err = pthread_mutex_lock(&game_table.mutex);
+	assert(err == 0);
+	if (!streq(game->key, MATCH_KEY) && game_table.games[encode_key(game->key)] == game) {
+		game_table.games[encode_key(game->key)] = NULL;
+	}
+	err = pthread_mutex_unlock(&game_table.mutex);
+	assert(err == 0);
+	atomic_store(&game->over, true);
+	game_wake(game);
+	game_release(game);
+}
+
+void game_write(Game* game, uint64_t* end, const char* buf, size_t len) {
+	size_t pos = *end % GAME_RING_LEN;
+	size_t first = GAME_RING_LEN - pos;
+	if (first > len) {
+		first = len;
+	}
+	atomic_store_explicit(&game->writing, *end + len, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(game->ring + pos, buf, first);
+	memcpy(game->ring, buf + first, len - first);
+	*end += len;
+}
+
+// record the whole messages `player` sent as lines, prefixed with its number so spectators can tell the boards apart
+void game_record(Game* game, int player, const char* buf, size_t len) {
+	uint64_t end = atomic_load_explicit(&game->end, memory_order_relaxed);
+	char* partial = game->partial[player];
+	size_t* partial_len = &game->partial_len[player];
+	for (size_t i = 0; i < len; i++) {
+		bool frame = (uint8_t)(*partial_len == 0 ? buf[i] : partial[0]) & FRAME_FLAG;
+		// a line longer than the buffer is cut short, the protocol never sends one
+		if (*partial_len < BUFFER_LEN - 1 || (!frame && buf[i] == '\n')) {
+			partial[(*partial_len)++] = buf[i];
+		}
+		if (frame ? *partial_len < FRAME_LEN(partial[0]) : buf[i] != '\n') {
+			continue;
+		}
+		char prefix[2] = { '1' + player, ' ' };
+		Message message;
+		if (frame && decode_frame((uint8_t*)partial, &message)) {
+			char line[REFEREE_LINE_LEN];
+			size_t line_len = message_to_text(&message, line, sizeof(line));
+			game_write(game, &end, prefix, sizeof(prefix));
+			game_write(game, &end, line, line_len);
+		} else if (!frame && !(*partial_len == strlen("BINARY\n") && memcmp(partial, "BINARY\n", *partial_len) == 0)) {
+			game_write(game, &end, prefix, sizeof(prefix));
+			game_write(game, &end, partial, *partial_len);
+		}
+		*partial_len = 0;
+	}
+	if (end != atomic_load_explicit(&game->end, memory_order_relaxed)) {
+		atomic_store(&game->end, end);
+		game_wake(game);
+	}
+}
+
+// the last `len` bytes a fill made ready to send from `relay`
+void game_record_relay(Game* game, int player, Relay* relay, size_t len) {
+	size_t start = (relay->head + relay_ready(relay) - len) % RELAY_LEN;
+	size_t first = RELAY_LEN - start;
+	if (first > len) {
+		first = len;
+	}
+	game_record(game, player, relay->buf + start, first);
+	game_record(game, player, relay->buf, len - first);
+}
+
+// hands a spectator over to the spectator loop, which keeps the reference on `game`
+void spectate(int sock_fd, Game* game) {
+	stat_add(&stats()->spectators_joined, 1);
+	write_message(sock_fd, "WATCHING\n");
+	fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+	Spectator* spectator = pool_alloc(PoolSpectator);
+	*spectator = (Spectator){
+		.sock_fd = sock_fd,
+		.game = game,
+		.offset = 0,
+		.blocked_since = 0,
+		.next = NULL,
+	};
+
+	int err = pthread_mutex_lock(&spectator_loop.mutex);
+	assert(err == 0);
+	spectator->next = spectator_loop.joining;
+	spectator_loop.joining = spectator;
+	err = pthread_mutex_unlock(&spectator_loop.mutex);
+	assert(err == 0);
+	spectator_loop_wake();
+}
+
+// a late spectator starts at the oldest whole line still in the ring
+uint64_t spectator_start(Game* game) {
+	uint64_t end = atomic_load(&game->end);
+	if (end <= GAME_RING_LEN) {
+		return 0;
+	}
+	uint64_t offset = end - GAME_RING_LEN;
+	while (offset < end && game->ring[offset % GAME_RING_LEN] != '\n') {
+		offset += 1;
+	}
+	// a ring without a newline has no whole line yet, the spectator starts at the end then
+	return offset < end ? offset + 1 : offset;
+}
+
+void spectator_leave(Spectator* spectator, bool dropped) {
+	Game* game = spectator->game;
+	if (dropped) {
+		log_message(LogInfo, "dropped a spectator that fell behind on key: `%s`", game->key);
+		stat_add(&stats()->spectators_dropped, 1);
+	}
+	stat_add(&stats()->spectators_left, 1);
+	atomic_fetch_sub_explicit(&game->spectators, 1, memory_order_relaxed);
+	game_release(game);
+	close(spectator->sock_fd);
+	pool_free(PoolSpectator, spectator);
+}
+
+// sends what the relay recorded since the last call straight from the ring, false once the spectator has to go,
+// a spectator the ring laps or that takes nothing for too long is dropped rather than ever holding the players back
+bool spectator_send(Spectator* spectator, uint64_t now, bool* dropped) {
+	Game* game = spectator->game;
+	while (true) {
+		// `over` is stored after the last end, so an end read after it is final
+		bool over = atomic_load(&game->over);
+		uint64_t end = atomic_load(&game->end);
+		if (end - spectator->offset > GAME_RING_LEN) {
+			*dropped = true;
+			return false;
+		}
+		if (end == spectator->offset) {
+			spectator->blocked_since = 0;
+			return !over;
+		}
+
+		size_t pos = spectator->offset % GAME_RING_LEN;
+		size_t len = end - spectator->offset;
+		if (len > GAME_RING_LEN - pos) {
+			len = GAME_RING_LEN - pos;
+		}
+		ssize_t written = send(spectator->sock_fd, game->ring + pos, len, 0);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		} else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (spectator->blocked_since == 0) {
+				spectator->blocked_since = now;
+			} else if (now - spectator->blocked_since > SPECTATOR_SEND_TIMEOUT * 1000000000ULL) {
+				*dropped = true;
+				return false;
+			}
+			return true;
+		} else if (written <= 0) {
+			return false;
+		}
+		// checked after the send: the relay may have been overwriting the span meanwhile, and the spectator
+		// cannot be given the rest of a torn line
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&game->writing, memory_order_relaxed) - spectator->offset > GAME_RING_LEN) {
+			*dropped = true;
+			return false;
+		}
+		spectator->offset += written;
+		spectator->blocked_since = 0;
+	}
+}
+
+void* spectator_thread(void* raw) {
+	(void)raw;
+	size_t len = 0;
+	size_t capacity = 64;
+	Spectator** spectators = malloc(capacity * sizeof(Spectator*));
+	// the wake pipe first, then one per spectator in the same order
+	struct pollfd* fds = malloc((capacity + 1) * sizeof(struct pollfd));
+	assert(spectators != NULL && fds != NULL);
+	bool batch = false;
+	while (true) {
+		// let a few fills gather instead of sending each of them on its own
+		if (batch) {
+			struct timespec delay = { .tv_sec = 0, .tv_nsec = SPECTATOR_BATCH_MS * 1000000L };
+			nanosleep(&delay, NULL);
+		}
+
+		int err = pthread_mutex_lock(&spectator_loop.mutex);
+		assert(err == 0);
+		Spectator* joining = spectator_loop.joining;
+		spectator_loop.joining = NULL;
+		err = pthread_mutex_unlock(&spectator_loop.mutex);
+		assert(err == 0);
+		while (joining != NULL) {
+			Spectator* spectator = joining;
+			joining = joining->next;
+			if (len == capacity) {
+				capacity *= 2;
+				spectators = realloc(spectators, capacity * sizeof(Spectator*));
+				fds = realloc(fds, (capacity + 1) * sizeof(struct pollfd));
+				assert(spectators != NULL && fds != NULL);
+			}
+			spectator->offset = spectator_start(spectator->game);
+			spectators[len++] = spectator;
+		}
+
+		// cleared before the rings are read, a line recorded from now on writes a new byte
+		atomic_store(&spectator_loop.woken, false);
+		char drain[64];
+		while (read(spectator_loop.wake_pipe[0], drain, sizeof(drain)) > 0) {
+		}
+
+		uint64_t now = now_ns();
+		bool blocked = false;
+		for (size_t i = 0; i < len;) {
+			bool dropped = false;
+			if (!spectator_send(spectators[i], now, &dropped)) {
+				spectator_leave(spectators[i], dropped);
+				spectators[i] = spectators[--len];
+				continue;
+			}
+			blocked |= spectators[i]->blocked_since != 0;
+			i += 1;
+		}
+
+		fds[0] = (struct pollfd){ .fd = spectator_loop.wake_pipe[0], .events = POLLIN };
+		for (size_t i = 0; i < len; i++) {
+			// read as well, only to notice a spectator that hung up
+			short events = POLLIN | (spectators[i]->blocked_since != 0 ? POLLOUT : 0);
+			fds[i + 1] = (struct pollfd){ .fd = spectators[i]->sock_fd, .events = events };
+		}
+		// a blocked spectator is given another look every second so its send timeout can run out
+		int polled = poll(fds, len + 1, blocked ? 1000 : -1);
+		if (polled == -1) {
+			if (errno != EINTR) {
+				log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+			}
+			continue;
+		}
+		batch = fds[0].revents & POLLIN;
+		// backwards, a spectator that hung up takes the place of the last one, which was already looked at
+		for (size_t i = len; i > 0; i--) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			char buf[64];
+			ssize_t readed = read(spectators[i - 1]->sock_fd, buf, sizeof(buf));
+			if (readed == 0 || (readed == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+				spectator_leave(spectators[i - 1], false);
+				spectators[i - 1] = spectators[--len];
+			}
+		}
+	}
+	return NULL;
+}
+
+int spectator_loop_start(void) {
+	if (pipe(spectator_loop.wake_pipe) == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+	for (size_t i = 0; i < 2; i++) {
+		int fd = spectator_loop.wake_pipe[i];
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, spectator_thread, NULL);
+	if (err != 0) {
+		log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+		return err;
+	}
+	err = pthread_detach(thread);
+	assert(err == 0);
+	return 0;
+}
+
+void* work_thread(void* raw_info) {
+	WorkThreadInfo* info = (WorkThreadInfo*)raw_info;
+	int sock1_fd = info->sock1_fd;
+	int sock2_fd = info->sock2_fd;
+
+	char* message = "CONNECTED AS 1";
+	ssize_t written = write(sock1_fd, message, strlen(message));
+	if (written == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	} else if (written != strlen(message)) {
+		log_message(LogError, "not all readed bytes are written to the sock1 (%ld / %ld) (line: %d)", written, strlen(message), __LINE__);
+	}
+
+	message = "CONNECTED AS 2";
+	written = write(sock2_fd, message, strlen(message));
+	if (written == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	} else if (written != strlen(message)) {
+		log_message(LogError, "not all readed bytes are written to the sock2 (%ld / %ld) (line: %d)", written, strlen(message), __LINE__);
+	}
+
+	// relays[i] holds the bytes read from fds[i] that fds[1 - i] has not taken yet
+	Relay relays[2];
+	relay_init(&relays[0]);
+	relay_init(&relays[1]);
+	Referee referee;
+	referee_init(&referee);
+#ifdef __linux__
+	if (info->config->use_splice) {
+		// the queue of a direction is its pipe, so each direction gets one
+		for (size_t i = 0; i < 2; i++) {
+			int err = pipe2(relays[i].pipe_fds, O_CLOEXEC);
+			if (err == -1) {
+				log_message(LogError, "pipe error, falling back to copying: %s (line: %d)", strerror(errno), __LINE__);
+				relays[i].pipe_fds[0] = -1;
+				relays[i].pipe_fds[1] = -1;
+			}
+		}
+	}
+#endif
+	// a slow peer must not block the thread, its bytes wait in the relay instead
+	fcntl(sock1_fd, F_SETFL, fcntl(sock1_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(sock2_fd, F_SETFL, fcntl(sock2_fd, F_GETFL) | O_NONBLOCK);
+
+	struct pollfd fds[2] = {
+		{ .fd = sock1_fd, .events = POLLIN },
+		{ .fd = sock2_fd, .events = POLLIN },
+	};
+	int timeout = -1;
+	if (info->config->idle_timeout != 0) {
+		timeout = info->config->idle_timeout * 1000;
+	}
+	bool end = false;
+	while (!end) {
+		for (size_t i = 0; i < 2; i++) {
+			// backpressure: a side is only read while its peer keeps up
+			fds[i].events = 0;
+			if (relays[i].len < RELAY_LEN) {
+				fds[i].events |= POLLIN;
+			}
+			if (relay_ready(&relays[1 - i]) > 0) {
+				fds[i].events |= POLLOUT;
+			}
+		}
+		int pollled = poll(fds, 2, timeout);
+		if (pollled == -1) {
+			log_message(LogError, "error on poll %s (line: %d)", strerror(errno), __LINE__);
+			break;
+		} else if (pollled == 0) {
+			log_message(LogInfo, "idle timeout");
+			write_message(sock1_fd, "error: idle timeout");
+			write_message(sock2_fd, "error: idle timeout");
+			break;
+		}
+		uint64_t started = 0;
+		if (metrics.timed) {
+			started = now_ns();
+		}
+
+		for (size_t i = 0; i < 2 && !end; i++) {
+			int from_fd = fds[i].fd;
+			int to_fd = fds[1 - i].fd;
+			if (fds[i].revents & POLLOUT) {
+				ssize_t drained = relay_drain(&relays[1 - i], from_fd);
+				if (drained == -1) {
+					log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+					end = true;
+					break;
+				}
+				stats_flushed(drained);
+			}
+			if (fds[i].revents & POLLIN) {
+				size_t ready = relay_ready(&relays[i]);
+				ssize_t filled = relay_fill(&relays[i], from_fd);
+				if (filled == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					continue;
+				} else if (filled == -1) {
+					log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+					end = true;
+					break;
+				} else if (filled == 0) {
+					log_message(LogDebug, "a socket ended");
+					end = true;
+					break;
+				}
+				if (info->config->authoritative) {
+					filled -= referee_filter(&referee, i, &relays[i], filled);
+				}
+				stats_relayed(i, filled, relays[i].len == RELAY_LEN);
+				if (info->game != NULL) {
+					game_record_relay(info->game, i, &relays[i], relay_ready(&relays[i]) - ready);
+				}
+				// most of the time the peer takes the bytes right away and no POLLOUT round is needed
+				ssize_t drained = relay_drain(&relays[i], to_fd);
+				if (drained == -1) {
+					log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+					end = true;
+					break;
+				}
+				stats_flushed(drained);
+				stats_relay_latency(started);
+			} else if (fds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+				log_message(LogDebug, "a socket ended");
+				end = true;
+			}
+		}
+	}
+
+#ifdef __linux__
+	for (size_t i = 0; i < 2; i++) {
+		if (relays[i].pipe_fds[0] != -1) {
+			close(relays[i].pipe_fds[0]);
+			close(relays[i].pipe_fds[1]);
+		}
+	}
+#endif
+	if (info->game != NULL) {
+		game_end(info->game);
+	}
+	close(sock1_fd);
+	close(sock2_fd);
+	stat_add(&stats()->games_ended, 1);
+	pool_free(PoolWorkThreadInfo, raw_info);
+	return NULL;
+}
+
+Lobby lobby_new(void) {
+	// calloc of this size is backed by lazily mapped zero pages, only touched slots take memory
+	_Atomic uint64_t* slots = calloc(KEY_SPACE + 1, sizeof(_Atomic uint64_t));
+	assert(slots != NULL);
+	_Atomic uint32_t* size = calloc(1, sizeof(_Atomic uint32_t));
+	assert(size != NULL);
+	return (Lobby){
+		.slots = slots,
+		.size = size,
+		.cap = 0,
+		.shared = NULL,
+	};
+}
+
+int entry_fd(uint64_t entry) {
+	return (int)(entry & ((1 << SLOT_FD_BITS) - 1)) - 1;
+}
+
+uint32_t entry_process(uint64_t entry) {
+	return ((entry >> SLOT_PROCESS_SHIFT) & 0xff) - 1;
+}
+
+bool entry_is_claim(uint64_t entry) {
+	return (entry >> SLOT_CLAIMER_SHIFT) != 0;
+}
+
+uint32_t claim_process(uint64_t claim) {
+	return ((claim >> SLOT_CLAIMER_SHIFT) & 0xff) - 1;
+}
+
+// the entry a socket of this process waits in a slot with
+uint64_t lobby_entry(Lobby* lobby, int sock_fd) {
+	uint64_t entry = (uint64_t)sock_fd + 1;
+	SharedLobby* shared = lobby->shared;
+	if (shared != NULL) {
+		uint64_t sequence = atomic_fetch_add_explicit(&shared->sequence, 1, memory_order_relaxed) & 0xff;
+		entry |= (uint64_t)(shared->index + 1) << SLOT_PROCESS_SHIFT;
+		entry |= (uint64_t)(shared->generation & 0xff) << SLOT_GENERATION_SHIFT;
+		entry |= sequence << SLOT_SEQUENCE_SHIFT;
+	}
+	return entry;
+}
+
+bool shared_entry_is_own(SharedLobby* shared, uint64_t entry) {
+	return entry_process(entry) == shared->index && ((entry >> SLOT_GENERATION_SHIFT) & 0xff) == (shared->generation & 0xff);
+}
+
+// `entry` claimed by this process
+uint64_t shared_claim(SharedLobby* shared, uint64_t entry) {
+	uint64_t claim = entry | (uint64_t)(shared->index + 1) << SLOT_CLAIMER_SHIFT;
+	return claim | (uint64_t)(shared->generation & 0xff) << SLOT_CLAIMER_GENERATION_SHIFT;
+}
+
+// reserve a place for a socket about to wait, false when the lobby is at its cap
+bool lobby_reserve(Lobby* lobby) {
+	if (lobby->cap == 0) {
+		return true;
+	}
+	uint32_t size = atomic_fetch_add_explicit(lobby->size, 1, memory_order_relaxed);
+	if (size >= lobby->cap) {
+		atomic_fetch_sub_explicit(lobby->size, 1, memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+void lobby_release(Lobby* lobby) {
+	if (lobby->cap != 0) {
+		atomic_fetch_sub_explicit(lobby->size, 1, memory_order_relaxed);
+	}
+}
+
+#ifdef __linux__
+int shared_lobby_addr(SharedLobby* shared, uint32_t index, struct sockaddr_un* addr) {
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s.%u", shared->path, index);
+	if (len < 0 || len >= sizeof(addr->sun_path)) {
+		log_message(LogError, "the shared lobby path `%s` is too long for a unix socket (line: %d)", shared->path, __LINE__);
+		return 1;
+	}
+	return 0;
+}
+
+// whether the process that put `claim` in a slot still runs, the kernel drops the lock on its index when it dies
+bool shared_claimer_alive(SharedLobby* shared, uint64_t claim) {
+	uint32_t index = claim_process(claim);
+	uint32_t generation = (claim >> SLOT_CLAIMER_GENERATION_SHIFT) & 0xff;
+	if (index >= SHARED_PROCESSES || (atomic_load(&shared->header->generations[index]) & 0xff) != generation) {
+		return false;
+	}
+	if (index == shared->index) {
+		return true;
+	}
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = index, .l_len = 1 };
+	if (fcntl(shared->fd, F_GETLK, &lock) == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return true;
+	}
+	return lock.l_type != F_UNLCK;
+}
+
+// clear the entries a crashed process left behind at `index`, their sockets were closed with it, and give back
+// the entries it had claimed but not taken yet, those sockets still wait in their own process
+void shared_lobby_sweep(Lobby* lobby, uint32_t index) {
+	size_t swept = 0;
+	size_t given_back = 0;
+	for (size_t i = 0; i <= KEY_SPACE; i++) {
+		uint64_t entry = atomic_load_explicit(&lobby->slots[i], memory_order_relaxed);
+		uint64_t next;
+		if (entry == 0) {
+			continue;
+		} else if (entry_is_claim(entry) && claim_process(entry) == index) {
+			next = entry & SLOT_ENTRY_MASK;
+		} else if (!entry_is_claim(entry) && entry_process(entry) == index) {
+			next = 0;
+		} else {
+			continue;
+		}
+		if (atomic_compare_exchange_strong_explicit(&lobby->slots[i], &entry, next, memory_order_acq_rel, memory_order_relaxed)) {
+			if (next == 0) {
+				swept += 1;
+			} else {
+				given_back += 1;
+			}
+		}
+	}
+	if (swept > 0) {
+		log_message(LogInfo, "cleared %lu waiting socket(s) of a process that is gone", swept);
+	}
+	if (given_back > 0) {
+		log_message(LogInfo, "gave back %lu waiting socket(s) claimed by a process that is gone", given_back);
+	}
+}
+
+// map the lobby file at `path`, creating it when it does not exist yet, and take a free index in it
+int shared_lobby_open(Lobby* lobby, const char* path) {
+	if (fd_table_len() >= (1 << SLOT_FD_BITS)) {
+		log_message(LogError, "a shared lobby holds fds below %d, lower the fd limit (line: %d)", 1 << SLOT_FD_BITS, __LINE__);
+		return 1;
+	}
+	SharedLobby* shared = calloc(1, sizeof(SharedLobby));
+	assert(shared != NULL);
+	shared->path = path;
+	shared->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (shared->fd == -1) {
+		log_message(LogError, "cannot open the shared lobby `%s`: %s (line: %d)", path, strerror(errno), __LINE__);
+		return 1;
+	}
+	// zeroed is an empty lobby, so whichever process comes first only has to size the file
+	size_t len = SHARED_SLOTS_OFFSET + (KEY_SPACE + 1) * sizeof(_Atomic uint64_t);
+	struct stat st;
+	int err = fstat(shared->fd, &st);
+	assert(err == 0);
+	if (st.st_size == 0) {
+		err = ftruncate(shared->fd, len);
+		if (err == -1) {
+			log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+			return 1;
+		}
+	} else if (st.st_size != len) {
+		log_message(LogError, "`%s` is not a shared lobby of this server (line: %d)", path, __LINE__);
+		return 1;
+	}
+	void* mapped = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, shared->fd, 0);
+	if (mapped == MAP_FAILED) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return 1;
+	}
+	shared->header = mapped;
+	uint64_t magic = 0;
+	if (!atomic_compare_exchange_strong(&shared->header->magic, &magic, SHARED_MAGIC) && magic != SHARED_MAGIC) {
+		log_message(LogError, "`%s` is not a shared lobby of this server (line: %d)", path, __LINE__);
+		return 1;
+	}
+
+	// the kernel drops the lock of a process that dies, so a free index is one nobody holds a lock on
+	shared->index = SHARED_PROCESSES;
+	for (uint32_t i = 0; i < SHARED_PROCESSES; i++) {
+		struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = i, .l_len = 1 };
+		if (fcntl(shared->fd, F_SETLK, &lock) == 0) {
+			shared->index = i;
+			break;
+		}
+	}
+	if (shared->index == SHARED_PROCESSES) {
+		log_message(LogError, "%d processes already share the lobby `%s` (line: %d)", SHARED_PROCESSES, path, __LINE__);
+		return 1;
+	}
+	uint32_t generation = atomic_fetch_add(&shared->header->generations[shared->index], 1);
+	shared->generation = generation + 1;
+	lobby->slots = (_Atomic uint64_t*)((char*)mapped + SHARED_SLOTS_OFFSET);
+	if (generation != 0) {
+		shared_lobby_sweep(lobby, shared->index);
+	}
+
+	struct sockaddr_un addr;
+	if (shared_lobby_addr(shared, shared->index, &addr) != 0) {
+		return 1;
+	}
+	// left behind by the process that held this index before
+	unlink(addr.sun_path);
+	shared->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (shared->listen_fd == -1 || bind(shared->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(shared->listen_fd, SOMAXCONN) == -1) {
+		log_message(LogError, "cannot listen on `%s`: %s (line: %d)", addr.sun_path, strerror(errno), __LINE__);
+		return 1;
+	}
+	shared->published_len = fd_table_len();
+	shared->published = calloc(shared->published_len, sizeof(_Atomic uint64_t));
+	assert(shared->published != NULL);
+	shared->timers = NULL;
+	lobby->shared = shared;
+	log_message(LogInfo, "sharing the lobby `%s` as process %u", path, shared->index);
+	return 0;
+}
+
+// ask the process holding `entry` for its waiting socket, -1 when it is gone or no longer has it and -2 when this
+// process could not ask, the socket may still be waiting then
+int shared_lobby_fetch(SharedLobby* shared, uint64_t entry, uint64_t* started) {
+	struct sockaddr_un addr;
+	if (shared_lobby_addr(shared, entry_process(entry), &addr) != 0) {
+		return -2;
+	}
+	int sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock_fd == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return -2;
+	}
+	struct timeval timeout = { .tv_sec = SHARED_TIMEOUT };
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		log_message(LogInfo, "process %u of the shared lobby is gone: %s", entry_process(entry), strerror(errno));
+		close(sock_fd);
+		return -1;
+	}
+	if (send(sock_fd, &entry, sizeof(entry), MSG_NOSIGNAL) != sizeof(entry)) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		close(sock_fd);
+		return -1;
+	}
+
+	struct iovec iov = { .iov_base = started, .iov_len = sizeof(*started) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t readed;
+	do {
+		readed = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (readed == -1 && errno == EINTR);
+	close(sock_fd);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (readed != sizeof(*started) || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	int wait_sock_fd;
+	memcpy(&wait_sock_fd, CMSG_DATA(cmsg), sizeof(int));
+	stat_add(&stats()->transfers_in, 1);
+	return wait_sock_fd;
+}
+
+#endif
+
+// take the socket of an entry of this process just removed from its slot, -1 when it is no longer there to take
+int lobby_claim(Lobby* lobby, uint64_t entry, uint64_t* started) {
+	int wait_sock_fd = entry_fd(entry);
+	SharedLobby* shared = lobby->shared;
+	if (shared != NULL) {
+		// the lobby timeout takes a socket back until it is marked as taken here
+		uint64_t expected = entry;
+		if (!atomic_compare_exchange_strong_explicit(&shared->published[wait_sock_fd], &expected, 0, memory_order_acq_rel, memory_order_relaxed)) {
+			return -1;
+		}
+	}
+	lobby_release(lobby);
+	*started = 0;
+	if (metrics.timed && wait_sock_fd < metrics.wait_started_len) {
+		*started = metrics.wait_started[wait_sock_fd];
+	}
+	stat_add(&stats()->lobby_leaves, 1);
+	return wait_sock_fd;
+}
+
+// one attempt at the slot that never waits on another process: wait in it, take the entry of this process out of it,
+// or turn the entry of another process into a claim of this one, `*taken` is what was put in or taken out
+LobbyResult lobby_swap(Lobby* lobby, _Atomic uint64_t* slot, int sock_fd, uint64_t entry, uint64_t* taken) {
+	SharedLobby* shared = lobby->shared;
+	uint64_t current = atomic_load_explicit(slot, memory_order_acquire);
+	while (true) {
+		// a failed exchange reloads `current`, the loop then retries with whatever won the race
+		if (current == 0) {
+			// the place is given back when the exchange loses, so a full lobby still pairs
+			if (!lobby_reserve(lobby)) {
+				current = atomic_load_explicit(slot, memory_order_acquire);
+				if (current == 0) {
+					return LobbyFull;
+				}
+				continue;
+			}
+			// published by the exchange, the pairing reads it after taking the slot
+			if (metrics.timed && sock_fd < metrics.wait_started_len) {
+				metrics.wait_started[sock_fd] = now_ns();
+			}
+			if (shared != NULL) {
+				atomic_store_explicit(&shared->published[sock_fd], entry, memory_order_relaxed);
+			}
+			if (atomic_compare_exchange_weak_explicit(slot, &current, entry, memory_order_acq_rel, memory_order_acquire)) {
+				*taken = entry;
+				return LobbyWaiting;
+			}
+			if (shared != NULL) {
+				atomic_store_explicit(&shared->published[sock_fd], 0, memory_order_relaxed);
+			}
+			lobby_release(lobby);
+		} else if (shared == NULL || shared_entry_is_own(shared, current)) {
+			if (atomic_compare_exchange_weak_explicit(slot, &current, 0, memory_order_acq_rel, memory_order_acquire)) {
+				*taken = current;
+				return LobbyPaired;
+			}
+#ifdef __linux__
+		} else if (entry_is_claim(current)) {
+			if (shared_claimer_alive(shared, current)) {
+				return LobbyBusy;
+			}
+			// the process asking for the socket died before it was handed over, it still waits in its own process
+			atomic_compare_exchange_weak_explicit(slot, &current, current & SLOT_ENTRY_MASK, memory_order_acq_rel, memory_order_acquire);
+		} else {
+			uint64_t claim = shared_claim(shared, current);
+			if (atomic_compare_exchange_weak_explicit(slot, &current, claim, memory_order_acq_rel, memory_order_acquire)) {
+				*taken = claim;
+				return LobbyClaimed;
+			}
+#endif
+		}
+	}
+}
+
+// pair with the socket waiting on `key`, or wait on `key` unless the lobby is at its cap
+LobbyResult lobby_join(Lobby* lobby, const char* key, int sock_fd, int* wait_sock_fd) {
+	_Atomic uint64_t* slot = &lobby->slots[encode_key(key)];
+	uint64_t entry = lobby_entry(lobby, sock_fd);
+	while (true) {
+		uint64_t taken;
+		uint64_t started = 0;
+		LobbyResult result = lobby_swap(lobby, slot, sock_fd, entry, &taken);
+		if (result == LobbyWaiting) {
+			log_message(LogInfo, "new key: `%s`", key);
+			stat_add(&stats()->lobby_joins, 1);
+			return LobbyWaiting;
+		} else if (result == LobbyFull) {
+			return LobbyFull;
+		} else if (result == LobbyBusy) {
+			// the other process answers within SHARED_TIMEOUT, or the claim is given back once it is gone
+			usleep(SHARED_CLAIM_WAIT_US);
+			continue;
+		} else if (result == LobbyClaimed) {
+#ifdef __linux__
+			// asked outside of lobby_swap, other joins on the key wait on the claim instead of an empty slot
+			*wait_sock_fd = shared_lobby_fetch(lobby->shared, taken & SLOT_ENTRY_MASK, &started);
+			// nothing but this process takes a live claim of its own out of the slot
+			uint64_t next = *wait_sock_fd == -2 ? taken & SLOT_ENTRY_MASK : 0;
+			bool swapped = atomic_compare_exchange_strong_explicit(slot, &taken, next, memory_order_acq_rel, memory_order_relaxed);
+			assert(swapped);
+			if (*wait_sock_fd == -2) {
+				// the socket keeps waiting in its process, this one is turned away like on a full lobby
+				return LobbyFull;
+			}
+#endif
+		} else {
+			*wait_sock_fd = lobby_claim(lobby, taken, &started);
+		}
+		if (*wait_sock_fd == -1) {
+			// the socket timed out or its process is gone, and its slot is empty now
+			continue;
+		}
+		log_message(LogInfo, "paired key: `%s`", key);
+		Stats* s = stats();
+		stat_add(&s->pairs, 1);
+		if (metrics.timed && started != 0) {
+			histogram_observe(&s->lobby_wait, lobby_wait_bounds, now_ns() - started);
+		}
+		return LobbyPaired;
+	}
+}
+
+// tell a socket the lobby has no place for it, the caller closes it
+void lobby_reject(Lobby* lobby, const char* key, int sock_fd) {
+	log_message(LogInfo, "the lobby is full (%u waiting), rejected key: `%s`", lobby->cap, key);
+	stat_add(&stats()->rejected_lobby, 1);
+	write_message(sock_fd, "error: lobby is full");
+}
+
+// remove a waiting socket that hung up before it was paired
+bool lobby_remove(Lobby* lobby, const char* key, int sock_fd) {
+	_Atomic uint64_t* slot = &lobby->slots[encode_key(key)];
+	SharedLobby* shared = lobby->shared;
+	uint64_t entry = (uint64_t)sock_fd + 1;
+	if (shared != NULL) {
+		entry = atomic_load_explicit(&shared->published[sock_fd], memory_order_relaxed);
+		if (entry == 0) {
+			return false;
+		}
+	}
+	uint64_t expected = entry;
+	if (!atomic_compare_exchange_strong_explicit(slot, &expected, 0, memory_order_acq_rel, memory_order_acquire)) {
+		// another process took the slot but did not ask for the socket yet, taking it back here makes that ask fail
+		if (shared == NULL || !atomic_compare_exchange_strong_explicit(&shared->published[sock_fd], &entry, 0, memory_order_acq_rel, memory_order_relaxed)) {
+			return false;
+		}
+		lobby_release(lobby);
+		stat_add(&stats()->lobby_leaves, 1);
+		return true;
+	}
+	if (shared != NULL) {
+		atomic_store_explicit(&shared->published[sock_fd], 0, memory_order_relaxed);
+	}
+	lobby_release(lobby);
+	stat_add(&stats()->lobby_leaves, 1);
+	return true;
+}
+
+void admission_init(uint32_t rate) {
+	admission.rate = rate;
+	if (rate == 0) {
+		return;
+	}
+	admission.locks = malloc(ADMISSION_GROUPS * sizeof(pthread_mutex_t));
+	assert(admission.locks != NULL);
+	for (size_t i = 0; i < ADMISSION_GROUPS; i++) {
+		int err = pthread_mutex_init(&admission.locks[i], NULL);
+		assert(err == 0);
+	}
+	admission.buckets = calloc(ADMISSION_GROUPS * ADMISSION_GROUP_LEN, sizeof(Bucket));
+	assert(admission.buckets != NULL);
+}
+
+// take a token from the bucket of the address `sock_fd` connected from, false when it has none left
+bool admission_allow(int sock_fd) {
+	if (admission.rate == 0) {
+		return true;
+	}
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	if (getpeername(sock_fd, (struct sockaddr*)&addr, &addr_len) == -1 || addr.sin_family != AF_INET) {
+		return true;
+	}
+	uint32_t key = addr.sin_addr.s_addr;
+	// fibonacci hashing spreads the addresses of one subnet over the groups
+	size_t group = (uint32_t)(key * 2654435769u) % ADMISSION_GROUPS;
+	Bucket* buckets = &admission.buckets[group * ADMISSION_GROUP_LEN];
+	uint64_t now = now_ns();
+	uint64_t burst = (uint64_t)admission.rate * ADMISSION_BURST_SECONDS * 1000;
+
+	int err = pthread_mutex_lock(&admission.locks[group]);
+	assert(err == 0);
+	// an address that is not in its group takes the bucket used least recently, an address quiet for that long
+	// has most likely refilled its bucket anyway
+	Bucket* bucket = &buckets[0];
+	for (size_t i = 0; i < ADMISSION_GROUP_LEN; i++) {
+		if (buckets[i].addr == key) {
+			bucket = &buckets[i];
+			break;
+		} else if (buckets[i].updated < bucket->updated) {
+			bucket = &buckets[i];
+		}
+	}
+	if (bucket->addr != key) {
+		*bucket = (Bucket){
+			.addr = key,
+			.tokens = burst,
+			.updated = now,
+		};
+	}
+	uint64_t elapsed = now - bucket->updated;
+	uint64_t tokens = burst;
+	if (elapsed < (uint64_t)ADMISSION_BURST_SECONDS * 1000000000) {
+		tokens = bucket->tokens + elapsed * admission.rate / 1000000;
+	}
+	bucket->tokens = tokens < burst ? tokens : burst;
+	bucket->updated = now;
+	bool allowed = bucket->tokens >= 1000;
+	if (allowed) {
+		bucket->tokens -= 1000;
+	}
+	err = pthread_mutex_unlock(&admission.locks[group]);
+	assert(err == 0);
+
+	if (!allowed) {
+		char addr_str[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &addr.sin_addr, addr_str, sizeof(addr_str));
+		log_message(LogInfo, "too many connections from %s", addr_str);
+		stat_add(&stats()->rejected_rate, 1);
+		write_message(sock_fd, "error: too many connections");
+	}
+	return allowed;
+}
+
+typedef enum AcceptRecovery {
+	// the listening socket itself is broken
+	AcceptFailed,
+	// accept again right away
+	AcceptAgain,
+	// nothing more can be taken now, accept again on the next readiness of the listening socket
+	AcceptIdle,
+} AcceptRecovery;
+
+// handle a failed accept() so the loop keeps serving, `wait_ms` is how long a blocking loop may wait for a
+// connection it can turn away
+AcceptRecovery accept_recover(int listen_fd, int err, int wait_ms) {
+	switch (err) {
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+		case EPERM:
+			return AcceptAgain;
+		case EAGAIN:
+			return AcceptIdle;
+		case EBADF:
+		case EINVAL:
+		case ENOTSOCK:
+		case EOPNOTSUPP:
+			log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+			return AcceptFailed;
+	}
+	stat_add(&stats()->accept_errors, 1);
+	log_message(LogError, "accept error: %s (line: %d)", strerror(err), __LINE__);
+	if (err != EMFILE && err != ENFILE) {
+		// ENOBUFS, ENOMEM and the like clear up on their own
+		usleep(wait_ms * 1000);
+		return AcceptIdle;
+	}
+
+	// out of fds, which accept() reports even when nothing is pending: giving up the spare fd makes room to take
+	// a pending connection and tell it why it is closed, otherwise it would sit in the backlog
+	AcceptRecovery recovery = AcceptIdle;
+	int spare_fd = atomic_exchange_explicit(&admission.spare_fd, -1, memory_order_acq_rel);
+	if (spare_fd == -1) {
+		// another thread holds it right now, or it could not be opened again yet
+		usleep(wait_ms * 1000);
+		return AcceptIdle;
+	}
+	close(spare_fd);
+	struct pollfd fds = { .fd = listen_fd, .events = POLLIN };
+	if (poll(&fds, 1, wait_ms) > 0) {
+		int sock_fd = accept(listen_fd, NULL, NULL);
+		if (sock_fd != -1) {
+			stat_add(&stats()->rejected_fds, 1);
+			write_message(sock_fd, "error: server is full");
+			close(sock_fd);
+			recovery = AcceptAgain;
+		}
+	}
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (spare_fd != -1) {
+		int expected = -1;
+		if (!atomic_compare_exchange_strong_explicit(&admission.spare_fd, &expected, spare_fd, memory_order_acq_rel, memory_order_acquire)) {
+			close(spare_fd);
+		}
+	}
+	return recovery;
+}
+
+// the splitmix64 finalizer, neighbouring keys land far apart on the ring
+uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111eb;
+	x ^= x >> 31;
+	return x;
+}
+
+// the points of a node only depend on its name, so the order of the peer file does not matter
+uint64_t cluster_point_hash(const char* node, uint32_t point) {
+	// fnv-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (const char* c = node; *c != '\0'; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= 0x100000001b3;
+	}
+	return mix64(hash + point);
+}
+
+int compare_cluster_point(const void* a, const void* b) {
+	const ClusterPoint* x = a;
+	const ClusterPoint* y = b;
+	if (x->hash != y->hash) {
+		return (x->hash > y->hash) - (x->hash < y->hash);
+	}
+	return strcmp(cluster.nodes[x->node], cluster.nodes[y->node]);
+}
+
+// a node is "host:port" where main.c can connect to host, so only an ipv4 address or localhost
+bool cluster_parse_node(const char* node, uint16_t* port) {
+	size_t len = strlen(node);
+	const char* colon = strrchr(node, ':');
+	if (len >= CLUSTER_NODE_LEN || colon == NULL) {
+		return false;
+	}
+	char host[CLUSTER_NODE_LEN];
+	memcpy(host, node, colon - node);
+	host[colon - node] = '\0';
+	struct in_addr addr;
+	if (!streq(host, "localhost") && inet_pton(AF_INET, host, &addr) != 1) {
+		return false;
+	}
+	uint64_t number;
+	if (!parse_number(colon + 1, UINT16_MAX, &number) || number == 0) {
+		return false;
+	}
+	*port = number;
+	return true;
+}
+
+// read the peer file, one "host:port" per line and `#` starts a comment; this node is `self`, or the only node
+// listening on `port` when `self` is NULL
+int cluster_load(const char* path, const char* self, uint16_t port) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		log_message(LogError, "cannot open the peer file `%s`: %s (line: %d)", path, strerror(errno), __LINE__);
+		return 1;
+	}
+	size_t nodes_cap = 0;
+	char* line = NULL;
+	size_t line_cap = 0;
+	int result = 0;
+	while (getline(&line, &line_cap, file) != -1) {
+		line[strcspn(line, "#")] = '\0';
+		char* node = line + strspn(line, " \t\r\n");
+		node[strcspn(node, " \t\r\n")] = '\0';
+		if (*node == '\0') {
+			continue;
+		}
+		uint16_t node_port;
+		if (!cluster_parse_node(node, &node_port)) {
+			log_message(LogError, "the node `%s` of the peer file is not <ipv4 address or localhost>:<port> (line: %d)", node, __LINE__);
+			result = 1;
+			break;
+		}
+		for (size_t i = 0; i < cluster.nodes_len; i++) {
+			if (streq(cluster.nodes[i], node)) {
+				log_message(LogError, "the node `%s` is in the peer file twice (line: %d)", node, __LINE__);
+				result = 1;
+			}
+		}
+		if (result != 0) {
+			break;
+		}
+		if (cluster.nodes_len == nodes_cap) {
+			nodes_cap = nodes_cap == 0 ? 8 : nodes_cap * 2;
+			cluster.nodes = realloc(cluster.nodes, nodes_cap * CLUSTER_NODE_LEN);
+			assert(cluster.nodes != NULL);
+		}
+		strcpy(cluster.nodes[cluster.nodes_len], node);
+		cluster.nodes_len += 1;
+	}
+	free(line);
+	fclose(file);
+	if (result != 0) {
+		return result;
+	}
+	if (cluster.nodes_len == 0) {
+		log_message(LogError, "the peer file `%s` has no node (line: %d)", path, __LINE__);
+		return 1;
+	}
+
+	cluster.self = SIZE_MAX;
+	for (size_t i = 0; i < cluster.nodes_len; i++) {
+		uint16_t node_port;
+		bool parsed = cluster_parse_node(cluster.nodes[i], &node_port);
+		assert(parsed);
+		if (self != NULL ? !streq(cluster.nodes[i], self) : node_port != port) {
+			continue;
+		}
+		if (cluster.self != SIZE_MAX) {
+			log_message(LogError, "more than one node of the peer file uses port %d, pick this one with --node (line: %d)", port, __LINE__);
+			return 1;
+		}
+		cluster.self = i;
+	}
+	if (cluster.self == SIZE_MAX) {
+		log_message(LogError, "this node is not in the peer file `%s` (line: %d)", path, __LINE__);
+		return 1;
+	}
+
+	cluster.points_len = cluster.nodes_len * CLUSTER_POINTS;
+	cluster.points = malloc(cluster.points_len * sizeof(ClusterPoint));
+	assert(cluster.points != NULL);
+	for (size_t i = 0; i < cluster.nodes_len; i++) {
+		for (uint32_t j = 0; j < CLUSTER_POINTS; j++) {
+			cluster.points[i * CLUSTER_POINTS + j] = (ClusterPoint){
+				.hash = cluster_point_hash(cluster.nodes[i], j),
+				.node = i,
+			};
+		}
+	}
+	qsort(cluster.points, cluster.points_len, sizeof(ClusterPoint), compare_cluster_point);
+	log_message(LogInfo, "cluster of %lu node(s), this node is `%s`", cluster.nodes_len, cluster.nodes[cluster.self]);
+	return 0;
+}
+
+// the node owning a valid key, the quick match queue is a key of its own so it lives on a single node
+size_t cluster_owner(const char* key) {
+	uint64_t hash = mix64(encode_key(key));
+	size_t low = 0;
+	size_t high = cluster.points_len;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (cluster.points[middle].hash < hash) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	// past the last point the ring wraps around to the first
+	if (low == cluster.points_len) {
+		low = 0;
+	}
+	return cluster.points[low].node;
+}
+
+// tell a socket that sent a key, or WATCH and a key, of another node where to go, true when it was redirected and
+// should be closed; a game is watched on the node owning its key
+bool cluster_redirect(char* handshake, int sock_fd) {
+	if (cluster.nodes_len == 0) {
+		return false;
+	}
+	char* key = handshake;
+	if (string_has_prefix(handshake, WATCH_PREFIX)) {
+		key += strlen(WATCH_PREFIX);
+		if (streq(key, MATCH_KEY)) {
+			return false;
+		}
+	}
+	if (!is_valid_key(key)) {
+		return false;
+	}
+	size_t owner = cluster_owner(key);
+	if (owner == cluster.self) {
+		return false;
+	}
+	log_message(LogDebug, "redirected key `%s` to `%s`", key, cluster.nodes[owner]);
+	stat_add(&stats()->redirects, 1);
+	char message[sizeof(REDIRECT_PREFIX) + CLUSTER_NODE_LEN];
+	snprintf(message, sizeof(message), REDIRECT_PREFIX "%s", cluster.nodes[owner]);
+	write_message(sock_fd, message);
+	return true;
+}
+
+// answer a spectator where games are not recorded: the reactors and splice never see the bytes of a game, true when
+// it was answered and should be closed
+bool watch_unsupported(const char* handshake, int sock_fd) {
+	if (!string_has_prefix(handshake, WATCH_PREFIX) || game_table.games != NULL) {
+		return false;
+	}
+	log_message(LogInfo, "a spectator came to a server that does not record games");
+	write_message(sock_fd, "error: spectating needs thread mode without splice");
+	return true;
+}
+
+void waiter_expire(void* raw_timers, Timer* timer) {
+	WaiterTimers* timers = raw_timers;
+	Waiter* waiter = (Waiter*)timer;
+	timers->waiters[waiter->sock_fd] = NULL;
+	// when the entry is gone the socket was just paired, and the pairing will find no waiter
+	if (lobby_remove(timers->lobby, waiter->key, waiter->sock_fd)) {
+		log_message(LogInfo, "lobby timeout for key: `%s`", waiter->key);
+		write_message(waiter->sock_fd, "error: lobby timeout");
+		close(waiter->sock_fd);
+	}
+	pool_free(PoolWaiter, waiter);
+}
+
+void* waiter_timers_thread(void* raw_timers) {
+	WaiterTimers* timers = raw_timers;
+	while (true) {
+		usleep(TICK_MS * 1000);
+		int err = pthread_mutex_lock(&timers->mutex);
+		assert(err == 0);
+		timer_wheel_advance(&timers->wheel, current_tick(), waiter_expire, timers);
+		err = pthread_mutex_unlock(&timers->mutex);
+		assert(err == 0);
+	}
+	return NULL;
+}
+
+WaiterTimers* waiter_timers_new(Lobby* lobby, Config* config) {
+	WaiterTimers* timers = malloc(sizeof(WaiterTimers));
+	assert(timers != NULL);
+	*timers = (WaiterTimers){
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.waiters_len = fd_table_len(),
+		.lobby = lobby,
+		.config = config,
+	};
+	timers->waiters = calloc(timers->waiters_len, sizeof(Waiter*));
+	assert(timers->waiters != NULL);
+	timer_wheel_init(&timers->wheel);
+
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, waiter_timers_thread, timers);
+	if (err != 0) {
+		log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+		return NULL;
+	}
+	err = pthread_detach(thread);
+	assert(err == 0);
+	return timers;
+}
+
+void waiter_add(WaiterTimers* timers, const char* key, int sock_fd) {
+	if (sock_fd >= timers->waiters_len) {
+		return;
+	}
+	Waiter* waiter = pool_alloc(PoolWaiter);
+	*waiter = (Waiter){
+		.timer = { .prev = NULL, .next = NULL, },
+		.sock_fd = sock_fd,
+		.key = {0},
+	};
+	strncpy(waiter->key, key, KEY_LEN);
+
+	int err = pthread_mutex_lock(&timers->mutex);
+	assert(err == 0);
+	timer_set(&timers->wheel, &waiter->timer, seconds_to_ticks(timers->config->lobby_timeout));
+	timers->waiters[sock_fd] = waiter;
+	err = pthread_mutex_unlock(&timers->mutex);
+	assert(err == 0);
+}
+
+void waiter_cancel(WaiterTimers* timers, int sock_fd) {
+	if (sock_fd >= timers->waiters_len) {
+		return;
+	}
+	int err = pthread_mutex_lock(&timers->mutex);
+	assert(err == 0);
+	Waiter* waiter = timers->waiters[sock_fd];
+	if (waiter != NULL) {
+		timer_cancel(&timers->wheel, &waiter->timer);
+		timers->waiters[sock_fd] = NULL;
+		pool_free(PoolWaiter, waiter);
+	}
+	err = pthread_mutex_unlock(&timers->mutex);
+	assert(err == 0);
+}
+
+#ifdef __linux__
+// answer another process asking for a waiting socket of this one, the socket goes with the answer when it is still here
+void shared_lobby_hand_over(Lobby* lobby, int conn_fd, uint64_t entry) {
+	SharedLobby* shared = lobby->shared;
+	int fd = entry_fd(entry);
+	uint64_t started = 0;
+	uint64_t expected = entry;
+	// a timed out socket was taken back, and an entry of an older generation was never this process
+	bool held = shared_entry_is_own(shared, entry) && fd >= 0 && fd < shared->published_len &&
+		atomic_compare_exchange_strong_explicit(&shared->published[fd], &expected, 0, memory_order_acq_rel, memory_order_relaxed);
+	if (!held) {
+		send(conn_fd, &started, sizeof(started), MSG_NOSIGNAL);
+		return;
+	}
+	lobby_release(lobby);
+	if (metrics.timed && fd < metrics.wait_started_len) {
+		started = metrics.wait_started[fd];
+	}
+
+	struct iovec iov = { .iov_base = &started, .iov_len = sizeof(started) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	ssize_t sent;
+	do {
+		sent = sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+	} while (sent == -1 && errno == EINTR);
+	if (sent != sizeof(started)) {
+		// the asking process died after taking the slot, the player has to come back
+		log_message(LogError, "shared lobby send error: %s (line: %d)", strerror(errno), __LINE__);
+		write_message(fd, "error: server is full");
+	}
+
+	if (shared->timers != NULL) {
+		waiter_cancel(shared->timers, fd);
+	}
+	close(fd);
+	Stats* s = stats();
+	stat_add(&s->lobby_leaves, 1);
+	stat_add(&s->transfers_out, 1);
+}
+
+void* shared_lobby_thread(void* raw_lobby) {
+	Lobby* lobby = raw_lobby;
+	SharedLobby* shared = lobby->shared;
+	while (true) {
+		int conn_fd = accept4(shared->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn_fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				log_message(LogError, "shared lobby accept error: %s (line: %d)", strerror(errno), __LINE__);
+				usleep(TICK_MS * 1000);
+			}
+			continue;
+		}
+		// a process that stops halfway cannot hold the others up
+		struct timeval timeout = { .tv_sec = SHARED_TIMEOUT };
+		setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		uint64_t entry;
+		if (recv(conn_fd, &entry, sizeof(entry), 0) == sizeof(entry)) {
+			shared_lobby_hand_over(lobby, conn_fd, entry);
+		}
+		close(conn_fd);
+	}
+	return NULL;
+}
+#endif
+
+void* wait_thread(void* raw_info) {
+	WaitThreadInfo* info = (WaitThreadInfo*)raw_info;
+	Lobby* lobby = info->lobby;
+
+	if (info->config->handshake_timeout != 0) {
+		struct pollfd fds = { .fd = info->sock_fd, .events = POLLIN };
+		int polled = poll(&fds, 1, info->config->handshake_timeout * 1000);
+		if (polled == 0) {
+			log_message(LogInfo, "handshake timeout");
+			write_message(info->sock_fd, "error: handshake timeout");
+			close(info->sock_fd);
+			pool_free(PoolWaitThreadInfo, raw_info);
+			return NULL;
+		}
+	}
+
+	char buf[1024] = {0};
+	ssize_t readed = read(info->sock_fd, buf, sizeof(buf) - 1);
+	if (readed == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	}
+	if (cluster_redirect(buf, info->sock_fd) || watch_unsupported(buf, info->sock_fd)) {
+		close(info->sock_fd);
+	} else if (string_has_prefix(buf, WATCH_PREFIX)) {
+		char* key = buf + strlen(WATCH_PREFIX);
+		Game* game = NULL;
+		if (is_valid_key(key) && !streq(key, MATCH_KEY)) {
+			game = game_watch(key);
+		}
+		if (game != NULL) {
+			log_message(LogInfo, "a spectator joined key: `%s`", key);
+			spectate(info->sock_fd, game);
+		} else {
+			write_message(info->sock_fd, "error: no game to watch");
+			close(info->sock_fd);
+		}
+	} else if (is_valid_key(buf)) {
+		// armed before joining, a pairing may take the socket and cancel it right away
+		if (info->timers != NULL) {
+			waiter_add(info->timers, buf, info->sock_fd);
+		}
+		int wait_sock_fd;
+		LobbyResult joined = lobby_join(lobby, buf, info->sock_fd, &wait_sock_fd);
+		if (joined == LobbyFull) {
+			if (info->timers != NULL) {
+				waiter_cancel(info->timers, info->sock_fd);
+			}
+			lobby_reject(lobby, buf, info->sock_fd);
+			close(info->sock_fd);
+		} else if (joined == LobbyPaired) {
+			if (info->timers != NULL) {
+				waiter_cancel(info->timers, info->sock_fd);
+				waiter_cancel(info->timers, wait_sock_fd);
+			}
+			WorkThreadInfo* work_info = pool_alloc(PoolWorkThreadInfo);
+			*work_info = (WorkThreadInfo){
+				.sock1_fd = wait_sock_fd,
+				.sock2_fd = info->sock_fd,
+				.config = info->config,
+				.game = NULL,
+			};
+			if (game_table.games != NULL) {
+				work_info->game = game_new(buf);
+			}
+
+			pthread_t thread;
+			int err = pthread_create(&thread, NULL, work_thread, work_info);
+			if (err != 0) {
+				log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+				stat_add(&stats()->rejected_fds, 1);
+				write_message(wait_sock_fd, "error: server is full");
+				write_message(info->sock_fd, "error: server is full");
+				close(wait_sock_fd);
+				close(info->sock_fd);
+				if (work_info->game != NULL) {
+					game_end(work_info->game);
+				}
+				stat_add(&stats()->games_ended, 1);
+				pool_free(PoolWorkThreadInfo, work_info);
+			} else {
+				err = pthread_detach(thread);
+				if (err != 0) {
+					log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+				}
+			}
+		}
+	} else {
+		log_message(LogInfo, "invalid key format");
+		stat_add(&stats()->invalid_keys, 1);
+		write_message(info->sock_fd, "error: invalid connection");
+		close(info->sock_fd);
+	}
+
+	pool_free(PoolWaitThreadInfo, raw_info);
+	return NULL;
+}
+
+#ifdef __linux__
+typedef enum ConnState {
+	ConnHandshake = 0,
+	ConnWaiting,
+	ConnPaired,
+} ConnState;
+
+typedef struct Conn {
+	int fd;
+	ConnState state;
+	// 0 for the first player of a pair and 1 for the second
+	int player;
+	// the deadline of the current state, for a pair it is only armed on the first connection
+	Timer timer;
+	// tick of the last relayed message, checked lazily when the idle deadline expires
+	uint64_t last_active;
+	struct Reactor* reactor;
+	struct Conn* peer;
+	// link for the closed list of a reactor, or for the inbox of the reactor it is handed to
+	struct Conn* next;
+	// io_uring engine only: requests in flight, the connection is freed once it is closing and none are left
+	int pending;
+	bool closing;
+	size_t handshake_len;
+	char handshake[1024];
+	// bytes read from this connection that its peer has not taken yet (epoll mode)
+	Relay relay;
+	// authoritative mode: the state of the game, only the connection of the first player uses it
+	Referee referee;
+	// io_uring engine only: received buffers queued to be sent to this connection, linked by `send_next`,
+	// only the head is in flight so the messages keep their order
+	int32_t send_head;
+	int32_t send_tail;
+	uint32_t send_count;
+	uint32_t send_offset;
+	bool recv_armed;
+	// the peer fell behind, the recv of this connection is cancelled until the peer catches up
+	bool stalled;
+} Conn;
+
+typedef struct Reactor {
+	pthread_t thread;
+	int epoll_fd;
+	int listen_fd;
+	int event_fd;
+	Lobby* lobby;
+	Config* config;
+	TimerWheel wheel;
+	// when the current batch of events was returned, relay latencies are measured from it
+	uint64_t batch_started;
+	// indexed by fd and shared by all reactors, so a paired key can be turned back into its connection
+	Conn** conns;
+	size_t conns_len;
+	// connections closed during an epoll batch are freed after the batch
+	Conn* closed;
+	// connections handed over by other reactors to be paired with one waiting here
+	Conn* inbox;
+	pthread_mutex_t inbox_mutex;
+} Reactor;
+
+// the running reactors, so SIGUSR2 can stop them to hand their sockets over to a new process
+typedef struct ReactorSet {
+	Reactor* _Atomic reactors;
+	size_t count;
+	// every reactor leaves its loop once it sees this after a batch
+	_Atomic bool stopping;
+} ReactorSet;
+
+ReactorSet reactor_set = {
+	.reactors = NULL,
+	.count = 0,
+	.stopping = false,
+};
+
+Conn* reactor_add_conn(Reactor* reactor, int sock_fd) {
+	if (sock_fd >= reactor->conns_len) {
+		log_message(LogError, "fd %d is over the connection table size %lu (line: %d)", sock_fd, reactor->conns_len, __LINE__);
+		close(sock_fd);
+		return NULL;
+	}
+
+	Conn* conn = pool_alloc(PoolConn);
+	*conn = (Conn){
+		.fd = sock_fd,
+		.state = ConnHandshake,
+		.reactor = reactor,
+		.peer = NULL,
+		.next = NULL,
+		.handshake_len = 0,
+	};
+	relay_init(&conn->relay);
+
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.ptr = conn,
+	};
+	int err = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+	if (err == -1) {
+		log_message(LogError, "epoll_ctl error: %s (line: %d)", strerror(errno), __LINE__);
+		close(sock_fd);
+		pool_free(PoolConn, conn);
+		return NULL;
+	}
+	reactor->conns[sock_fd] = conn;
+	timer_set(&reactor->wheel, &conn->timer, seconds_to_ticks(reactor->config->handshake_timeout));
+	return conn;
+}
+
+void reactor_close_conn(Reactor* reactor, Conn* conn) {
+	timer_cancel(&reactor->wheel, &conn->timer);
+	reactor->conns[conn->fd] = NULL;
+	close(conn->fd);
+	conn->fd = -1;
+	conn->next = reactor->closed;
+	reactor->closed = conn;
+}
+
+void reactor_free_closed(Reactor* reactor) {
+	while (reactor->closed != NULL) {
+		Conn* conn = reactor->closed;
+		reactor->closed = conn->next;
+		pool_free(PoolConn, conn);
+	}
+}
+
+void reactor_end_game(Reactor* reactor, Conn* conn) {
+	stat_add(&stats()->games_ended, 1);
+	Conn* peer = conn->peer;
+	reactor_close_conn(reactor, conn);
+	reactor_close_conn(reactor, peer);
+}
+
+// write the bytes queued on `conn` to its peer, returns false when the game ended
+bool reactor_flush(Reactor* reactor, Conn* conn) {
+	ssize_t written = relay_drain(&conn->relay, conn->peer->fd);
+	if (written == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		reactor_end_game(reactor, conn);
+		return false;
+	}
+	stats_flushed(written);
+	return true;
+}
+
+// forward everything readable on `conn` to its peer, returns false when the game ended
+bool reactor_relay(Reactor* reactor, Conn* conn) {
+	while (true) {
+		if (conn->relay.len == RELAY_LEN) {
+			// the peer fell behind: the rest stays in the socket until its EPOLLOUT drains the queue
+			return true;
+		}
+		ssize_t readed = relay_fill(&conn->relay, conn->fd);
+		if (readed == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+			reactor_end_game(reactor, conn);
+			return false;
+		} else if (readed == 0) {
+			log_message(LogDebug, "a socket ended");
+			reactor_end_game(reactor, conn);
+			return false;
+		}
+		conn->last_active = reactor->wheel.now;
+		if (reactor->config->authoritative) {
+			Referee* referee = conn->player == 0 ? &conn->referee : &conn->peer->referee;
+			readed -= referee_filter(referee, conn->player, &conn->relay, readed);
+		}
+		stats_relayed(conn->player, readed, conn->relay.len == RELAY_LEN);
+
+		if (!reactor_flush(reactor, conn)) {
+			return false;
+		}
+		stats_relay_latency(reactor->batch_started);
+	}
+}
+
+// make a game of two connections, only the first one carries the idle deadline
+void reactor_link(Reactor* reactor, Conn* conn1, Conn* conn2) {
+	conn1->state = ConnPaired;
+	conn1->peer = conn2;
+	conn1->player = 0;
+	conn2->state = ConnPaired;
+	conn2->peer = conn1;
+	conn2->player = 1;
+	conn1->last_active = reactor->wheel.now;
+	conn2->last_active = reactor->wheel.now;
+	referee_init(&conn1->referee);
+	timer_cancel(&reactor->wheel, &conn2->timer);
+	timer_set(&reactor->wheel, &conn1->timer, seconds_to_ticks(reactor->config->idle_timeout));
+}
+
+void reactor_pair(Reactor* reactor, Conn* conn1, Conn* conn2) {
+	reactor_link(reactor, conn1, conn2);
+
+	write_message(conn1->fd, "CONNECTED AS 1");
+	write_message(conn2->fd, "CONNECTED AS 2");
+
+	// edge-triggered: anything that arrived before pairing will not be reported again,
+	// this also ends the game right away if the waiting socket hung up during a hand over
+	if (reactor_relay(reactor, conn1)) {
+		reactor_relay(reactor, conn2);
+	}
+}
+
+// move `conn` to the reactor owning `waiting`, so the whole game stays on one thread
+void reactor_hand_over(Reactor* reactor, Conn* conn, Conn* waiting) {
+	int err = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	if (err == -1) {
+		log_message(LogError, "epoll_ctl error: %s (line: %d)", strerror(errno), __LINE__);
+	}
+	timer_cancel(&reactor->wheel, &conn->timer);
+	Reactor* target = waiting->reactor;
+	conn->reactor = target;
+	conn->peer = waiting;
+
+	err = pthread_mutex_lock(&target->inbox_mutex);
+	assert(err == 0);
+	conn->next = target->inbox;
+	target->inbox = conn;
+	err = pthread_mutex_unlock(&target->inbox_mutex);
+	assert(err == 0);
+
+	uint64_t one = 1;
+	ssize_t written = write(target->event_fd, &one, sizeof(one));
+	if (written != sizeof(one)) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	}
+}
+
+void reactor_drain_inbox(Reactor* reactor) {
+	uint64_t count;
+	ssize_t readed = read(reactor->event_fd, &count, sizeof(count));
+	if (readed == -1 && errno != EAGAIN) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+	}
+
+	int err = pthread_mutex_lock(&reactor->inbox_mutex);
+	assert(err == 0);
+	Conn* inbox = reactor->inbox;
+	reactor->inbox = NULL;
+	err = pthread_mutex_unlock(&reactor->inbox_mutex);
+	assert(err == 0);
+
+	while (inbox != NULL) {
+		Conn* conn = inbox;
+		inbox = conn->next;
+		conn->next = NULL;
+
+		struct epoll_event event = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.ptr = conn,
+		};
+		err = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+		if (err == -1) {
+			log_message(LogError, "epoll_ctl error: %s (line: %d)", strerror(errno), __LINE__);
+			conn->state = ConnPaired;
+			reactor_end_game(reactor, conn);
+			continue;
+		}
+		reactor_pair(reactor, conn->peer, conn);
+	}
+}
+
+// pair `conn` with the socket waiting on its key, or make it wait
+void reactor_join(Reactor* reactor, Conn* conn) {
+	int wait_sock_fd;
+	LobbyResult joined = lobby_join(reactor->lobby, conn->handshake, conn->fd, &wait_sock_fd);
+	if (joined == LobbyFull) {
+		lobby_reject(reactor->lobby, conn->handshake, conn->fd);
+		reactor_close_conn(reactor, conn);
+	} else if (joined == LobbyPaired) {
+		Conn* waiting = reactor->conns[wait_sock_fd];
+		if (waiting->reactor == reactor) {
+			reactor_pair(reactor, waiting, conn);
+		} else {
+			log_message(LogInfo, "handing over key `%s` to another reactor", conn->handshake);
+			reactor_hand_over(reactor, conn, waiting);
+		}
+	} else {
+		conn->state = ConnWaiting;
+		timer_set(&reactor->wheel, &conn->timer, seconds_to_ticks(reactor->config->lobby_timeout));
+	}
+}
+
+void reactor_handshake(Reactor* reactor, Conn* conn) {
+	bool ended = false;
+	while (conn->handshake_len < sizeof(conn->handshake) - 1) {
+		ssize_t readed = read(conn->fd, conn->handshake + conn->handshake_len, sizeof(conn->handshake) - 1 - conn->handshake_len);
+		if (readed == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+			ended = true;
+			break;
+		} else if (readed == 0) {
+			ended = true;
+			break;
+		}
+		conn->handshake_len += readed;
+	}
+	if (conn->handshake_len == 0 && !ended) {
+		return;
+	}
+	conn->handshake[conn->handshake_len] = '\0';
+
+	if (cluster_redirect(conn->handshake, conn->fd) || watch_unsupported(conn->handshake, conn->fd)) {
+		reactor_close_conn(reactor, conn);
+	} else if (is_valid_key(conn->handshake)) {
+		reactor_join(reactor, conn);
+	} else {
+		log_message(LogInfo, "invalid key format");
+		stat_add(&stats()->invalid_keys, 1);
+		write_message(conn->fd, "error: invalid connection");
+		reactor_close_conn(reactor, conn);
+	}
+}
+
+int reactor_accept(Reactor* reactor) {
+	while (true) {
+		int accepted_fd = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (accepted_fd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			// edge-triggered: a connection that could not be taken is tried again with the next one arriving
+			AcceptRecovery recovery = accept_recover(reactor->listen_fd, errno, 0);
+			if (recovery == AcceptFailed) {
+				return errno;
+			} else if (recovery == AcceptIdle) {
+				return 0;
+			}
+			continue;
+		}
+		log_message(LogDebug, "a new connection");
+		if (!admission_allow(accepted_fd)) {
+			close(accepted_fd);
+			continue;
+		}
+		reactor_add_conn(reactor, accepted_fd);
+	}
+}
+
+void reactor_expire(void* raw_reactor, Timer* timer) {
+	Reactor* reactor = raw_reactor;
+	Conn* conn = (Conn*)((char*)timer - offsetof(Conn, timer));
+	switch (conn->state) {
+		case ConnHandshake:
+			log_message(LogInfo, "handshake timeout");
+			write_message(conn->fd, "error: handshake timeout");
+			reactor_close_conn(reactor, conn);
+			break;
+		case ConnWaiting:
+			// when the entry is gone another reactor is handing its player over, the pairing re-arms the timer
+			if (lobby_remove(reactor->lobby, conn->handshake, conn->fd)) {
+				log_message(LogInfo, "lobby timeout for key: `%s`", conn->handshake);
+				write_message(conn->fd, "error: lobby timeout");
+				reactor_close_conn(reactor, conn);
+			}
+			break;
+		case ConnPaired: {
+			uint64_t last_active = conn->last_active;
+			if (conn->peer->last_active > last_active) {
+				last_active = conn->peer->last_active;
+			}
+			uint64_t deadline = last_active + seconds_to_ticks(reactor->config->idle_timeout);
+			if (deadline > reactor->wheel.now) {
+				timer_set(&reactor->wheel, timer, deadline - reactor->wheel.now);
+			} else {
+				log_message(LogInfo, "idle timeout");
+				write_message(conn->fd, "error: idle timeout");
+				write_message(conn->peer->fd, "error: idle timeout");
+				reactor_end_game(reactor, conn);
+			}
+			break;
+		}
+	}
+}
+
+int reactor_init(Reactor* reactor, int listen_fd, Lobby* lobby, Config* config, Conn** conns, size_t conns_len) {
+	*reactor = (Reactor){
+		.epoll_fd = epoll_create1(EPOLL_CLOEXEC),
+		.listen_fd = listen_fd,
+		.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+		.lobby = lobby,
+		.config = config,
+		.conns = conns,
+		.conns_len = conns_len,
+		.closed = NULL,
+		.inbox = NULL,
+		.inbox_mutex = PTHREAD_MUTEX_INITIALIZER,
+	};
+	timer_wheel_init(&reactor->wheel);
+	if (reactor->epoll_fd == -1 || reactor->event_fd == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+
+	int flags = fcntl(listen_fd, F_GETFL);
+	if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+
+	// the listening socket is registered with a NULL pointer and the event fd with the reactor,
+	// to tell them apart from connections
+	struct epoll_event listen_event = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = NULL,
+	};
+	int err = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+	if (err == -1) {
+		log_message(LogError, "epoll_ctl error: %s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+	struct epoll_event inbox_event = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = reactor,
+	};
+	err = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &inbox_event);
+	if (err == -1) {
+		log_message(LogError, "epoll_ctl error: %s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+	return 0;
+}
+
+int reactor_run(Reactor* reactor) {
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		int timeout = -1;
+		if (reactor->wheel.len > 0) {
+			timeout = TICK_MS;
+		}
+		int polled = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+		if (polled == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_message(LogError, "error on epoll_wait %s (line: %d)", strerror(errno), __LINE__);
+			return errno;
+		}
+		// deadlines are handled first so that a state change in this batch is not expired against an old tick
+		timer_wheel_advance(&reactor->wheel, current_tick(), reactor_expire, reactor);
+		if (metrics.timed) {
+			reactor->batch_started = now_ns();
+		}
+
+		for (int i = 0; i < polled; i++) {
+			void* ptr = events[i].data.ptr;
+			uint32_t revents = events[i].events;
+			if (ptr == NULL) {
+				int err = reactor_accept(reactor);
+				if (err != 0) {
+					return err;
+				}
+				continue;
+			} else if (ptr == reactor) {
+				reactor_drain_inbox(reactor);
+				continue;
+			}
+
+			Conn* conn = ptr;
+			// the connection was closed earlier in this batch
+			if (conn->fd == -1) {
+				continue;
+			}
+
+			switch (conn->state) {
+				case ConnHandshake:
+					if (revents & (EPOLLERR | EPOLLHUP)) {
+						reactor_close_conn(reactor, conn);
+					} else if (revents & (EPOLLIN | EPOLLRDHUP)) {
+						reactor_handshake(reactor, conn);
+					}
+					break;
+				case ConnWaiting:
+					// the socket is left unread until paired, only a hang up is handled here
+					if (revents & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+						log_message(LogInfo, "a waiting socket ended");
+						// when the entry is gone another reactor is handing its player over,
+						// the pairing will then see the hang up and end the game
+						if (lobby_remove(reactor->lobby, conn->handshake, conn->fd)) {
+							reactor_close_conn(reactor, conn);
+						}
+					}
+					break;
+				case ConnPaired: {
+					if (revents & (EPOLLERR | EPOLLHUP)) {
+						log_message(LogDebug, "a socket ended");
+						reactor_end_game(reactor, conn);
+						break;
+					}
+					Conn* peer = conn->peer;
+					if ((revents & EPOLLOUT) && relay_ready(&peer->relay) > 0) {
+						bool stalled = peer->relay.len == RELAY_LEN;
+						if (!reactor_flush(reactor, peer)) {
+							break;
+						}
+						// edge-triggered: the peer is not reported again for what it sent while stalled
+						if (stalled && !reactor_relay(reactor, peer)) {
+							break;
+						}
+					}
+					if (revents & (EPOLLIN | EPOLLRDHUP)) {
+						reactor_relay(reactor, conn);
+					}
+					break;
+				}
+			}
+		}
+		reactor_free_closed(reactor);
+		if (atomic_load_explicit(&reactor_set.stopping, memory_order_acquire)) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+// a reactor only returns without an error when it was stopped for a handoff
+void* reactor_thread(void* raw_reactor) {
+	int err = reactor_run(raw_reactor);
+	if (err != 0) {
+		exit(err);
+	}
+	return NULL;
+}
+
+// the fd-indexed connection table, sized so every fd the process can open fits
+Conn** conn_table(size_t* conns_len) {
+	*conns_len = fd_table_len();
+	Conn** conns = calloc(*conns_len, sizeof(Conn*));
+	assert(conns != NULL);
+	return conns;
+}
+
+// live handoff: SIGUSR2 stops the reactors, the binary on disk is executed again with the same arguments
+// and every socket is passed to it over a socket pair as SCM_RIGHTS, players keep their connections
+
+typedef enum HandoffKind {
+	HandoffListen = 0,
+	HandoffMetrics,
+	// the listening sockets are taken before the reactors are set up, the connections after
+	HandoffListenEnd,
+	HandoffHandshake,
+	HandoffWaiting,
+	HandoffPaired,
+	HandoffEnd,
+} HandoffKind;
+
+// one message on the handoff socket, the sockets it describes travel with it
+typedef struct HandoffRecord {
+	HandoffKind kind;
+	uint32_t handshake_len;
+	char handshake[1024];
+	// for a pair: the bytes each player sent that the other has not taken yet
+	uint32_t relay_len[2];
+	uint32_t relay_held[2];
+	char relay[2][RELAY_LEN];
+	Referee referee;
+} HandoffRecord;
+
+void reactors_stop(void) {
+	Reactor* reactors = atomic_load_explicit(&reactor_set.reactors, memory_order_acquire);
+	if (reactors == NULL) {
+		log_message(LogError, "a handoff needs the epoll reactors (line: %d)", __LINE__);
+		return;
+	}
+	if (atomic_exchange_explicit(&reactor_set.stopping, true, memory_order_acq_rel)) {
+		return;
+	}
+	log_message(LogInfo, "stopping the reactors for a handoff");
+	for (size_t i = 0; i < reactor_set.count; i++) {
+		uint64_t one = 1;
+		ssize_t written = write(reactors[i].event_fd, &one, sizeof(one));
+		if (written != sizeof(one)) {
+			log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		}
+	}
+}
+
+bool handoff_send_record(int sock_fd, HandoffRecord* record, int* fds, size_t fds_len) {
+	struct iovec iov = { .iov_base = record, .iov_len = sizeof(*record) };
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	if (fds_len > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(fds_len * sizeof(int));
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds_len * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fds_len * sizeof(int));
+	}
+
+	ssize_t sent;
+	do {
+		sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+	} while (sent == -1 && errno == EINTR);
+	if (sent != sizeof(*record)) {
+		log_message(LogError, "handoff send error: %s (line: %d)", strerror(errno), __LINE__);
+		return false;
+	}
+	return true;
+}
+
+// returns how many sockets came with the record, or -1 when the handoff broke off
+ssize_t handoff_receive_record(int sock_fd, HandoffRecord* record, int fds[2]) {
+	struct iovec iov = { .iov_base = record, .iov_len = sizeof(*record) };
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t readed;
+	do {
+		readed = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (readed == -1 && errno == EINTR);
+	if (readed == -1) {
+		log_message(LogError, "handoff receive error: %s (line: %d)", strerror(errno), __LINE__);
+		return -1;
+	} else if (readed != sizeof(*record)) {
+		log_message(LogError, "the handoff ended early (line: %d)", __LINE__);
+		return -1;
+	}
+
+	size_t fds_len = 0;
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		fds_len = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), fds_len * sizeof(int));
+	}
+	return fds_len;
+}
+
+void handoff_copy_relay(Relay* relay, char* dst, uint32_t* len, uint32_t* held) {
+	size_t first = RELAY_LEN - relay->head;
+	if (first > relay->len) {
+		first = relay->len;
+	}
+	memcpy(dst, relay->buf + relay->head, first);
+	memcpy(dst + first, relay->buf, relay->len - first);
+	*len = relay->len;
+	*held = relay->held;
+}
+
+// runs once every reactor stopped, only returns when the new process did not take over
+void handoff_send(Reactor* reactors, size_t count, Config* config) {
+	int pair[2];
+	int err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair);
+	if (err == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return;
+	}
+
+	// the same arguments, with the handoff socket in place of the one this process may have been given
+	size_t argc = 0;
+	while (config->argv[argc] != NULL) {
+		argc += 1;
+	}
+	char** args = malloc((argc + 3) * sizeof(char*));
+	assert(args != NULL);
+	size_t args_len = 0;
+	for (size_t i = 0; i < argc; i++) {
+		if (streq(config->argv[i], "--handoff-fd") && i + 1 < argc) {
+			i += 1;
+			continue;
+		}
+		args[args_len++] = config->argv[i];
+	}
+	char fd_str[16];
+	snprintf(fd_str, sizeof(fd_str), "%d", pair[1]);
+	args[args_len++] = "--handoff-fd";
+	args[args_len++] = fd_str;
+	args[args_len] = NULL;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		fcntl(pair[1], F_SETFD, 0);
+		execvp(args[0], args);
+		_exit(127);
+	}
+	free(args);
+	close(pair[1]);
+	if (pid == -1) {
+		log_message(LogError, "fork error: %s (line: %d)", strerror(errno), __LINE__);
+		close(pair[0]);
+		return;
+	}
+
+	HandoffRecord* record = calloc(1, sizeof(HandoffRecord));
+	assert(record != NULL);
+	bool sent = true;
+	for (size_t i = 0; i < count && sent; i++) {
+		record->kind = HandoffListen;
+		sent = handoff_send_record(pair[0], record, &reactors[i].listen_fd, 1);
+	}
+	if (sent && metrics.listen_fd != -1) {
+		record->kind = HandoffMetrics;
+		sent = handoff_send_record(pair[0], record, &metrics.listen_fd, 1);
+	}
+	if (sent) {
+		record->kind = HandoffListenEnd;
+		sent = handoff_send_record(pair[0], record, NULL, 0);
+	}
+
+	size_t games = 0;
+	size_t waiting = 0;
+	Conn** conns = reactors[0].conns;
+	for (size_t fd = 0; fd < reactors[0].conns_len && sent; fd++) {
+		Conn* conn = conns[fd];
+		if (conn == NULL) {
+			continue;
+		}
+		record->handshake_len = conn->handshake_len;
+		memcpy(record->handshake, conn->handshake, conn->handshake_len);
+		switch (conn->state) {
+			case ConnHandshake:
+				record->kind = HandoffHandshake;
+				sent = handoff_send_record(pair[0], record, &conn->fd, 1);
+				break;
+			case ConnWaiting:
+				record->kind = HandoffWaiting;
+				sent = handoff_send_record(pair[0], record, &conn->fd, 1);
+				waiting += 1;
+				break;
+			case ConnPaired: {
+				// a game is sent once, with the first player first
+				if (conn->player != 0) {
+					break;
+				}
+				record->kind = HandoffPaired;
+				handoff_copy_relay(&conn->relay, record->relay[0], &record->relay_len[0], &record->relay_held[0]);
+				handoff_copy_relay(&conn->peer->relay, record->relay[1], &record->relay_len[1], &record->relay_held[1]);
+				record->referee = conn->referee;
+				int fds[2] = { conn->fd, conn->peer->fd };
+				sent = handoff_send_record(pair[0], record, fds, 2);
+				games += 1;
+				break;
+			}
+		}
+	}
+	if (sent) {
+		record->kind = HandoffEnd;
+		sent = handoff_send_record(pair[0], record, NULL, 0);
+	}
+	free(record);
+
+	// the new process answers once it owns every socket, before that this process can still go on
+	char ack;
+	ssize_t readed = sent ? read(pair[0], &ack, 1) : -1;
+	close(pair[0]);
+	if (readed == 1) {
+		log_message(LogInfo, "handed %zu games and %zu waiting sockets over to process %d", games, waiting, pid);
+		exit(0);
+	}
+	log_message(LogError, "process %d did not take over (line: %d)", pid, __LINE__);
+	waitpid(pid, NULL, 0);
+}
+
+// the listening sockets of the previous process, taken in place of binding new ones
+int handoff_receive_listeners(int sock_fd, int** listen_fds, size_t* count) {
+	HandoffRecord* record = malloc(sizeof(HandoffRecord));
+	assert(record != NULL);
+	*listen_fds = NULL;
+	*count = 0;
+	while (true) {
+		int fds[2];
+		ssize_t fds_len = handoff_receive_record(sock_fd, record, fds);
+		if (fds_len == -1) {
+			free(record);
+			return EPROTO;
+		}
+		if (record->kind == HandoffListenEnd) {
+			break;
+		}
+		if (fds_len != 1 || (record->kind != HandoffListen && record->kind != HandoffMetrics)) {
+			log_message(LogError, "unexpected handoff record %d (line: %d)", record->kind, __LINE__);
+			free(record);
+			return EPROTO;
+		}
+		if (record->kind == HandoffMetrics) {
+			metrics.listen_fd = fds[0];
+			continue;
+		}
+		*listen_fds = realloc(*listen_fds, (*count + 1) * sizeof(int));
+		assert(*listen_fds != NULL);
+		(*listen_fds)[*count] = fds[0];
+		*count += 1;
+	}
+	free(record);
+	if (*count == 0) {
+		log_message(LogError, "the handoff had no listening socket (line: %d)", __LINE__);
+		return EPROTO;
+	}
+	return 0;
+}
+
+Conn* handoff_restore_conn(Reactor* reactor, HandoffRecord* record, int fd) {
+	Conn* conn = reactor_add_conn(reactor, fd);
+	if (conn == NULL) {
+		return NULL;
+	}
+	if (record->handshake_len >= sizeof(conn->handshake)) {
+		record->handshake_len = sizeof(conn->handshake) - 1;
+	}
+	memcpy(conn->handshake, record->handshake, record->handshake_len);
+	conn->handshake[record->handshake_len] = '\0';
+	conn->handshake_len = record->handshake_len;
+	return conn;
+}
+
+void handoff_restore_relay(Conn* conn, HandoffRecord* record, size_t player) {
+	uint32_t len = record->relay_len[player];
+	if (len > RELAY_LEN) {
+		len = RELAY_LEN;
+	}
+	memcpy(conn->relay.buf, record->relay[player], len);
+	conn->relay.head = 0;
+	conn->relay.len = len;
+	// an unfinished line is let through as it is when this process does not check the game
+	conn->relay.held = 0;
+	if (conn->reactor->config->authoritative && record->relay_held[player] <= len) {
+		conn->relay.held = record->relay_held[player];
+	}
+	// keeps the queued bytes gauge from going below what gets flushed
+	stat_add(&stats()->relay_queued, len);
+}
+
+// the connections of the previous process, spread over the reactors before they start
+int handoff_restore(Reactor* reactors, size_t count, int sock_fd) {
+	HandoffRecord* record = malloc(sizeof(HandoffRecord));
+	assert(record != NULL);
+	size_t restored = 0;
+	size_t games = 0;
+	int err = 0;
+	while (err == 0) {
+		int fds[2];
+		ssize_t fds_len = handoff_receive_record(sock_fd, record, fds);
+		if (fds_len == -1) {
+			err = EPROTO;
+			break;
+		}
+		if (record->kind == HandoffEnd) {
+			break;
+		}
+		size_t expected = record->kind == HandoffPaired ? 2 : 1;
+		if (fds_len != expected || record->kind < HandoffHandshake) {
+			log_message(LogError, "unexpected handoff record %d with %zd sockets (line: %d)", record->kind, fds_len, __LINE__);
+			for (ssize_t i = 0; i < fds_len; i++) {
+				close(fds[i]);
+			}
+			err = EPROTO;
+			break;
+		}
+
+		Reactor* reactor = &reactors[restored % count];
+		restored += 1;
+		switch (record->kind) {
+			case HandoffHandshake:
+				handoff_restore_conn(reactor, record, fds[0]);
+				break;
+			case HandoffWaiting: {
+				Conn* conn = handoff_restore_conn(reactor, record, fds[0]);
+				if (conn != NULL) {
+					reactor_join(reactor, conn);
+				}
+				break;
+			}
+			case HandoffPaired: {
+				Conn* conn1 = handoff_restore_conn(reactor, record, fds[0]);
+				Conn* conn2 = handoff_restore_conn(reactor, record, fds[1]);
+				if (conn1 == NULL || conn2 == NULL) {
+					if (conn1 != NULL) {
+						reactor_close_conn(reactor, conn1);
+					}
+					if (conn2 != NULL) {
+						reactor_close_conn(reactor, conn2);
+					}
+					break;
+				}
+				reactor_link(reactor, conn1, conn2);
+				stat_add(&stats()->pairs, 1);
+				handoff_restore_relay(conn1, record, 0);
+				handoff_restore_relay(conn2, record, 1);
+				conn1->referee = record->referee;
+				games += 1;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	free(record);
+
+	if (err == 0) {
+		char ack = 1;
+		if (write(sock_fd, &ack, 1) != 1) {
+			log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+			err = errno;
+		} else {
+			log_message(LogInfo, "took over %zu sockets in %zu games", restored + games, games);
+		}
+	}
+	close(sock_fd);
+	return err;
+}
+
+int run_reactors(int* listen_fds, size_t count, Lobby* lobby, Config* config) {
+	size_t conns_len;
+	Conn** conns = conn_table(&conns_len);
+
+	// each reactor carries its own timing wheel, so they are allocated rather than on the stack
+	Reactor* reactors = malloc(count * sizeof(Reactor));
+	assert(reactors != NULL);
+	for (size_t i = 0; i < count; i++) {
+		int err = reactor_init(&reactors[i], listen_fds[i], lobby, config, conns, conns_len);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (config->handoff_fd != -1) {
+		int err = handoff_restore(reactors, count, config->handoff_fd);
+		if (err != 0) {
+			return err;
+		}
+		config->handoff_fd = -1;
+	}
+	log_message(LogInfo, "running %lu epoll reactor(s)", count);
+	reactor_set.count = count;
+	atomic_store_explicit(&reactor_set.reactors, reactors, memory_order_release);
+
+	while (true) {
+		for (size_t i = 1; i < count; i++) {
+			int err = pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]);
+			if (err != 0) {
+				log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+				return err;
+			}
+		}
+		int err = reactor_run(&reactors[0]);
+		if (err != 0) {
+			return err;
+		}
+		for (size_t i = 1; i < count; i++) {
+			err = pthread_join(reactors[i].thread, NULL);
+			assert(err == 0);
+		}
+
+		// with every reactor stopped nothing is handed over anymore, players already handed over are paired first
+		for (size_t i = 0; i < count; i++) {
+			reactor_drain_inbox(&reactors[i]);
+			reactor_free_closed(&reactors[i]);
+		}
+		handoff_send(reactors, count, config);
+		log_message(LogInfo, "resuming the reactors");
+		atomic_store_explicit(&reactor_set.stopping, false, memory_order_release);
+	}
+}
+#endif
+
+#ifdef __linux__
+// io_uring engine: one ring, multishot accept, multishot recv into a provided buffer ring,
+// and a send straight out of the received buffer for the relay
+
+typedef enum UringOp {
+	UringAccept = 0,
+	UringRecv,
+	UringSend,
+	UringTimeout,
+	UringCancel,
+} UringOp;
+
+typedef struct Uring {
+	int ring_fd;
+	int listen_fd;
+	Lobby* lobby;
+	Config* config;
+	Conn** conns;
+	size_t conns_len;
+	TimerWheel wheel;
+	// a single timeout request of one tick is kept in flight while timers are armed
+	bool timeout_armed;
+	// the accept request is not armed until the next tick, after it failed for a lack of fds
+	bool accept_paused;
+	struct __kernel_timespec tick;
+
+	uint32_t* sq_head;
+	uint32_t* sq_tail;
+	uint32_t sq_mask;
+	uint32_t* sq_array;
+	struct io_uring_sqe* sqes;
+	uint32_t sq_entries;
+	uint32_t to_submit;
+
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe* cqes;
+
+	struct io_uring_buf_ring* buf_ring;
+	char* bufs;
+	uint16_t buf_tail;
+	bool recycled;
+	// when each buffer in flight was received, the relay latency is observed once its send completed
+	uint64_t recv_started[URING_BUFFERS];
+	uint64_t batch_started;
+	// the send queues of the connections: the next buffer and the length received into each buffer
+	int32_t send_next[URING_BUFFERS];
+	uint16_t send_len[URING_BUFFERS];
+	// connections whose multishot recv stopped because the buffer ring ran dry
+	Conn* starved;
+} Uring;
+
+// user data of a request: the connection pointer with the operation in its low bits
+// and the provided buffer id of a send in its top 16 bits
+uint64_t uring_user_data(Conn* conn, UringOp op, uint16_t bid) {
+	uintptr_t ptr = (uintptr_t)conn;
+	assert((ptr & 0x7) == 0 && ptr < ((uintptr_t)1 << 48));
+	return ((uint64_t)bid << 48) | ptr | op;
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* uring) {
+	uint32_t head = atomic_load_explicit((_Atomic uint32_t*)uring->sq_head, memory_order_acquire);
+	uint32_t tail = *uring->sq_tail;
+	if (tail - head >= uring->sq_entries) {
+		// the queue is full, hand what is queued to the kernel first
+		int submitted = syscall(__NR_io_uring_enter, uring->ring_fd, uring->to_submit, 0, 0, NULL, 0);
+		if (submitted == -1) {
+			log_message(LogError, "io_uring_enter error: %s (line: %d)", strerror(errno), __LINE__);
+			return NULL;
+		}
+		uring->to_submit -= submitted;
+		return uring_get_sqe(uring);
+	}
+	uint32_t index = tail & uring->sq_mask;
+	struct io_uring_sqe* sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[index] = index;
+	atomic_store_explicit((_Atomic uint32_t*)uring->sq_tail, tail + 1, memory_order_release);
+	uring->to_submit += 1;
+	return sqe;
+}
+
+void uring_recycle_buffer(Uring* uring, uint16_t bid) {
+	uint32_t mask = URING_BUFFERS - 1;
+	struct io_uring_buf* buf = &uring->buf_ring->bufs[uring->buf_tail & mask];
+	buf->addr = (uint64_t)(uintptr_t)(uring->bufs + (size_t)bid * BUFFER_LEN);
+	buf->len = BUFFER_LEN;
+	buf->bid = bid;
+	uring->buf_tail += 1;
+	uring->recycled = true;
+	atomic_store_explicit((_Atomic uint16_t*)&uring->buf_ring->tail, uring->buf_tail, memory_order_release);
+}
+
+void uring_arm_accept(Uring* uring) {
+	struct io_uring_sqe* sqe = uring_get_sqe(uring);
+	assert(sqe != NULL);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = uring->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	// non-blocking so the plain writes of pairing and timeouts cannot stall the ring thread on a full peer
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = uring_user_data(NULL, UringAccept, 0);
+}
+
+void uring_arm_recv(Uring* uring, Conn* conn) {
+	struct io_uring_sqe* sqe = uring_get_sqe(uring);
+	assert(sqe != NULL);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = uring_user_data(conn, UringRecv, 0);
+	conn->pending += 1;
+	conn->recv_armed = true;
+}
+
+// stops the multishot recv of `conn`, it completes with -ECANCELED
+void uring_cancel_recv(Uring* uring, Conn* conn) {
+	struct io_uring_sqe* sqe = uring_get_sqe(uring);
+	assert(sqe != NULL);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = uring_user_data(conn, UringRecv, 0);
+	sqe->user_data = uring_user_data(conn, UringCancel, 0);
+	conn->pending += 1;
+}
+
+// sends what is left of the buffer at the head of the send queue
+void uring_submit_send(Uring* uring, Conn* conn) {
+	int32_t bid = conn->send_head;
+	struct io_uring_sqe* sqe = uring_get_sqe(uring);
+	assert(sqe != NULL);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(uring->bufs + (size_t)bid * BUFFER_LEN + conn->send_offset);
+	sqe->len = uring->send_len[bid] - conn->send_offset;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = uring_user_data(conn, UringSend, bid);
+	conn->pending += 1;
+}
+
+void uring_send(Uring* uring, Conn* conn, uint16_t bid, uint32_t len) {
+	uring->send_len[bid] = len;
+	uring->send_next[bid] = -1;
+	conn->send_count += 1;
+	if (conn->send_head == -1) {
+		conn->send_head = bid;
+		conn->send_tail = bid;
+		conn->send_offset = 0;
+		uring_submit_send(uring, conn);
+	} else {
+		uring->send_next[conn->send_tail] = bid;
+		conn->send_tail = bid;
+	}
+
+	// the receiver fell behind, stop reading from the sender so it cannot take the whole buffer ring
+	Conn* sender = conn->peer;
+	bool full = conn->send_count >= URING_QUEUE_LEN && !sender->stalled;
+	// `conn` receives the message, so it came from the other player
+	stats_relayed(1 - conn->player, len, full);
+	if (full) {
+		sender->stalled = true;
+		if (sender->recv_armed) {
+			uring_cancel_recv(uring, sender);
+		}
+	}
+}
+
+// gives every queued buffer back to the ring, the head is not in flight anymore when this is called
+void uring_drop_sends(Uring* uring, Conn* conn) {
+	for (int32_t bid = conn->send_head; bid != -1; bid = uring->send_next[bid]) {
+		stats_flushed(uring->send_len[bid]);
+		uring_recycle_buffer(uring, bid);
+	}
+	conn->send_head = -1;
+	conn->send_tail = -1;
+	conn->send_count = 0;
+}
+
+void uring_arm_timeout(Uring* uring) {
+	struct io_uring_sqe* sqe = uring_get_sqe(uring);
+	assert(sqe != NULL);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)(uintptr_t)&uring->tick;
+	sqe->len = 1;
+	sqe->user_data = uring_user_data(NULL, UringTimeout, 0);
+	uring->timeout_armed = true;
+}
+
+// the fd stays open until every request on it completed, shutdown() makes them complete
+void uring_close_conn(Uring* uring, Conn* conn) {
+	if (!conn->closing) {
+		conn->closing = true;
+		timer_cancel(&uring->wheel, &conn->timer);
+		uring->conns[conn->fd] = NULL;
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	if (conn->pending == 0) {
+		close(conn->fd);
+		pool_free(PoolConn, conn);
+	}
+}
+
+void uring_end_game(Uring* uring, Conn* conn) {
+	Conn* peer = conn->peer;
+	if (peer != NULL) {
+		stat_add(&stats()->games_ended, 1);
+		peer->peer = NULL;
+		uring_close_conn(uring, peer);
+	}
+	conn->peer = NULL;
+	uring_close_conn(uring, conn);
+}
+
+void uring_pair(Uring* uring, Conn* conn1, Conn* conn2) {
+	conn1->state = ConnPaired;
+	conn1->peer = conn2;
+	conn1->player = 0;
+	conn2->state = ConnPaired;
+	conn2->peer = conn1;
+	conn2->player = 1;
+	conn1->last_active = uring->wheel.now;
+	conn2->last_active = uring->wheel.now;
+	timer_cancel(&uring->wheel, &conn2->timer);
+	timer_set(&uring->wheel, &conn1->timer, seconds_to_ticks(uring->config->idle_timeout));
+
+	write_message(conn1->fd, "CONNECTED AS 1");
+	write_message(conn2->fd, "CONNECTED AS 2");
+
+	// bytes the waiting player sent while in the lobby, they follow the key in the handshake buffer
+	size_t early_len = conn1->handshake_len - (KEY_LEN + 1);
+	if (early_len > 0) {
+		ssize_t written = write(conn2->fd, conn1->handshake + KEY_LEN + 1, early_len);
+		if (written != early_len) {
+			log_message(LogError, "not all readed bytes are written to the write_sock (%ld / %ld) (line: %d)", written, early_len, __LINE__);
+			uring_end_game(uring, conn1);
+		}
+	}
+}
+
+void uring_handle_handshake(Uring* uring, Conn* conn, const char* buf, size_t len) {
+	if (len > sizeof(conn->handshake) - 1) {
+		len = sizeof(conn->handshake) - 1;
+	}
+	memcpy(conn->handshake, buf, len);
+	conn->handshake[len] = '\0';
+	conn->handshake_len = len;
+
+	if (cluster_redirect(conn->handshake, conn->fd) || watch_unsupported(conn->handshake, conn->fd)) {
+		uring_close_conn(uring, conn);
+	} else if (is_valid_key(conn->handshake)) {
+		int wait_sock_fd;
+		LobbyResult joined = lobby_join(uring->lobby, conn->handshake, conn->fd, &wait_sock_fd);
+		if (joined == LobbyFull) {
+			lobby_reject(uring->lobby, conn->handshake, conn->fd);
+			uring_close_conn(uring, conn);
+		} else if (joined == LobbyPaired) {
+			uring_pair(uring, uring->conns[wait_sock_fd], conn);
+		} else {
+			conn->state = ConnWaiting;
+			conn->handshake_len = KEY_LEN + 1;
+			timer_set(&uring->wheel, &conn->timer, seconds_to_ticks(uring->config->lobby_timeout));
+		}
+	} else {
+		log_message(LogInfo, "invalid key format");
+		stat_add(&stats()->invalid_keys, 1);
+		write_message(conn->fd, "error: invalid connection");
+		uring_close_conn(uring, conn);
+	}
+}
+
+void uring_handle_recv(Uring* uring, Conn* conn, struct io_uring_cqe* cqe) {
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	if (!more) {
+		conn->pending -= 1;
+		conn->recv_armed = false;
+	}
+	bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+	uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (conn->closing) {
+		if (has_buffer) {
+			uring_recycle_buffer(uring, bid);
+		}
+		uring_close_conn(uring, conn);
+		return;
+	}
+
+	if (cqe->res == -ECANCELED) {
+		// cancelled because the peer fell behind, unless it already caught up again
+		if (!conn->stalled) {
+			uring_arm_recv(uring, conn);
+		}
+		return;
+	}
+
+	if (cqe->res == -ENOBUFS) {
+		// still counted as pending, the connection stays alive until it is taken off the list
+		conn->pending += 1;
+		conn->next = uring->starved;
+		uring->starved = conn;
+		return;
+	} else if (cqe->res <= 0) {
+		if (cqe->res < 0) {
+			log_message(LogError, "%s (line: %d)", strerror(-cqe->res), __LINE__);
+		}
+		switch (conn->state) {
+			case ConnHandshake:
+				uring_handle_handshake(uring, conn, "", 0);
+				break;
+			case ConnWaiting:
+				log_message(LogInfo, "a waiting socket ended");
+				bool removed = lobby_remove(uring->lobby, conn->handshake, conn->fd);
+				assert(removed);
+				uring_close_conn(uring, conn);
+				break;
+			case ConnPaired:
+				log_message(LogDebug, "a socket ended");
+				uring_end_game(uring, conn);
+				break;
+		}
+		return;
+	}
+
+	// re-armed first: if handling the data closes the connection, the new recv keeps it alive,
+	// a stalled connection is re-armed once its peer caught up
+	if (!more && !conn->stalled) {
+		uring_arm_recv(uring, conn);
+	}
+
+	char* buf = uring->bufs + (size_t)bid * BUFFER_LEN;
+	switch (conn->state) {
+		case ConnHandshake:
+			uring_handle_handshake(uring, conn, buf, cqe->res);
+			uring_recycle_buffer(uring, bid);
+			break;
+		case ConnWaiting:
+			if (conn->handshake_len + cqe->res > sizeof(conn->handshake)) {
+				log_message(LogError, "too many bytes sent while waiting (line: %d)", __LINE__);
+				lobby_remove(uring->lobby, conn->handshake, conn->fd);
+				uring_close_conn(uring, conn);
+			} else {
+				memcpy(conn->handshake + conn->handshake_len, buf, cqe->res);
+				conn->handshake_len += cqe->res;
+			}
+			uring_recycle_buffer(uring, bid);
+			break;
+		case ConnPaired:
+			// the buffer goes back to the ring once the send completed
+			uring->recv_started[bid] = uring->batch_started;
+			uring_send(uring, conn->peer, bid, cqe->res);
+			conn->last_active = uring->wheel.now;
+			break;
+	}
+}
+
+void uring_handle_send(Uring* uring, Conn* conn, struct io_uring_cqe* cqe) {
+	conn->pending -= 1;
+	uint16_t bid = cqe->user_data >> 48;
+	if (conn->closing) {
+		uring_drop_sends(uring, conn);
+		uring_close_conn(uring, conn);
+		return;
+	}
+	if (cqe->res < 0) {
+		log_message(LogError, "%s (line: %d)", strerror(-cqe->res), __LINE__);
+		uring_drop_sends(uring, conn);
+		uring_end_game(uring, conn);
+		return;
+	}
+
+	conn->send_offset += cqe->res;
+	if (conn->send_offset < uring->send_len[bid]) {
+		// a short send, the rest of the buffer goes out before anything queued behind it
+		uring_submit_send(uring, conn);
+		return;
+	}
+	stats_flushed(uring->send_len[bid]);
+	stats_relay_latency(uring->recv_started[bid]);
+	conn->send_head = uring->send_next[bid];
+	conn->send_count -= 1;
+	conn->send_offset = 0;
+	uring_recycle_buffer(uring, bid);
+	if (conn->send_head != -1) {
+		uring_submit_send(uring, conn);
+	} else {
+		conn->send_tail = -1;
+	}
+
+	Conn* sender = conn->peer;
+	if (sender->stalled && conn->send_count <= URING_QUEUE_LEN / 2) {
+		sender->stalled = false;
+		if (!sender->recv_armed) {
+			uring_arm_recv(uring, sender);
+		}
+	}
+}
+
+int uring_handle_accept(Uring* uring, struct io_uring_cqe* cqe) {
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	if (cqe->res < 0) {
+		AcceptRecovery recovery = accept_recover(uring->listen_fd, -cqe->res, 0);
+		if (recovery == AcceptFailed) {
+			return -cqe->res;
+		}
+		// an accept armed again right away would fail the same way, so it waits for the next tick
+		if (!more && recovery == AcceptIdle) {
+			uring->accept_paused = true;
+		} else if (!more) {
+			uring_arm_accept(uring);
+		}
+		return 0;
+	}
+	if (!more) {
+		uring_arm_accept(uring);
+	}
+	int accepted_fd = cqe->res;
+	log_message(LogDebug, "a new connection");
+	if (!admission_allow(accepted_fd)) {
+		close(accepted_fd);
+		return 0;
+	}
+	if (accepted_fd >= uring->conns_len) {
+		log_message(LogError, "fd %d is over the connection table size %lu (line: %d)", accepted_fd, uring->conns_len, __LINE__);
+		close(accepted_fd);
+		return 0;
+	}
+
+	Conn* conn = pool_alloc(PoolConn);
+	*conn = (Conn){
+		.fd = accepted_fd,
+		.state = ConnHandshake,
+		.reactor = NULL,
+		.peer = NULL,
+		.next = NULL,
+		.pending = 0,
+		.closing = false,
+		.handshake_len = 0,
+		.send_head = -1,
+		.send_tail = -1,
+		.send_count = 0,
+		.send_offset = 0,
+		.recv_armed = false,
+		.stalled = false,
+	};
+	uring->conns[accepted_fd] = conn;
+	timer_set(&uring->wheel, &conn->timer, seconds_to_ticks(uring->config->handshake_timeout));
+	uring_arm_recv(uring, conn);
+	return 0;
+}
+
+void uring_expire(void* raw_uring, Timer* timer) {
+	Uring* uring = raw_uring;
+	Conn* conn = (Conn*)((char*)timer - offsetof(Conn, timer));
+	switch (conn->state) {
+		case ConnHandshake:
+			log_message(LogInfo, "handshake timeout");
+			write_message(conn->fd, "error: handshake timeout");
+			uring_close_conn(uring, conn);
+			break;
+		case ConnWaiting:
+			log_message(LogInfo, "lobby timeout for key: `%s`", conn->handshake);
+			lobby_remove(uring->lobby, conn->handshake, conn->fd);
+			write_message(conn->fd, "error: lobby timeout");
+			uring_close_conn(uring, conn);
+			break;
+		case ConnPaired: {
+			uint64_t last_active = conn->last_active;
+			if (conn->peer->last_active > last_active) {
+				last_active = conn->peer->last_active;
+			}
+			uint64_t deadline = last_active + seconds_to_ticks(uring->config->idle_timeout);
+			if (deadline > uring->wheel.now) {
+				timer_set(&uring->wheel, timer, deadline - uring->wheel.now);
+			} else {
+				log_message(LogInfo, "idle timeout");
+				write_message(conn->fd, "error: idle timeout");
+				write_message(conn->peer->fd, "error: idle timeout");
+				uring_end_game(uring, conn);
+			}
+			break;
+		}
+	}
+}
+
+int uring_init(Uring* uring, int listen_fd, Lobby* lobby, Config* config, Conn** conns, size_t conns_len) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER;
+	int ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring_fd == -1) {
+		log_message(LogError, "io_uring_setup error: %s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		log_message(LogError, "io_uring is too old (line: %d)", __LINE__);
+		close(ring_fd);
+		return ENOSYS;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+	char* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	struct io_uring_sqe* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+		log_message(LogError, "mmap error: %s (line: %d)", strerror(errno), __LINE__);
+		close(ring_fd);
+		return errno;
+	}
+
+	size_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+	struct io_uring_buf_ring* buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char* bufs = malloc((size_t)URING_BUFFERS * BUFFER_LEN);
+	if (buf_ring == MAP_FAILED || bufs == NULL) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		close(ring_fd);
+		return errno;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uint64_t)(uintptr_t)buf_ring,
+		.ring_entries = URING_BUFFERS,
+		.bgid = URING_BUFFER_GROUP,
+	};
+	int err = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (err == -1) {
+		log_message(LogError, "io_uring buffer ring error: %s (line: %d)", strerror(errno), __LINE__);
+		close(ring_fd);
+		return errno;
+	}
+
+	*uring = (Uring){
+		.ring_fd = ring_fd,
+		.listen_fd = listen_fd,
+		.lobby = lobby,
+		.config = config,
+		.conns = conns,
+		.conns_len = conns_len,
+		.timeout_armed = false,
+		.accept_paused = false,
+		.tick = { .tv_sec = 0, .tv_nsec = TICK_MS * 1000000, },
+		.sq_head = (uint32_t*)(ring + params.sq_off.head),
+		.sq_tail = (uint32_t*)(ring + params.sq_off.tail),
+		.sq_mask = *(uint32_t*)(ring + params.sq_off.ring_mask),
+		.sq_array = (uint32_t*)(ring + params.sq_off.array),
+		.sqes = sqes,
+		.sq_entries = params.sq_entries,
+		.to_submit = 0,
+		.cq_head = (uint32_t*)(ring + params.cq_off.head),
+		.cq_tail = (uint32_t*)(ring + params.cq_off.tail),
+		.cq_mask = *(uint32_t*)(ring + params.cq_off.ring_mask),
+		.cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes),
+		.buf_ring = buf_ring,
+		.bufs = bufs,
+		.buf_tail = 0,
+		.recycled = false,
+		.starved = NULL,
+	};
+	for (uint16_t bid = 0; bid < URING_BUFFERS; bid++) {
+		uring_recycle_buffer(uring, bid);
+	}
+	timer_wheel_init(&uring->wheel);
+	return 0;
+}
+
+int uring_run(Uring* uring) {
+	uring_arm_accept(uring);
+	while (true) {
+		if ((uring->wheel.len > 0 || uring->accept_paused) && !uring->timeout_armed) {
+			uring_arm_timeout(uring);
+		}
+		// one syscall submits everything queued by the last batch and waits for the next one
+		int submitted = syscall(__NR_io_uring_enter, uring->ring_fd, uring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_message(LogError, "io_uring_enter error: %s (line: %d)", strerror(errno), __LINE__);
+			return errno;
+		}
+		uring->to_submit -= submitted;
+		timer_wheel_advance(&uring->wheel, current_tick(), uring_expire, uring);
+		if (metrics.timed) {
+			uring->batch_started = now_ns();
+		}
+
+		uint32_t head = *uring->cq_head;
+		uint32_t tail = atomic_load_explicit((_Atomic uint32_t*)uring->cq_tail, memory_order_acquire);
+		uring->recycled = false;
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = &uring->cqes[head & uring->cq_mask];
+			Conn* conn = (Conn*)(uintptr_t)(cqe->user_data & (((uint64_t)1 << 48) - 1) & ~(uint64_t)0x7);
+			switch ((UringOp)(cqe->user_data & 0x7)) {
+				case UringAccept: {
+					int err = uring_handle_accept(uring, cqe);
+					if (err != 0) {
+						return err;
+					}
+					break;
+				}
+				case UringRecv:
+					uring_handle_recv(uring, conn, cqe);
+					break;
+				case UringSend:
+					uring_handle_send(uring, conn, cqe);
+					break;
+				case UringTimeout:
+					uring->timeout_armed = false;
+					if (uring->accept_paused) {
+						uring->accept_paused = false;
+						uring_arm_accept(uring);
+					}
+					break;
+				case UringCancel:
+					conn->pending -= 1;
+					if (conn->closing) {
+						uring_close_conn(uring, conn);
+					}
+					break;
+			}
+		}
+		atomic_store_explicit((_Atomic uint32_t*)uring->cq_head, head, memory_order_release);
+
+		if (uring->recycled) {
+			while (uring->starved != NULL) {
+				Conn* conn = uring->starved;
+				uring->starved = conn->next;
+				conn->next = NULL;
+				conn->pending -= 1;
+				if (conn->closing) {
+					uring_close_conn(uring, conn);
+				} else if (!conn->stalled) {
+					uring_arm_recv(uring, conn);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+int run_uring(int listen_fd, Lobby* lobby, Config* config) {
+	size_t conns_len;
+	Conn** conns = conn_table(&conns_len);
+
+	Uring* uring = malloc(sizeof(Uring));
+	assert(uring != NULL);
+	int err = uring_init(uring, listen_fd, lobby, config, conns, conns_len);
+	if (err != 0) {
+		log_message(LogInfo, "io_uring is not available, falling back to epoll");
+		free(uring);
+		free(conns);
+		return run_reactors(&listen_fd, 1, lobby, config);
+	}
+	log_message(LogInfo, "running in io_uring mode");
+	return uring_run(uring);
+}
+#endif
+
+void histogram_sum(uint64_t buckets[HISTOGRAM_LEN + 1], Histogram* histogram) {
+	for (size_t i = 0; i < HISTOGRAM_LEN; i++) {
+		buckets[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+	}
+	buckets[HISTOGRAM_LEN] += atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed);
+}
+
+// `buckets` as summed by `histogram_sum`, with the sum of the observations after the buckets
+void render_histogram(FILE* out, const char* name, const char* help, uint64_t buckets[HISTOGRAM_LEN + 1], const uint64_t* bounds) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	uint64_t count = 0;
+	for (size_t i = 0; i < HISTOGRAM_LEN; i++) {
+		count += buckets[i];
+		if (i < HISTOGRAM_LEN - 1) {
+			fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, bounds[i] / 1e9, count);
+		} else {
+			fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+		}
+	}
+	fprintf(out, "%s_sum %g\n%s_count %lu\n", name, buckets[HISTOGRAM_LEN] / 1e9, name, count);
+}
+
+// sums the stats of every thread, this is the only place that reads them
+void render_metrics(FILE* out) {
+	uint64_t lobby_joins = 0;
+	uint64_t lobby_leaves = 0;
+	uint64_t pairs = 0;
+	uint64_t games_ended = 0;
+	uint64_t invalid_keys = 0;
+	uint64_t relayed_bytes[2] = {0};
+	uint64_t relayed_messages[2] = {0};
+	uint64_t relay_queued = 0;
+	uint64_t relay_flushed = 0;
+	uint64_t relay_stalls = 0;
+	uint64_t spectators_joined = 0;
+	uint64_t spectators_left = 0;
+	uint64_t spectators_dropped = 0;
+	uint64_t messages_dropped = 0;
+	uint64_t rejected[3] = {0};
+	uint64_t accept_errors = 0;
+	uint64_t redirects = 0;
+	uint64_t transfers[2] = {0};
+	uint64_t lobby_wait[HISTOGRAM_LEN + 1] = {0};
+	uint64_t relay_latency[HISTOGRAM_LEN + 1] = {0};
+
+	int err = pthread_mutex_lock(&metrics.mutex);
+	assert(err == 0);
+	for (Stats* s = metrics.stats; s != NULL; s = s->next) {
+		lobby_joins += atomic_load_explicit(&s->lobby_joins, memory_order_relaxed);
+		lobby_leaves += atomic_load_explicit(&s->lobby_leaves, memory_order_relaxed);
+		pairs += atomic_load_explicit(&s->pairs, memory_order_relaxed);
+		games_ended += atomic_load_explicit(&s->games_ended, memory_order_relaxed);
+		invalid_keys += atomic_load_explicit(&s->invalid_keys, memory_order_relaxed);
+		for (size_t i = 0; i < 2; i++) {
+			relayed_bytes[i] += atomic_load_explicit(&s->relayed_bytes[i], memory_order_relaxed);
+			relayed_messages[i] += atomic_load_explicit(&s->relayed_messages[i], memory_order_relaxed);
+		}
+		relay_queued += atomic_load_explicit(&s->relay_queued, memory_order_relaxed);
+		relay_flushed += atomic_load_explicit(&s->relay_flushed, memory_order_relaxed);
+		relay_stalls += atomic_load_explicit(&s->relay_stalls, memory_order_relaxed);
+		spectators_joined += atomic_load_explicit(&s->spectators_joined, memory_order_relaxed);
+		spectators_left += atomic_load_explicit(&s->spectators_left, memory_order_relaxed);
+		spectators_dropped += atomic_load_explicit(&s->spectators_dropped, memory_order_relaxed);
+		messages_dropped += atomic_load_explicit(&s->messages_dropped, memory_order_relaxed);
+		rejected[0] += atomic_load_explicit(&s->rejected_rate, memory_order_relaxed);
+		rejected[1] += atomic_load_explicit(&s->rejected_lobby, memory_order_relaxed);
+		rejected[2] += atomic_load_explicit(&s->rejected_fds, memory_order_relaxed);
+		accept_errors += atomic_load_explicit(&s->accept_errors, memory_order_relaxed);
+		redirects += atomic_load_explicit(&s->redirects, memory_order_relaxed);
+		transfers[0] += atomic_load_explicit(&s->transfers_in, memory_order_relaxed);
+		transfers[1] += atomic_load_explicit(&s->transfers_out, memory_order_relaxed);
+		histogram_sum(lobby_wait, &s->lobby_wait);
+		histogram_sum(relay_latency, &s->relay_latency);
+	}
+	err = pthread_mutex_unlock(&metrics.mutex);
+	assert(err == 0);
+
+	// counters of different threads are read one after another, so a gauge can be briefly off by a few
+	int64_t lobby_size = lobby_joins - lobby_leaves;
+	int64_t active_games = pairs - games_ended;
+	fprintf(out, "# HELP battleship_lobby_size Sockets waiting in the lobby.\n# TYPE battleship_lobby_size gauge\n");
+	fprintf(out, "battleship_lobby_size %ld\n", lobby_size < 0 ? 0 : lobby_size);
+	fprintf(out, "# HELP battleship_active_games Paired games being relayed.\n# TYPE battleship_active_games gauge\n");
+	fprintf(out, "battleship_active_games %ld\n", active_games < 0 ? 0 : active_games);
+	fprintf(out, "# HELP battleship_pairs_total Games paired.\n# TYPE battleship_pairs_total counter\n");
+	fprintf(out, "battleship_pairs_total %lu\n", pairs);
+	fprintf(out, "# HELP battleship_invalid_keys_total Connections rejected for an invalid key.\n# TYPE battleship_invalid_keys_total counter\n");
+	fprintf(out, "battleship_invalid_keys_total %lu\n", invalid_keys);
+	const char* reasons[3] = { "rate", "lobby", "full" };
+	fprintf(out, "# HELP battleship_rejected_total Connections turned away before they could play.\n# TYPE battleship_rejected_total counter\n");
+	for (size_t i = 0; i < 3; i++) {
+		fprintf(out, "battleship_rejected_total{reason=\"%s\"} %lu\n", reasons[i], rejected[i]);
+	}
+	fprintf(out, "# HELP battleship_accept_errors_total Failed accept calls the server carried on after.\n# TYPE battleship_accept_errors_total counter\n");
+	fprintf(out, "battleship_accept_errors_total %lu\n", accept_errors);
+	fprintf(out, "# HELP battleship_redirects_total Keys sent on to the cluster node that owns them.\n# TYPE battleship_redirects_total counter\n");
+	fprintf(out, "battleship_redirects_total %lu\n", redirects);
+	const char* transfer_directions[2] = { "in", "out" };
+	fprintf(out, "# HELP battleship_lobby_transfers_total Waiting sockets moved between the processes of a shared lobby.\n# TYPE battleship_lobby_transfers_total counter\n");
+	for (size_t i = 0; i < 2; i++) {
+		fprintf(out, "battleship_lobby_transfers_total{direction=\"%s\"} %lu\n", transfer_directions[i], transfers[i]);
+	}
+	const char* directions[2] = { "1to2", "2to1" };
+	fprintf(out, "# HELP battleship_relayed_bytes_total Bytes relayed between players.\n# TYPE battleship_relayed_bytes_total counter\n");
+	for (size_t i = 0; i < 2; i++) {
+		fprintf(out, "battleship_relayed_bytes_total{direction=\"%s\"} %lu\n", directions[i], relayed_bytes[i]);
+	}
+	fprintf(out, "# HELP battleship_relayed_messages_total Reads relayed between players.\n# TYPE battleship_relayed_messages_total counter\n");
+	for (size_t i = 0; i < 2; i++) {
+		fprintf(out, "battleship_relayed_messages_total{direction=\"%s\"} %lu\n", directions[i], relayed_messages[i]);
+	}
+	int64_t relay_queue = relay_queued - relay_flushed;
+	fprintf(out, "# HELP battleship_relay_queued_bytes Bytes waiting in relay queues for a slow peer.\n# TYPE battleship_relay_queued_bytes gauge\n");
+	fprintf(out, "battleship_relay_queued_bytes %ld\n", relay_queue < 0 ? 0 : relay_queue);
+	fprintf(out, "# HELP battleship_relay_stalls_total Times a relay queue filled up and reading from its sender paused.\n# TYPE battleship_relay_stalls_total counter\n");
+	fprintf(out, "battleship_relay_stalls_total %lu\n", relay_stalls);
+	int64_t spectators = spectators_joined - spectators_left;
+	fprintf(out, "# HELP battleship_spectators Spectators watching a game.\n# TYPE battleship_spectators gauge\n");
+	fprintf(out, "battleship_spectators %ld\n", spectators < 0 ? 0 : spectators);
+	fprintf(out, "# HELP battleship_spectators_dropped_total Spectators dropped for falling behind the game.\n# TYPE battleship_spectators_dropped_total counter\n");
+	fprintf(out, "battleship_spectators_dropped_total %lu\n", spectators_dropped);
+	fprintf(out, "# HELP battleship_messages_dropped_total Lines dropped by authoritative mode for breaking the rules of the game.\n# TYPE battleship_messages_dropped_total counter\n");
+	fprintf(out, "battleship_messages_dropped_total %lu\n", messages_dropped);
+	render_histogram(out, "battleship_lobby_wait_seconds", "Time a paired socket waited in the lobby.", lobby_wait, lobby_wait_bounds);
+	render_histogram(out, "battleship_relay_latency_seconds", "Time from a message being readable to it being written to the peer.", relay_latency, relay_latency_bounds);
+
+	fprintf(out, "# HELP battleship_pool_in_use Pool objects in use.\n# TYPE battleship_pool_in_use gauge\n");
+	for (size_t kind = 0; kind < POOL_COUNT; kind++) {
+		if (pools[kind].name != NULL) {
+			fprintf(out, "battleship_pool_in_use{pool=\"%s\"} %zu\n", pools[kind].name, atomic_load_explicit(&pools[kind].in_use, memory_order_relaxed));
+		}
+	}
+	fprintf(out, "# HELP battleship_pool_capacity Pool objects carved from the heap.\n# TYPE battleship_pool_capacity gauge\n");
+	for (size_t kind = 0; kind < POOL_COUNT; kind++) {
+		if (pools[kind].name != NULL) {
+			fprintf(out, "battleship_pool_capacity{pool=\"%s\"} %zu\n", pools[kind].name, atomic_load_explicit(&pools[kind].capacity, memory_order_relaxed));
+		}
+	}
+}
+
+// serves one scrape at a time, a plain HTTP/1.0 response is all a Prometheus scraper needs
+void* metrics_thread(void* raw_listen_fd) {
+	int listen_fd = *(int*)raw_listen_fd;
+	while (true) {
+		int accepted_fd = accept(listen_fd, NULL, NULL);
+		if (accepted_fd == -1) {
+			log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+			continue;
+		}
+		// a scraper that never sends its request must not block the next one
+		struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+		setsockopt(accepted_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		char request[1024] = {0};
+		ssize_t readed = read(accepted_fd, request, sizeof(request) - 1);
+		if (readed <= 0) {
+			close(accepted_fd);
+			continue;
+		}
+
+		char* body = NULL;
+		size_t body_len = 0;
+		FILE* out = open_memstream(&body, &body_len);
+		assert(out != NULL);
+		const char* status = "200 OK";
+		if (strncmp(request, "GET /metrics ", strlen("GET /metrics ")) == 0) {
+			render_metrics(out);
+		} else {
+			status = "404 Not Found";
+			fprintf(out, "not found\n");
+		}
+		fclose(out);
+
+		FILE* sock = fdopen(accepted_fd, "w");
+		assert(sock != NULL);
+		fprintf(sock, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", status, body_len);
+		fwrite(body, 1, body_len, sock);
+		fclose(sock);
+		free(body);
+	}
+	return NULL;
+}
+
+// handles the signals blocked in every other thread: SIGUSR1 logs the pool occupancy
+// and SIGUSR2 hands every socket over to a new process
+void* signal_thread(void* raw_signals) {
+	sigset_t* signals = raw_signals;
+	while (true) {
+		int signal;
+		int err = sigwait(signals, &signal);
+		assert(err == 0);
+		if (signal == SIGUSR1) {
+			pool_log_stats();
+		} else if (signal == SIGUSR2) {
+#ifdef __linux__
+			reactors_stop();
+#else
+			log_message(LogError, "a handoff needs the epoll reactors (line: %d)", __LINE__);
+#endif
+		}
+	}
+	return NULL;
+}
+
+int listen_socket(uint16_t port, bool reuse_port) {
+	int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock_fd == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return -1;
+	}
+	// close on exec, a handoff passes the listening sockets on explicitly, set apart since not every system has
+	// SOCK_CLOEXEC
+	if (fcntl(sock_fd, F_SETFD, FD_CLOEXEC) == -1) {
+		log_message(LogError, "fcntl error: %s (line: %d)", strerror(errno), __LINE__);
+		return -1;
+	}
+
+	if (reuse_port) {
+		int one = 1;
+		int err = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+		if (err == -1) {
+			log_message(LogError, "setsockopt error: %s (line: %d)", strerror(errno), __LINE__);
+			return -1;
+		}
+	}
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	int err = bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr));
+	if (err == -1) {
+		log_message(LogError, "bind error: %s (line: %d)", strerror(errno), __LINE__);
+		return -1;
+	}
+
+	err = listen(sock_fd, SOMAXCONN);
+	if (err == -1) {
+		log_message(LogError, "listen error: %s (line: %d)", strerror(errno), __LINE__);
+		return -1;
+	}
+	return sock_fd;
+}
+
+int main(int argc, char** argv) {
+	Config config = {
+		.use_splice = false,
+		.authoritative = false,
+		// off unless asked for: main.c connects before its player types the key, and a player may wait long for a friend
+		.handshake_timeout = 0,
+		.lobby_timeout = 0,
+		.idle_timeout = 0,
+		.argv = argv,
+		.handoff_fd = -1,
+	};
+	bool use_epoll = false;
+	bool use_uring = false;
+	size_t threads = 1;
+	uint16_t metrics_port = 0;
+	uint32_t ip_rate = 0;
+	// no cap unless asked for, the spare fd already keeps the server up when the fds run out
+	uint64_t lobby_cap = 0;
+	const char* peer_file = NULL;
+	const char* node = NULL;
+	const char* shared_lobby = NULL;
+	// blocked before any other thread starts, so only the signal thread takes SIGUSR1 and SIGUSR2
+	static sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	int err = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	assert(err == 0);
+	// a peer that resets while an error message is written to it must not end the process
+	struct sigaction ignore = { .sa_handler = SIG_IGN };
+	err = sigaction(SIGPIPE, &ignore, NULL);
+	assert(err == 0);
+	err = log_start();
+	if (err != 0) {
+		return err;
+	}
+	char* port_str = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (streq(argv[i], "--epoll")) {
+			use_epoll = true;
+		} else if (streq(argv[i], "--io-uring")) {
+			use_uring = true;
+		} else if (streq(argv[i], "--splice")) {
+			config.use_splice = true;
+		} else if (streq(argv[i], "--authoritative")) {
+			config.authoritative = true;
+		} else if (streq(argv[i], "--threads") && i + 1 < argc) {
+			i += 1;
+			uint64_t number;
+			if (!parse_number(argv[i], SIZE_MAX, &number) || number == 0) {
+				log_message(LogError, "the thread count `%s` is not a positive number (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+			threads = number;
+			use_epoll = true;
+		} else if ((streq(argv[i], "--handshake-timeout") || streq(argv[i], "--lobby-timeout") || streq(argv[i], "--idle-timeout")) && i + 1 < argc) {
+			uint32_t* timeout = &config.handshake_timeout;
+			if (streq(argv[i], "--lobby-timeout")) {
+				timeout = &config.lobby_timeout;
+			} else if (streq(argv[i], "--idle-timeout")) {
+				timeout = &config.idle_timeout;
+			}
+			i += 1;
+			uint64_t number;
+			// the thread mode hands the deadline to poll() in milliseconds
+			if (!parse_number(argv[i], INT32_MAX / 1000, &number)) {
+				log_message(LogError, "the timeout `%s` is not a number of seconds (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+			*timeout = number;
+		} else if (streq(argv[i], "--ip-rate") && i + 1 < argc) {
+			i += 1;
+			uint64_t number;
+			if (!parse_number(argv[i], 100000, &number)) {
+				log_message(LogError, "the rate `%s` is not a number of connections per second (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+			ip_rate = number;
+		} else if (streq(argv[i], "--lobby-cap") && i + 1 < argc) {
+			i += 1;
+			if (!parse_number(argv[i], UINT32_MAX, &lobby_cap)) {
+				log_message(LogError, "the lobby cap `%s` is not a number (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+		} else if (streq(argv[i], "--cluster") && i + 1 < argc) {
+			i += 1;
+			peer_file = argv[i];
+		} else if (streq(argv[i], "--node") && i + 1 < argc) {
+			i += 1;
+			node = argv[i];
+		} else if (streq(argv[i], "--shared-lobby") && i + 1 < argc) {
+			i += 1;
+			shared_lobby = argv[i];
+		} else if (streq(argv[i], "--log-level") && i + 1 < argc) {
+			i += 1;
+			if (streq(argv[i], "debug")) {
+				logger.level = LogDebug;
+			} else if (streq(argv[i], "info")) {
+				logger.level = LogInfo;
+			} else if (streq(argv[i], "error")) {
+				logger.level = LogError;
+			} else {
+				log_message(LogError, "the log level `%s` is not one of debug, info or error (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+		} else if (streq(argv[i], "--metrics") && i + 1 < argc) {
+			i += 1;
+			uint64_t number;
+			if (!parse_number(argv[i], UINT16_MAX, &number) || number == 0) {
+				log_message(LogError, "the metrics port `%s` is not a port (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+			metrics_port = number;
+		} else if (streq(argv[i], "--handoff-fd") && i + 1 < argc) {
+			// passed by the previous process when it hands its sockets over
+			i += 1;
+			uint64_t number;
+			if (!parse_number(argv[i], INT32_MAX, &number)) {
+				log_message(LogError, "the handoff fd `%s` is not a number (line: %d)", argv[i], __LINE__);
+				return 1;
+			}
+			config.handoff_fd = number;
+		} else if (port_str == NULL) {
+			port_str = argv[i];
+		} else {
+			port_str = NULL;
+			break;
+		}
+	}
+	if (port_str == NULL) {
+		printf("usage: %s [--epoll] [--threads <n>] [--io-uring] [--splice] [--authoritative]\n"
+			"    [--handshake-timeout <s>] [--lobby-timeout <s>] [--idle-timeout <s>]\n"
+			"    [--ip-rate <connections/s>] [--lobby-cap <sockets>]\n"
+			"    [--cluster <peer file> [--node <host:port>]] [--shared-lobby <file>]\n"
+			"    [--metrics <port>] [--log-level debug|info|error] <port>\n", argv[0]);
+		return 0;
+	}
+	// the referee reads every line out of the relay queue, splice and io_uring hand the bytes on without one
+	if (config.authoritative && (config.use_splice || use_uring)) {
+		log_message(LogError, "authoritative mode needs the thread mode without splice or the epoll reactors (line: %d)", __LINE__);
+		return 1;
+	}
+#ifndef __linux__
+	if (use_epoll) {
+		log_message(LogError, "epoll mode is only available on linux (line: %d)", __LINE__);
+		return 1;
+	}
+	if (use_uring) {
+		log_message(LogError, "io_uring mode is only available on linux (line: %d)", __LINE__);
+		return 1;
+	}
+	if (config.use_splice) {
+		log_message(LogError, "splice is only available on linux (line: %d)", __LINE__);
+		return 1;
+	}
+	if (shared_lobby != NULL) {
+		log_message(LogError, "a shared lobby is only available on linux (line: %d)", __LINE__);
+		return 1;
+	}
+#endif
+	// only work_thread relays through a pipe, the reactors and io_uring would quietly copy
+	if (config.use_splice && (use_epoll || use_uring)) {
+		log_message(LogError, "splice needs the thread mode (line: %d)", __LINE__);
+		return 1;
+	}
+	// io_uring runs a single ring on one listening socket, the sockets of more threads would never be accepted from
+	if (use_uring && threads > 1) {
+		log_message(LogError, "io_uring mode runs on one thread, --threads needs the epoll reactors (line: %d)", __LINE__);
+		return 1;
+	}
+	// only the thread mode leaves a waiting socket to no one, so it can be handed to another process as it is
+	if (shared_lobby != NULL && (use_epoll || use_uring)) {
+		log_message(LogError, "a shared lobby needs the thread mode (line: %d)", __LINE__);
+		return 1;
+	}
+
+	uint16_t port;
+	{
+		char* end;
+		uint64_t tmp_port = strtoul(port_str, &end, 10);
+		if (end == port_str) {
+			log_message(LogError, "the port `%s` is not a number (line: %d)", port_str, __LINE__);
+			return 1;
+		}
+		if (tmp_port > UINT16_MAX) {
+			log_message(LogError, "the port `%s` is too big for a port (line: %d)", port_str, __LINE__);
+			return 1;
+		}
+		port = tmp_port;
+	}
+	if (node != NULL && peer_file == NULL) {
+		log_message(LogError, "--node needs a peer file from --cluster (line: %d)", __LINE__);
+		return 1;
+	}
+	if (peer_file != NULL) {
+		int err = cluster_load(peer_file, node, port);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	int* listen_fds;
+	if (config.handoff_fd != -1) {
+#ifdef __linux__
+		if (!use_epoll || use_uring) {
+			log_message(LogError, "a handoff needs the epoll reactors (line: %d)", __LINE__);
+			return 1;
+		}
+		// one reactor per listening socket of the previous process, so none of their backlogs is dropped
+		size_t count;
+		int err = handoff_receive_listeners(config.handoff_fd, &listen_fds, &count);
+		if (err != 0) {
+			return err;
+		}
+		if (count != threads) {
+			log_message(LogInfo, "running %lu reactor(s) for the handed over listening sockets", count);
+			threads = count;
+		}
+#else
+		log_message(LogError, "a handoff needs the epoll reactors (line: %d)", __LINE__);
+		return 1;
+#endif
+	} else {
+		// every reactor gets its own SO_REUSEPORT socket, so the kernel spreads accepts across them
+		listen_fds = malloc(threads * sizeof(int));
+		assert(listen_fds != NULL);
+		for (size_t i = 0; i < threads; i++) {
+			listen_fds[i] = listen_socket(port, threads > 1);
+			if (listen_fds[i] == -1) {
+				return errno;
+			}
+		}
+	}
+	int sock_fd = listen_fds[0];
+	log_message(LogInfo, "start listening port %d", port);
+
+	Lobby lobby = lobby_new();
+	lobby.cap = lobby_cap;
+#ifdef __linux__
+	if (shared_lobby != NULL) {
+		int err = shared_lobby_open(&lobby, shared_lobby);
+		if (err != 0) {
+			return err;
+		}
+	}
+#endif
+	admission_init(ip_rate);
+	admission.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (admission.spare_fd == -1) {
+		log_message(LogError, "%s (line: %d)", strerror(errno), __LINE__);
+		return errno;
+	}
+
+	pool_init(PoolWaitThreadInfo, "wait_thread_info", sizeof(WaitThreadInfo));
+	pool_init(PoolWorkThreadInfo, "work_thread_info", sizeof(WorkThreadInfo));
+	pool_init(PoolWaiter, "waiter", sizeof(Waiter));
+	pool_init(PoolGame, "game", sizeof(Game));
+	pool_init(PoolSpectator, "spectator", sizeof(Spectator));
+#ifdef __linux__
+	pool_init(PoolConn, "conn", sizeof(Conn));
+#endif
+	{
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, signal_thread, &signals);
+		if (err != 0) {
+			log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+			return err;
+		}
+		err = pthread_detach(thread);
+		assert(err == 0);
+	}
+
+	if (metrics_port == 0 && metrics.listen_fd != -1) {
+		close(metrics.listen_fd);
+		metrics.listen_fd = -1;
+	}
+	if (metrics_port != 0) {
+		if (metrics.listen_fd == -1) {
+			metrics.listen_fd = listen_socket(metrics_port, false);
+			if (metrics.listen_fd == -1) {
+				return errno;
+			}
+		}
+		metrics.wait_started_len = fd_table_len();
+		metrics.wait_started = calloc(metrics.wait_started_len, sizeof(uint64_t));
+		assert(metrics.wait_started != NULL);
+		metrics.timed = true;
+
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, metrics_thread, &metrics.listen_fd);
+		if (err != 0) {
+			log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+			return err;
+		}
+		err = pthread_detach(thread);
+		assert(err == 0);
+		log_message(LogInfo, "serving metrics on port %d", metrics_port);
+	}
+
+#ifdef __linux__
+	if (use_uring) {
+		return run_uring(sock_fd, &lobby, &config);
+	}
+	if (use_epoll) {
+		return run_reactors(listen_fds, threads, &lobby, &config);
+	}
+#endif
+
+	// games are only recorded for spectators when their bytes pass through userspace
+	if (!config.use_splice) {
+		game_table.games = calloc(KEY_SPACE, sizeof(Game*));
+		assert(game_table.games != NULL);
+		int err = spectator_loop_start();
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	WaiterTimers* timers = NULL;
+	if (config.lobby_timeout != 0) {
+		timers = waiter_timers_new(&lobby, &config);
+	}
+#ifdef __linux__
+	if (lobby.shared != NULL) {
+		lobby.shared->timers = timers;
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, shared_lobby_thread, &lobby);
+		if (err != 0) {
+			log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
 			return err;
 		}
 		err = pthread_detach(thread);
+		assert(err == 0);
+	}
+#endif
+
+	while (true) {
+		int accepted_fd = accept(sock_fd, NULL, NULL);
+		if (accepted_fd == -1) {
+			if (accept_recover(sock_fd, errno, TICK_MS) == AcceptFailed) {
+				return errno;
+			}
+			continue;
+		}
+		log_message(LogDebug, "a new connection");
+		if (!admission_allow(accepted_fd)) {
+			close(accepted_fd);
+			continue;
+		}
+
+		WaitThreadInfo* info = pool_alloc(PoolWaitThreadInfo);
+		*info = (WaitThreadInfo){
+			.sock_fd = accepted_fd,
+			.lobby = &lobby,
+			.config = &config,
+			.timers = timers,
+		};
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, wait_thread, info);
+		if (err != 0) {
+			// out of threads is a full server too, the games already running go on
+			log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
+			stat_add(&stats()->rejected_fds, 1);
+			write_message(accepted_fd, "error: server is full");
+			close(accepted_fd);
+			pool_free(PoolWaitThreadInfo, info);
+			continue;
+		}
+		err = pthread_detach(thread);
 		if (err != 0) {
-			fprintf(stderr, "[ERROR] %s (line: %d)\n", strerror(err), __LINE__);
+			log_message(LogError, "%s (line: %d)", strerror(err), __LINE__);
 			return err;
 		}
 	}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# compares the cpu time the server spends per relayed message in thread mode with and without --splice,
+# usage: ./splice_bench.sh [port] [loadgen options...]
+set -e
+
+# a run leaves its port in TIME_WAIT for a while, so the default changes every run and splice takes the next port
+port=${1:-$((20000 + $$ % 20000))}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- --concurrency 100 --shots 200 --duration 10
+ticks=$(getconf CLK_TCK)
+
+for mode in copy splice; do
+	flags=
+	if [ "$mode" = splice ]; then
+		flags=--splice
+		port=$((port + 1))
+	fi
+	./server $flags "$port" >/dev/null 2>&1 &
+	pid=$!
+	sleep 0.5
+	if ! kill -0 "$pid" 2>/dev/null; then
+		echo "[ERROR] the server did not start on port $port" >&2
+		exit 1
+	fi
+	report=$(./loadgen "$@" "$port")
+	# utime and stime of the server, in clock ticks
+	cpu=$(awk '{ print $14 + $15 }' "/proc/$pid/stat")
+	kill "$pid"
+	wait "$pid" 2>/dev/null || true
+	messages=$(echo "$report" | sed -n 's/.* \([0-9]*\) messages (.*/\1/p' | tail -n 1)
+	awk -v mode="$mode" -v cpu="$cpu" -v ticks="$ticks" -v messages="$messages" 'BEGIN {
+		seconds = cpu / ticks
+		per_message = messages == 0 ? 0 : seconds * 1e6 / messages
+		printf "[LOG] %s: %d messages, %.2fs of server cpu, %.2fus per message\n", mode, messages, seconds, per_message
+	}'
+done